@@ -98,8 +98,17 @@ uint32_t wcolor = 0xFF0000;      // 'On' color (starts red)
 #define RGB_MESSAGE 13
 #define WHITE_MESSAGE 12
 
-void WhiteCallback(uint8_t *payload, uint16_t payload_length)
+// payloads are either JSON {"led": [r, g, b]} or binary (ftmq_codec) with an FTMQ_TAG_LED bytes field
+bool parseColor(uint8_t *payload, uint16_t payload_length, uint32_t *rgb)
 {
+  if (FTMQ_codec_is_binary(payload, payload_length)) {
+    FTMQ_codec_field field;
+    if (!FTMQ_codec_find(payload, payload_length, FTMQ_TAG_LED, &field) || field.length < 3)
+      return false;
+    *rgb = ((uint32_t)field.value[0] << 16) | ((uint32_t)field.value[1] << 8) | field.value[2];
+    return true;
+  }
+
   StaticJsonDocument<49> doc;
   // Deserialize the JSON document
   DeserializationError error = deserializeJson(doc, payload, payload_length);
@@ -109,29 +118,23 @@ void WhiteCallback(uint8_t *payload, uint16_t payload_length)
   	// this will fail if enabled because we have redirected serial away from USB/IDE to FT Click
     //Serial.print(F("deserializeJson() failed: "));
     //Serial.println(error.c_str());
-    return;
+    return false;
   }
-  wcolor =  doc["led"][0];
-  wcolor = (wcolor<<8) | (uint8_t)doc["led"][1];
-  wcolor = (wcolor<<8) | (uint8_t)doc["led"][2];
+  *rgb =  doc["led"][0];
+  *rgb = (*rgb<<8) | (uint8_t)doc["led"][1];
+  *rgb = (*rgb<<8) | (uint8_t)doc["led"][2];
+  return true;
+}
+
+void WhiteCallback(uint8_t *payload, uint16_t payload_length)
+{
+  parseColor(payload, payload_length, &wcolor);
 }
 
 
 void RGBCallback(uint8_t *payload, uint16_t payload_length) 
 {
-  StaticJsonDocument<49> doc;
-  // Deserialize the JSON document
-  DeserializationError error = deserializeJson(doc, payload, payload_length);
-
-  // Test if parsing succeeds.
-  if (error) {
-    //Serial.print(F("deserializeJson() failed: "));
-    //Serial.println(error.c_str());
-    return;
-  }
-  color =  doc["led"][0];
-  color = (color<<8) | (uint8_t)doc["led"][1];
-  color = (color<<8) | (uint8_t)doc["led"][2];
+  parseColor(payload, payload_length, &color);
 }
 
 int serial_comm_id = 0;
@@ -40,3 +40,4 @@
 #define CCP_MAX_COMM 1
 #define CCP_COMM_READ_BUFFER_LEN 10
 #define CCP_MAX_RECEIVE_CALLBACKS 1
+#define CCP_MAX_TICK_CALLBACKS 1
@@ -50,6 +50,7 @@ extern "C" {
 #endif
 
 #include "ftmq.h"
+#include "ftmq_codec.h"
 
 #ifdef __cplusplus
 }
@@ -36,4 +36,6 @@
 *
 ****************************************************************************************/
 
+// comment out FTMQ_MAX_SUBSCRIPTIONS to let the FTclick filter the subscriptions (needs ftmq_filter in the FTclick),
+// each subscription then takes 4 bytes of ram instead of 53
 #define FTMQ_MAX_SUBSCRIPTIONS 4
\ No newline at end of file
@@ -64,6 +64,7 @@ class CCP:
     def __init__(self):
         self.comms = []
         self.callbacks = []
+        self.tick_callbacks = []
 
     def register_comm(self,comm):
         '''
@@ -82,6 +83,12 @@ class CCP:
         '''
         self.callbacks.append(dict(queue=r_queue,callback=r_callback))
 
+    def register_tick_callback(self, r_callback):
+        '''
+        Register a function called from every poll_1msec, after the comms are read
+        '''
+        self.tick_callbacks.append(r_callback)
+
     def send_data(self, comm_id, queue, data: bytes):
         '''
         Builds a valid ccp packet from the data argument and queue argument
@@ -109,6 +116,8 @@ class CCP:
                 for b in data:
                     self.parse_byte(b, comm)
                 comm.restore_timeout()
+        for callback in self.tick_callbacks:
+            callback()
 
     def parse_byte(self,b, comm):
         '''
@@ -31,6 +31,8 @@
 #include "common.h"
 #include "debug.h"
 #include "ftmq.h"
+#include "ftmq_codec.h"
+#include "ftmq_report.h"
 
 
 #include "ClickEnvironment.h"
@@ -47,6 +49,14 @@
 
 #define EXIT while(1) {}
 
+#define SAMPLE_INTERVAL 500 // ms
+// reporting policy: a change bigger than the deadband is published, but not more often than
+// REPORT_MIN_INTERVAL, and every value is published at least every REPORT_MAX_INTERVAL
+#define REPORT_MIN_INTERVAL 1000 // ms
+#define REPORT_MAX_INTERVAL 30000 // ms
+// the gas resistance is noisy, it is summarized instead (min, max and mean of each window)
+#define VOC_WINDOW 60000 // ms
+
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -142,49 +152,32 @@ int main(void)
   serial_comm_id = CCP_register_comm(&serial_comm);
 
   FTMQ_init();
+  FTMQ_report_init();
+  // binary (ftmq_codec) readings, published with topic ids
+  uint8_t temperature_report = FTMQ_report_add(serial_comm_id, "temperature", FTMQ_TAG_TEMPERATURE, 0.05f, REPORT_MIN_INTERVAL, REPORT_MAX_INTERVAL);
+  uint8_t pressure_report = FTMQ_report_add(serial_comm_id, "pressure", FTMQ_TAG_PRESSURE, 0.05f, REPORT_MIN_INTERVAL, REPORT_MAX_INTERVAL); // hPa
+  uint8_t humidity_report = FTMQ_report_add(serial_comm_id, "humidity", FTMQ_TAG_HUMIDITY, 0.05f, REPORT_MIN_INTERVAL, REPORT_MAX_INTERVAL);
+  uint8_t voc_report = FTMQ_report_add_window(serial_comm_id, "VOC", FTMQ_STAT_MIN | FTMQ_STAT_MAX | FTMQ_STAT_MEAN, VOC_WINDOW); // kOhm
 
   SERIAL_DEBUG("Beginning\n\r");
 
 
-  struct ClickEnvironment last_envdata;
-  uint32_t count = 0;
-  float temperature, pressure, humidity, voc;
-  uint8_t payload[49];
-  int payload_len;
+  uint32_t last_sample = HAL_GetTick() - SAMPLE_INTERVAL;
   while (1)  {
-		struct ClickEnvironment envdata = read_environment();
+		// the reports are published from the CCP tick
+		HAL_Delay(1);
+		CCP_poll_1msec();
+		if (HAL_GetTick() - last_sample < SAMPLE_INTERVAL)
+			continue;
+		last_sample = HAL_GetTick();
 
-		if(abs(envdata.temperature - last_envdata.temperature) > 0.05 || count == 10){
-			SERIAL_DEBUG_SPRINTF_2("temp: %d\thum: %d\r\n", (int)envdata.temperature, (int)envdata.humidity);
-			payload_len = sprintf(payload, "{\"temperature\": %f}", envdata.temperature);
-			FTMQ_publish(serial_comm_id, "temperature", payload, payload_len);
-			last_envdata.temperature = envdata.temperature;
-			HAL_Delay(100);
-		}
-		if(abs(envdata.pressure - last_envdata.pressure) > 5 || count == 20){
-			pressure = envdata.pressure / 100.0f;
-			payload_len = sprintf(payload, "{\"pressure\": %f}", pressure);
-			FTMQ_publish(serial_comm_id, "pressure", payload, payload_len);
-			last_envdata.pressure = envdata.pressure;
-			HAL_Delay(100);
-		}
-		if(abs(envdata.humidity - last_envdata.humidity) > 0.05 || count == 30){
-			payload_len = sprintf(payload, "{\"humidity\": %f}", envdata.humidity);
-			FTMQ_publish(serial_comm_id, "humidity", payload, payload_len);
-			last_envdata.humidity = envdata.humidity;
-			HAL_Delay(100);
-		}
-		if(abs(envdata.gas_resistance - last_envdata.gas_resistance) > 500 || count == 40){
-			voc = (float)envdata.gas_resistance / 1000.0f;
-			payload_len = sprintf(payload, "{\"AQI\": %f}", voc);
-			FTMQ_publish(serial_comm_id, "VOC", payload, payload_len);
-			last_envdata.gas_resistance = envdata.gas_resistance;
-			HAL_Delay(100);
-		}
-		if (count++ > 40)
-			count = 0;
+		struct ClickEnvironment envdata = read_environment();
+		SERIAL_DEBUG_SPRINTF_2("temp: %d\thum: %d\r\n", (int)envdata.temperature, (int)envdata.humidity);
+		FTMQ_report_sample(temperature_report, envdata.temperature);
+		FTMQ_report_sample(pressure_report, envdata.pressure / 100.0f);
+		FTMQ_report_sample(humidity_report, envdata.humidity);
+		FTMQ_report_sample(voc_report, (float)envdata.gas_resistance / 1000.0f);
 		HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
-		HAL_Delay(500);
 
     /* USER CODE END WHILE */
 
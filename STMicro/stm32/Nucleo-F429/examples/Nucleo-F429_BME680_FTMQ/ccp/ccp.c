@@ -43,6 +43,9 @@
 
 // ---------------- CONSTANTS --------------------------------
 #define CCP_TIMEOUT 1000 //ms
+#ifndef CCP_BUSY_WAIT
+#define CCP_BUSY_WAIT 100000 // polls of hal.busy before CCP_beginPacket gives up
+#endif
 
 #define CCP_MAX_PAYLOAD 68
 #define CCP_PREAMBLE_LEN 2
@@ -79,6 +82,11 @@ typedef struct CCP_input {
 typedef struct CCP_output {
   uint8_t buffer[CCP_MAX_PACKET];
   uint8_t transfering;
+  uint16_t length;    // payload length written in the header, CCP_UNKNOWN_LENGTH until CCP_endPacket
+  uint16_t written;   // payload bytes already in the buffer
+  uint16_t reserved;  // payload bytes handed out by CCP_reservePacket
+  uint16_t crc_bytes; // payload bytes already accumulated in crc
+  uint16_t crc;
 } CCP_output;
 
 typedef struct CCP_Comm {
@@ -96,7 +104,8 @@ typedef struct CCP_receive_callback {
 // ------------ PRIVATE FUNCTION PROTOTYPES ---------------------------------
 void parse_byte(uint8_t b, int comm_id);
 uint16_t CRC16 (const uint8_t *nData, uint16_t length);
-uint16_t generate_packet(uint8_t buffer[], uint8_t queue,uint8_t payload[],uint16_t length);
+uint16_t CRC16_update(uint16_t crc, const uint8_t *nData, uint16_t length);
+uint16_t CRC16_copy(uint16_t crc, uint8_t *dst, const uint8_t *src, uint16_t length);
 void print_packet(CCP_Packet *packet);
 
 
@@ -108,6 +117,9 @@ CCP_Comm comms[CCP_MAX_COMM];
 int registered_callbacks = 0;
 CCP_receive_callback callbacks[CCP_MAX_RECEIVE_CALLBACKS];
 
+int registered_tick_callbacks = 0;
+CCP_tick_cb_t tick_callbacks[CCP_MAX_TICK_CALLBACKS];
+
 
 // ------------ PUBLIC FUNCTIONS -------------------------------------
 void CCP_init() {
@@ -123,6 +135,14 @@ void CCP_register_callback(uint8_t queue, CCP_receive_cb_t cb) {
   }
 }
 
+void CCP_register_tick_callback(CCP_tick_cb_t cb) {
+
+  if (registered_tick_callbacks < CCP_MAX_TICK_CALLBACKS) {
+    tick_callbacks[registered_tick_callbacks] = cb;
+    registered_tick_callbacks++;
+  }
+}
+
 int CCP_register_comm(CCP_Comm_HAL *comm) { // returns comm id
 
   if (registered_comms < CCP_MAX_COMM) {
@@ -158,20 +178,130 @@ void CCP_poll_1msec() {
       comms[i].input.timeout = CCP_TIMEOUT;
     }
   }
+
+  for (int i = 0; i < registered_tick_callbacks; i++)
+    tick_callbacks[i]();
 }
 
 
 //send the packet to serial
 int CCP_sendPacket(uint8_t comm_id, uint8_t queue, uint8_t *data, uint16_t length)
 {
-  if (comms[comm_id].output.transfering == 0) { 
-    comms[comm_id].output.transfering = 1;
-    uint16_t packet_length = generate_packet(comms[comm_id].output.buffer, queue, data, length);
-    comms[comm_id].hal.send_bytes(comms[comm_id].output.buffer, packet_length);
-    comms[comm_id].output.transfering = 0;
-    return 0; // transfer started
+  if (CCP_beginPacket(comm_id, queue, length) != 0)
+    return -1;  // comm busy, can't start a new transfer
+  CCP_writePacket(comm_id, data, length);
+  return CCP_endPacket(comm_id); // transfer started
+}
+
+// The packet is built in place in the comm output buffer, so the payload segments are copied only once.
+// With a known length the header goes first and the crc is accumulated while copying.
+int CCP_beginPacket(uint8_t comm_id, uint8_t queue, uint16_t length)
+{
+  CCP_output *output = &(comms[comm_id].output);
+
+  if (output->transfering != 0 || (length != CCP_UNKNOWN_LENGTH && length > CCP_MAX_PAYLOAD))
+    return -1;
+  // asynchronous comms (interrupt driven uarts) may still be sending the previous packet from the output buffer,
+  // the wait is bounded so that a stuck uart doesn't hang the caller (tick callbacks check CCP_busy first)
+  if (comms[comm_id].hal.busy) {
+    uint32_t polls = 0;
+    while (comms[comm_id].hal.busy())
+      if (++polls >= CCP_BUSY_WAIT)
+        return -1;
+  }
+  output->transfering = 1;
+  memcpy(output->buffer, CCP_PREAMBLE, CCP_PREAMBLE_LEN);
+  output->buffer[CCP_PREAMBLE_LEN + 2] = queue;
+  output->length = length;
+  output->written = 0;
+  output->reserved = 0;
+  output->crc_bytes = 0;
+  if (length != CCP_UNKNOWN_LENGTH) {
+    uint16_t packet_length = CCP_OVERHEAD_LEN + length;
+    output->buffer[CCP_PREAMBLE_LEN] = (uint8_t) (packet_length & 0x00ff);
+    output->buffer[CCP_PREAMBLE_LEN + 1] = (uint8_t) ((packet_length & 0xff00) >> 8);
+    output->crc = CRC16(output->buffer, CCP_PREAMBLE_LEN + CCP_HEADER_LEN);
+  }
+  return 0;
+}
+
+// non zero while CCP_beginPacket would have to wait for the comm
+int CCP_busy(uint8_t comm_id)
+{
+  return comms[comm_id].output.transfering != 0 || (comms[comm_id].hal.busy && comms[comm_id].hal.busy());
+}
+
+int CCP_writePacket(uint8_t comm_id, const uint8_t *data, uint16_t length)
+{
+  CCP_output *output = &(comms[comm_id].output);
+  uint16_t max = (output->length == CCP_UNKNOWN_LENGTH) ? CCP_MAX_PAYLOAD : output->length;
+  uint8_t *dst = output->buffer + CCP_PREAMBLE_LEN + CCP_HEADER_LEN;
+
+  if (output->transfering == 0 || output->written + length > max)
+    return -1;
+  if (output->length != CCP_UNKNOWN_LENGTH && output->crc_bytes == output->written) {
+    output->crc = CRC16_copy(output->crc, dst + output->written, data, length);
+    output->crc_bytes += length;
+  } else {
+    memcpy(dst + output->written, data, length);
+  }
+  output->written += length;
+  return 0;
+}
+
+// returns where the caller can serialize up to length bytes, CCP_commitPacket tells how many were used
+uint8_t *CCP_reservePacket(uint8_t comm_id, uint16_t length)
+{
+  CCP_output *output = &(comms[comm_id].output);
+  uint16_t max = (output->length == CCP_UNKNOWN_LENGTH) ? CCP_MAX_PAYLOAD : output->length;
+
+  if (output->transfering == 0 || output->written + length > max)
+    return 0;
+  output->reserved = length;
+  return output->buffer + CCP_PREAMBLE_LEN + CCP_HEADER_LEN + output->written;
+}
+
+int CCP_commitPacket(uint8_t comm_id, uint16_t length)
+{
+  CCP_output *output = &(comms[comm_id].output);
+
+  if (output->transfering == 0 || length > output->reserved)
+    return -1;
+  output->written += length;
+  output->reserved = 0;
+  return 0;
+}
+
+int CCP_endPacket(uint8_t comm_id)
+{
+  CCP_output *output = &(comms[comm_id].output);
+  uint8_t *payload = output->buffer + CCP_PREAMBLE_LEN + CCP_HEADER_LEN;
+
+  if (output->transfering == 0)
+    return -1;
+  if (output->length == CCP_UNKNOWN_LENGTH) {
+    // length known only now, the header and crc are done in one pass over the packet
+    uint16_t packet_length = CCP_OVERHEAD_LEN + output->written;
+    output->buffer[CCP_PREAMBLE_LEN] = (uint8_t) (packet_length & 0x00ff);
+    output->buffer[CCP_PREAMBLE_LEN + 1] = (uint8_t) ((packet_length & 0xff00) >> 8);
+    output->crc = CRC16(output->buffer, CCP_PREAMBLE_LEN + CCP_HEADER_LEN + output->written);
+  } else if (output->written != output->length) {
+    output->transfering = 0; // the header doesn't match the data, drop the packet
+    return -1;
+  } else {
+    // bytes serialized in place by the caller
+    output->crc = CRC16_update(output->crc, payload + output->crc_bytes, output->written - output->crc_bytes);
   }
-  return -1;  // comm busy, can't start a new transfer
+  payload[output->written] = (uint8_t)(output->crc & 0x00ff);
+  payload[output->written + 1] = (uint8_t)((output->crc & 0xff00) >> 8);
+  comms[comm_id].hal.send_bytes(output->buffer, CCP_OVERHEAD_LEN + output->written);
+  output->transfering = 0;
+  return 0;
+}
+
+void CCP_abortPacket(uint8_t comm_id)
+{
+  comms[comm_id].output.transfering = 0;
 }
 
 
@@ -277,10 +407,7 @@ void parse_byte(uint8_t b, int comm_id) {
   }
 }
 
-//returns the crc16 value(MODBUS) using tables
-uint16_t CRC16 (const uint8_t *nData, uint16_t length){
-  
-  static const uint16_t crcTable[] = {
+static const uint16_t crcTable[] = {
   0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241,
   0XC601, 0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440,
   0XCC01, 0X0CC0, 0X0D80, 0XCD41, 0X0F00, 0XCFC1, 0XCE81, 0X0E40,
@@ -314,8 +441,16 @@ uint16_t CRC16 (const uint8_t *nData, uint16_t length){
   0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
   0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040 };
 
+//returns the crc16 value(MODBUS) using tables
+uint16_t CRC16 (const uint8_t *nData, uint16_t length){
+
+  return CRC16_update(0xFFFF, nData, length);
+}
+
+//continues a crc16 over more data
+uint16_t CRC16_update(uint16_t crc, const uint8_t *nData, uint16_t length){
+
   uint8_t nTemp;
-  uint16_t crc = 0xFFFF;
 
    while (length--)
    {
@@ -326,28 +461,18 @@ uint16_t CRC16 (const uint8_t *nData, uint16_t length){
    return crc;
 }
 
+//copies src to dst and continues the crc16 in the same pass
+uint16_t CRC16_copy(uint16_t crc, uint8_t *dst, const uint8_t *src, uint16_t length){
 
-//Allocate and populate a new packet
-uint16_t generate_packet(uint8_t *buffer, uint8_t queue,uint8_t payload[],uint16_t length){
-  uint8_t *buff_ptr = buffer;
-  // preamble
-  memcpy(buff_ptr, CCP_PREAMBLE, CCP_PREAMBLE_LEN);
-  buff_ptr += CCP_PREAMBLE_LEN;
-  // header
-  uint16_t packet_length = CCP_PREAMBLE_LEN + CCP_HEADER_LEN + length + CCP_CRC_LEN;
-  buff_ptr[0] = (uint8_t) (packet_length & 0x00ff);
-  buff_ptr[1] = (uint8_t) ((packet_length & 0xff00) >> 8);
-  buff_ptr[2] = queue;
-  // data
-  buff_ptr += CCP_HEADER_LEN;
-  memcpy(buff_ptr, payload, length);
-  // crc
-  buff_ptr += length;
-  uint16_t crc = CRC16(buffer, packet_length - CCP_CRC_LEN);
-  buff_ptr[0] = (uint8_t)(crc & 0x00ff);
-  buff_ptr[1] = (uint8_t)((crc & 0xff00) >> 8);
-
-  return packet_length;
+  uint8_t b;
+
+   while (length--)
+   {
+      b = *src++;
+      *dst++ = b;
+      crc = (crc >> 8) ^ crcTable[(uint8_t)(b ^ crc)];
+   }
+   return crc;
 }
 
 /*
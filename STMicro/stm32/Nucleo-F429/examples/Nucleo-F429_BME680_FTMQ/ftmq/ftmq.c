@@ -47,15 +47,160 @@
 #define FTMQ_START_PRINTABLE_CHARACTER 32
 #define FTMQ_END_PRINTABLE_CHARACTER 126
 
+#define FTMQ_FRAGMENT_CHUNK_LEN (FTMQ_MAX_PACKET_LEN - FTMQ_FRAGMENT_HEADER_LEN)
+
+#define FTMQ_NO_SUBSCRIPTION 0xFF
+#define FTMQ_NOT_DEFERRED 0xFF
+
+#define FTMQ_TOKEN 1000 // the pacing bucket counts thousandths of a frame, rate (frames/s) are added every ms
+
+// published topic id flags
+#define FTMQ_ALIAS_ANNOUNCED 0x01
+#define FTMQ_ALIAS_CONFLICT  0x02 // another topic has the same id, publish with the topic string
+
+// subscribed topic id states
+#define FTMQ_BINDING_UNBOUND  0 // waiting for the publisher to announce the topic
+#define FTMQ_BINDING_BOUND    1
+#define FTMQ_BINDING_CONFLICT 2 // another topic has the same id, only topic string frames are received
+
+// retained entry: | flags | topic length | payload length | topic | payload |, packed in FTMQ_retained
+#define FTMQ_RETAINED_HEADER_LEN 3
+#define FTMQ_RETAINED_OWN    0x01 // published by this node, it answers the retained requests for it
+#define FTMQ_RETAINED_ANSWER 0x02 // requested, published again from the CCP tick
+
 // -------------- CUSTOM TYPES ---------------------------------
 
+#ifdef FTMQ_MAX_SUBSCRIPTIONS
 typedef struct FTMQ_receive_callback {
     FTMQ_receive_cb_t receive;
     uint8_t msg[FTMQ_MAX_PACKET_LEN];
+    uint32_t hash; // of the topic, compared before the string
     uint8_t topic_length;
+    uint8_t next; // next subscription with the same topic id
+#ifdef FTMQ_DEFERRED_SLOTS
+    uint8_t deferred_first; // first slot of its ring in FTMQ_deferred, FTMQ_NOT_DEFERRED to call it from CCP_poll_1msec
+    uint8_t deferred_depth;
+    uint8_t deferred_head; // oldest message
+    uint8_t deferred_count;
+    uint8_t deferred_policy;
+#endif
 } FTMQ_receive_callback;
+#else
+typedef struct FTMQ_receive_callback {
+    FTMQ_receive_cb_t receive;
+    const char *topic; // kept to send it again from FTMQ_resubscribe
+#ifdef FTMQ_DEFERRED_SLOTS
+    uint8_t deferred_first; // as above, the frames filtered by the FT Click are queued the same way
+    uint8_t deferred_depth;
+    uint8_t deferred_head;
+    uint8_t deferred_count;
+    uint8_t deferred_policy;
+#endif
+} FTMQ_receive_callback;
+#endif
+
+#ifdef FTMQ_MAX_TOPIC_IDS
+typedef struct FTMQ_topic_alias {
+    const char *topic;
+    uint16_t id;
+    uint8_t topic_length;
+    uint8_t flags;
+} FTMQ_topic_alias;
+
+typedef struct FTMQ_topic_binding {
+    uint16_t id;
+    uint8_t subscription; // first subscription of the topic, FTMQ_NO_SUBSCRIPTION if the slot is free
+    uint8_t state;
+    uint16_t retry; // ms before the next register request
+} FTMQ_topic_binding;
+#endif
+
+#ifdef FTMQ_DEFERRED_SLOTS
+typedef struct FTMQ_deferred_message {
+    uint8_t length;
+    uint8_t payload[FTMQ_MAX_PACKET_LEN];
+} FTMQ_deferred_message;
+#endif
+
+#ifdef FTMQ_PACING_RATE
+typedef struct FTMQ_paced_frame {
+    uint8_t commid;
+    uint8_t key_length; // topic\0 or topic id header, frames with the same key are coalesced
+    uint8_t length;
+    uint8_t data[FTMQ_MAX_PACKET_LEN];
+} FTMQ_paced_frame;
+#endif
+
+#ifdef FTMQ_MAX_PENDING
+typedef struct FTMQ_pending_request {
+    FTMQ_response_cb_t cb;
+    uint16_t timeout; // ms, 0 means the slot is free
+    uint8_t sequence;
+} FTMQ_pending_request;
+#endif
+
+#ifdef FTMQ_MAX_RESPONDERS
+typedef struct FTMQ_responder {
+    const char *topic;
+    uint8_t topic_length;
+    FTMQ_responder_cb_t respond;
+} FTMQ_responder;
+#endif
+
+#ifdef FTMQ_MAX_MESSAGE_LEN
+typedef struct FTMQ_reassembly_slot {
+    uint16_t timeout; // ms, 0 means the slot is free
+    uint16_t source_id;
+    uint8_t msg_id;
+    uint8_t next_index;
+    uint8_t count;
+    uint16_t length;
+    uint8_t data[FTMQ_MAX_MESSAGE_LEN];
+} FTMQ_reassembly_slot;
+#endif
 
 void manage_callbacks(uint8_t commid, uint8_t *data, int length);
+void manage_timeouts();
+void dispatch_message(uint8_t *data, int length);
+uint8_t publish_frame(uint8_t commid, const char *topic, uint8_t topic_length, const uint8_t* payload, uint16_t payload_length, uint8_t publish_class);
+uint8_t subscribe_topic(uint8_t commid, const char *topic, uint8_t topic_length, uint32_t hash, FTMQ_receive_cb_t cb);
+void deliver(uint8_t subscription, uint8_t *payload, int length);
+void reassemble_fragment(uint8_t *data, int length);
+void write_message_range(uint8_t commid, const char *topic, uint8_t topic_length, const uint8_t* payload, uint16_t offset, uint16_t len);
+uint8_t publish_fragments(uint8_t commid, const char *topic, uint8_t topic_length, const uint8_t* payload, uint16_t payload_length);
+uint8_t send_topic_id_frame(uint8_t commid, uint8_t frame, uint16_t topic_id, const uint8_t *data, uint16_t length);
+void dispatch_topic_id(uint8_t commid, uint8_t *data, int length);
+void register_topic_id(uint8_t *data, int length);
+void request_registration(uint8_t *data, int length);
+void bind_subscription(uint8_t subscription);
+void dispatch_filtered(uint8_t *data, int length);
+void deliver_filtered(uint8_t *payload, int length);
+uint8_t send_filter_command(uint8_t commid, uint8_t command, uint8_t subscription, const char *topic);
+uint8_t take_tokens(uint8_t publish_class, uint8_t frames);
+uint8_t hold_frame(uint8_t commid, const uint8_t *key, uint8_t key_length, const uint8_t *payload, uint16_t payload_length);
+void manage_pacing();
+void refill_tokens(uint32_t elapsed);
+void send_held_frames();
+void set_pacing(uint8_t *data, int length);
+void retain_message(const uint8_t *topic, uint8_t topic_length, const uint8_t *payload, uint16_t payload_length, uint8_t flags);
+void reserve_retained(const char *topic, uint8_t topic_length, uint8_t *payload);
+void request_retained(uint8_t commid, uint8_t *data, int length);
+void answer_retained();
+void answer_request(uint8_t commid, uint8_t *data, int length);
+void dispatch_response(uint8_t *data, int length);
+void manage_requests();
+uint32_t hash_topic(const uint8_t *topic, uint8_t topic_length);
+uint16_t fold_topic_id(uint32_t hash);
+uint8_t find_static_topic(const uint8_t *topic, uint8_t topic_length, uint32_t hash);
+uint8_t find_static_topic_id(uint16_t topic_id);
+#ifdef FTMQ_RETAINED_ARENA
+uint8_t *find_retained(const uint8_t *topic, uint8_t topic_length);
+void remove_retained(uint8_t *entry);
+#endif
+#ifdef FTMQ_MAX_TOPIC_IDS
+FTMQ_topic_alias *find_alias(uint16_t topic_id);
+FTMQ_topic_binding *find_binding(uint16_t topic_id);
+#endif
 
 // ------------- LIBRARY GLOBAL VARIABLES ----------------------------
 #ifdef FTMQ_MAX_SUBSCRIPTIONS
@@ -66,46 +211,1161 @@ FTMQ_receive_callback FTMQ_callbacks[FTMQ_MAX_SUBSCRIPTIONS];
 
 #else
 // FTclick handles the subscriptions
+uint8_t registered_FTMQ_callbacks = 0;
+FTMQ_receive_callback FTMQ_callbacks[FTMQ_MAX_FILTERS];
+uint16_t FTMQ_delivery_mask = 0; // subscriptions the FT Click matched for the frame being delivered
+#endif
+
+#ifdef FTMQ_DEFERRED_SLOTS
+uint8_t allocated_FTMQ_deferred = 0;
+uint8_t FTMQ_next_deferred = 0; // FTMQ_process goes round robin over the subscriptions
+FTMQ_deferred_message FTMQ_deferred[FTMQ_DEFERRED_SLOTS];
 #endif
 
-uint8_t out_buffer[FTMQ_MAX_PACKET_LEN];
+const uint8_t FTMQ_separator = FTMQ_SEPARATOR;
+
+#ifdef FTMQ_STATIC_TOPICS
+// generated with the topic list, see utilities/ftmq_topic_table.py
+extern const uint16_t FTMQ_static_seeds[FTMQ_STATIC_BUCKETS];
+extern const FTMQ_static_topic FTMQ_static_topics[FTMQ_STATIC_TOPICS];
+#ifdef FTMQ_MAX_TOPIC_IDS
+uint8_t FTMQ_static_conflicts[(FTMQ_STATIC_TOPICS + 7) / 8]; // bit set: another node announced a different topic with the id
+#endif
+#endif
+
+#ifdef FTMQ_MAX_TOPIC_IDS
+uint8_t registered_FTMQ_topics = 0;
+FTMQ_topic_alias FTMQ_topics[FTMQ_MAX_TOPIC_IDS];
+#ifdef FTMQ_MAX_SUBSCRIPTIONS
+FTMQ_topic_binding FTMQ_bindings[FTMQ_MAX_TOPIC_IDS]; // direct mapped by topic id
+#endif
+#endif
+
+#ifdef FTMQ_PACING_RATE
+int32_t FTMQ_tokens = (int32_t)FTMQ_PACING_BURST * FTMQ_TOKEN;
+uint8_t FTMQ_pacing_burst = FTMQ_PACING_BURST;
+uint16_t FTMQ_pacing_rate = FTMQ_PACING_RATE;
+uint8_t held_FTMQ_frames = 0;
+FTMQ_paced_frame FTMQ_held_frames[FTMQ_PACING_QUEUE]; // sent in order from the CCP tick and FTMQ_process
+#ifdef FTMQ_CLOCK_MS
+uint32_t FTMQ_pacing_time = 0; // FTMQ_CLOCK_MS of the last refill
+#endif
+#endif
+
+#ifdef FTMQ_RETAINED_ARENA
+uint8_t FTMQ_retained[FTMQ_RETAINED_ARENA]; // oldest entries first, they are evicted to make room
+uint16_t FTMQ_retained_length = 0;
+uint8_t FTMQ_retained_commid = 0; // where the requested entries are published
+const char *FTMQ_reserved_topic = 0; // FTMQ_commit retains what was written after FTMQ_reserve
+uint8_t FTMQ_reserved_topic_length = 0;
+uint8_t *FTMQ_reserved_payload = 0;
+#endif
+
+uint16_t FTMQ_source_id = 0;
+#if defined(FTMQ_MAX_PENDING) && !defined(FTMQ_DEFAULT_SOURCE_ID)
+uint8_t FTMQ_source_id_set = 0; // the responses are matched by source id, requests wait for FTMQ_set_source_id
+#endif
+
+#ifdef FTMQ_MAX_PENDING
+uint8_t FTMQ_next_sequence = 0;
+FTMQ_pending_request FTMQ_pending[FTMQ_MAX_PENDING];
+#endif
+
+#ifdef FTMQ_MAX_RESPONDERS
+uint8_t registered_FTMQ_responders = 0;
+FTMQ_responder FTMQ_responders[FTMQ_MAX_RESPONDERS];
+#endif
+
+#ifdef FTMQ_MAX_MESSAGE_LEN
+uint8_t FTMQ_next_msg_id = 0;
+FTMQ_reassembly_slot FTMQ_reassembly[FTMQ_REASSEMBLY_SLOTS];
+#endif
 
 // ------------ PUBLIC FUNCTIONS -------------------------------------
 // When ccp.h is included, all the ccp resources are present. Since it isn't an object nor is it dynamic, we just use it as is.
 // The ccp init must be done outside, since it could be helpful for the user to do more things beside ftmq
 
 void FTMQ_init() {
+#ifdef FTMQ_DEFAULT_SOURCE_ID
+    FTMQ_source_id = FTMQ_DEFAULT_SOURCE_ID(); // different on each node, FTMQ_set_source_id replaces it
+#endif
+#if defined(FTMQ_MAX_TOPIC_IDS) && defined(FTMQ_MAX_SUBSCRIPTIONS)
+    for (uint8_t i = 0; i < FTMQ_MAX_TOPIC_IDS; i++)
+        FTMQ_bindings[i].subscription = FTMQ_NO_SUBSCRIPTION;
+#endif
     CCP_register_callback(CCP_FTMQ_QUEUE, manage_callbacks);
+    CCP_register_tick_callback(manage_timeouts);
+}
+
+void FTMQ_set_source_id(uint16_t source_id) {
+    FTMQ_source_id = source_id;
+#if defined(FTMQ_MAX_PENDING) && !defined(FTMQ_DEFAULT_SOURCE_ID)
+    FTMQ_source_id_set = 1;
+#endif
 }
 
 uint8_t FTMQ_publish(uint8_t commid, const char *topic, const uint8_t* payload, uint16_t payload_length) {
+    return FTMQ_publish_class(commid, topic, payload, payload_length, FTMQ_CLASS_TELEMETRY);
+}
+
+uint8_t FTMQ_publish_class(uint8_t commid, const char *topic, const uint8_t* payload, uint16_t payload_length, uint8_t publish_class) {
+    return publish_frame(commid, topic, strlen(topic), payload, payload_length, publish_class);
+}
+
+// the length comes from FTMQ_TOPIC, no strlen in the hot path
+uint8_t FTMQ_publish_topic(uint8_t commid, FTMQ_topic topic, const uint8_t* payload, uint16_t payload_length) {
+    return publish_frame(commid, topic.name, topic.length, payload, payload_length, FTMQ_CLASS_TELEMETRY);
+}
+
+// returns where the caller can serialize the payload (up to max_payload_length bytes), or 0 if the comm
+// is busy or there isn't room. FTMQ_commit sends the message with the bytes actually written.
+uint8_t *FTMQ_reserve(uint8_t commid, const char *topic, uint16_t max_payload_length) {
     uint8_t topic_length = strlen(topic);
-    memcpy(out_buffer, topic, topic_length);
-    out_buffer[topic_length] = 0;// include the null terminator
-    memcpy(out_buffer + topic_length + 1, payload, payload_length);
-    CCP_sendPacket(commid, CCP_FTMQ_QUEUE, out_buffer, topic_length + 1 + payload_length);
+    if (topic_length + 1 + max_payload_length > FTMQ_MAX_PACKET_LEN)
+        return 0;
+    if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, CCP_UNKNOWN_LENGTH) != 0)
+        return 0;
+    if (!take_tokens(FTMQ_CLASS_TELEMETRY, 1)){ // only a frame that can be sent takes its token
+        CCP_abortPacket(commid);
+        return 0; // over the pacing budget, try again later
+    }
+    CCP_writePacket(commid, (const uint8_t *)topic, topic_length);
+    CCP_writePacket(commid, &FTMQ_separator, 1);
+    uint8_t *payload = CCP_reservePacket(commid, max_payload_length);
+    reserve_retained(topic, topic_length, payload);
+    return payload;
+}
+
+uint8_t FTMQ_commit(uint8_t commid, uint16_t payload_length) {
+    if (CCP_commitPacket(commid, payload_length) != 0) {
+        CCP_abortPacket(commid);
+        return FTMQ_ERR_TOO_LONG;
+    }
+#ifdef FTMQ_RETAINED_ARENA
+    if (FTMQ_reserved_payload != 0)
+        retain_message((const uint8_t *)FTMQ_reserved_topic, FTMQ_reserved_topic_length, FTMQ_reserved_payload, payload_length, FTMQ_RETAINED_OWN);
+    FTMQ_reserved_payload = 0;
+#endif
+    if (CCP_endPacket(commid) != 0)
+        return FTMQ_ERR_BUSY;
+    return FTMQ_OK;
+}
+
+
+// FNV-1a folded to 16 bits
+uint16_t FTMQ_topic_id(const char *topic) {
+    return fold_topic_id(hash_topic((const uint8_t *)topic, strlen(topic)));
+}
+
+// the id is announced now and again when a subscriber asks for it, returns the id to publish with
+uint16_t FTMQ_register_topic(uint8_t commid, const char *topic) {
+    uint16_t topic_id = FTMQ_topic_id(topic);
+#ifdef FTMQ_MAX_TOPIC_IDS
+    FTMQ_topic_alias *alias = find_alias(topic_id);
+    if (alias == 0 && registered_FTMQ_topics < FTMQ_MAX_TOPIC_IDS) {
+        alias = &FTMQ_topics[registered_FTMQ_topics++];
+        alias->topic = topic;
+        alias->id = topic_id;
+        alias->topic_length = strlen(topic);
+        alias->flags = 0;
+    }
+    if (alias != 0 && send_topic_id_frame(commid, FTMQ_FRAME_REGISTER, topic_id, (const uint8_t *)alias->topic, alias->topic_length) == FTMQ_OK)
+        alias->flags |= FTMQ_ALIAS_ANNOUNCED;
+#endif
+    return topic_id;
 }
 
+uint8_t FTMQ_publish_id(uint8_t commid, uint16_t topic_id, const uint8_t* payload, uint16_t payload_length) {
+#ifdef FTMQ_MAX_TOPIC_IDS
+    FTMQ_topic_alias *alias = find_alias(topic_id);
+    if (alias == 0)
+        return FTMQ_ERR_NO_TOPIC;
+    if ((alias->flags & FTMQ_ALIAS_CONFLICT) || FTMQ_TOPIC_ID_HEADER_LEN + payload_length > FTMQ_MAX_PACKET_LEN)
+        return FTMQ_publish(commid, alias->topic, payload, payload_length);
+    if (!(alias->flags & FTMQ_ALIAS_ANNOUNCED)) {
+        FTMQ_register_topic(commid, alias->topic);
+        if (!(alias->flags & FTMQ_ALIAS_ANNOUNCED))
+            return FTMQ_ERR_BUSY;
+    }
+    retain_message((const uint8_t *)alias->topic, alias->topic_length, payload, payload_length, FTMQ_RETAINED_OWN);
+    if (!take_tokens(FTMQ_CLASS_TELEMETRY, 1)) {
+        uint8_t header[FTMQ_TOPIC_ID_HEADER_LEN] = { FTMQ_FRAME_TOPIC_ID, (uint8_t)(topic_id & 0x00ff), (uint8_t)((topic_id & 0xff00) >> 8) };
+        return hold_frame(commid, header, FTMQ_TOPIC_ID_HEADER_LEN, payload, payload_length);
+    }
+    if (send_topic_id_frame(commid, FTMQ_FRAME_TOPIC_ID, topic_id, payload, payload_length) != FTMQ_OK)
+        return FTMQ_ERR_BUSY;
+    return FTMQ_OK;
+#else
+    return FTMQ_ERR_NO_TOPIC;
+#endif
+}
+
+uint8_t *FTMQ_reserve_id(uint8_t commid, uint16_t topic_id, uint16_t max_payload_length) {
+#ifdef FTMQ_MAX_TOPIC_IDS
+    FTMQ_topic_alias *alias = find_alias(topic_id);
+    if (alias == 0)
+        return 0;
+    if (alias->flags & FTMQ_ALIAS_CONFLICT)
+        return FTMQ_reserve(commid, alias->topic, max_payload_length);
+    if (FTMQ_TOPIC_ID_HEADER_LEN + max_payload_length > FTMQ_MAX_PACKET_LEN)
+        return 0;
+    if (!(alias->flags & FTMQ_ALIAS_ANNOUNCED)) {
+        FTMQ_register_topic(commid, alias->topic);
+        if (!(alias->flags & FTMQ_ALIAS_ANNOUNCED))
+            return 0;
+    }
+    uint8_t header[FTMQ_TOPIC_ID_HEADER_LEN] = { FTMQ_FRAME_TOPIC_ID, (uint8_t)(topic_id & 0x00ff), (uint8_t)((topic_id & 0xff00) >> 8) };
+    if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, CCP_UNKNOWN_LENGTH) != 0)
+        return 0;
+    if (!take_tokens(FTMQ_CLASS_TELEMETRY, 1)){
+        CCP_abortPacket(commid);
+        return 0;
+    }
+    CCP_writePacket(commid, header, FTMQ_TOPIC_ID_HEADER_LEN);
+    uint8_t *payload = CCP_reservePacket(commid, max_payload_length);
+    reserve_retained(alias->topic, alias->topic_length, payload);
+    return payload;
+#else
+    return 0;
+#endif
+}
 
 uint8_t FTMQ_subscribe(uint8_t commid, const char *topic, FTMQ_receive_cb_t cb){
+    uint8_t topic_length = strlen(topic);
+    return subscribe_topic(commid, topic, topic_length, hash_topic((const uint8_t *)topic, topic_length), cb);
+}
+
+uint8_t FTMQ_subscribe_topic(uint8_t commid, FTMQ_topic topic, FTMQ_receive_cb_t cb){
+    return subscribe_topic(commid, topic.name, topic.length, topic.hash, cb);
+}
+
+// depth is the number of messages kept, the slots are taken from FTMQ_DEFERRED_SLOTS
+uint8_t FTMQ_subscribe_deferred(uint8_t commid, const char *topic, FTMQ_receive_cb_t cb, uint8_t policy, uint8_t depth){
+#ifdef FTMQ_DEFERRED_SLOTS
+    if (policy == FTMQ_DEFER_LATEST || depth == 0)
+        depth = 1;
+    if (allocated_FTMQ_deferred + depth > FTMQ_DEFERRED_SLOTS)
+        return FTMQ_ERR_FULL;
+    uint8_t result = FTMQ_subscribe(commid, topic, cb);
+    if (result != FTMQ_OK)
+        return result;
+    FTMQ_receive_callback *sub = &FTMQ_callbacks[registered_FTMQ_callbacks - 1];
+    sub->deferred_first = allocated_FTMQ_deferred;
+    sub->deferred_depth = depth;
+    sub->deferred_head = 0;
+    sub->deferred_count = 0;
+    sub->deferred_policy = policy;
+    allocated_FTMQ_deferred += depth;
+    return FTMQ_OK;
+#else
+    return FTMQ_subscribe(commid, topic, cb);
+#endif
+}
+
+// call it from the same context as CCP_poll_1msec (main loop or task), the callbacks can take their time here
+uint8_t FTMQ_process(uint8_t budget){
+    uint8_t left = 0;
+#if defined(FTMQ_PACING_RATE) && defined(FTMQ_CLOCK_MS)
+    refill_tokens(0); // the held frames don't depend on the CCP tick
+    send_held_frames();
+#endif
+#ifdef FTMQ_DEFERRED_SLOTS
+    uint8_t idle = 0;
+    while (budget > 0 && idle < registered_FTMQ_callbacks){
+        FTMQ_receive_callback *sub = &FTMQ_callbacks[FTMQ_next_deferred];
+        FTMQ_next_deferred = (FTMQ_next_deferred + 1) % registered_FTMQ_callbacks;
+        if (sub->deferred_first == FTMQ_NOT_DEFERRED || sub->deferred_count == 0){
+            idle++;
+            continue;
+        }
+        idle = 0;
+        FTMQ_deferred_message *message = &FTMQ_deferred[sub->deferred_first + sub->deferred_head];
+        sub->receive(message->payload, message->length);
+        sub->deferred_head = (sub->deferred_head + 1) % sub->deferred_depth; // the slot is freed once the callback returns
+        sub->deferred_count--;
+        budget--;
+    }
+    for (uint8_t i = 0; i < registered_FTMQ_callbacks; i++){
+        if (FTMQ_callbacks[i].deferred_first != FTMQ_NOT_DEFERRED)
+            left += FTMQ_callbacks[i].deferred_count;
+    }
+#endif
+    return left;
+}
+
+uint8_t FTMQ_resubscribe(uint8_t commid){
+#ifndef FTMQ_MAX_SUBSCRIPTIONS
+    if (send_filter_command(commid, CCP_COMMAND_FTMQ_CLEAR_FILTERS, 0, 0) != FTMQ_OK)
+        return FTMQ_ERR_BUSY;
+    for (uint8_t i = 0; i < registered_FTMQ_callbacks; i++){
+        if (send_filter_command(commid, CCP_COMMAND_FTMQ_SUBSCRIBE, i, FTMQ_callbacks[i].topic) != FTMQ_OK)
+            return FTMQ_ERR_BUSY;
+    }
+#endif
+    return FTMQ_OK;
+}
+
+// requests are commands for the pacing, the same for the responses
+uint8_t FTMQ_request(uint8_t commid, const char *topic, const uint8_t *payload, uint16_t payload_length, uint16_t timeout, FTMQ_response_cb_t cb){
+#ifdef FTMQ_MAX_PENDING
+    uint8_t topic_length = strlen(topic);
+    FTMQ_pending_request *pending = 0;
+#ifndef FTMQ_DEFAULT_SOURCE_ID
+    if (!FTMQ_source_id_set)
+        return FTMQ_ERR_NO_SOURCE; // every node would be 0, and take the responses of the others
+#endif
+    if (FTMQ_RPC_HEADER_LEN + topic_length + 1 + payload_length > FTMQ_MAX_PACKET_LEN)
+        return FTMQ_ERR_TOO_LONG;
+    for (uint8_t i = 0; i < FTMQ_MAX_PENDING; i++){
+        if (FTMQ_pending[i].timeout == 0){
+            pending = &FTMQ_pending[i];
+            break;
+        }
+    }
+    if (pending == 0)
+        return FTMQ_ERR_FULL;
+    uint8_t header[FTMQ_RPC_HEADER_LEN] = { FTMQ_FRAME_REQUEST, (uint8_t)(FTMQ_source_id & 0x00ff), (uint8_t)((FTMQ_source_id & 0xff00) >> 8), FTMQ_next_sequence };
+    if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, FTMQ_RPC_HEADER_LEN + topic_length + 1 + payload_length) != 0)
+        return FTMQ_ERR_BUSY;
+    take_tokens(FTMQ_CLASS_COMMAND, 1);
+    CCP_writePacket(commid, header, FTMQ_RPC_HEADER_LEN);
+    CCP_writePacket(commid, (const uint8_t *)topic, topic_length);
+    CCP_writePacket(commid, &FTMQ_separator, 1);
+    CCP_writePacket(commid, payload, payload_length);
+    if (CCP_endPacket(commid) != 0)
+        return FTMQ_ERR_BUSY;
+    pending->cb = cb;
+    pending->sequence = FTMQ_next_sequence++;
+    pending->timeout = timeout > 0 ? timeout : 1;
+    return FTMQ_OK;
+#else
+    return FTMQ_ERR_FULL;
+#endif
+}
+
+uint8_t FTMQ_respond(const char *topic, FTMQ_responder_cb_t cb){
+#ifdef FTMQ_MAX_RESPONDERS
+    if (registered_FTMQ_responders >= FTMQ_MAX_RESPONDERS)
+        return FTMQ_ERR_FULL;
+    FTMQ_responders[registered_FTMQ_responders].topic = topic;
+    FTMQ_responders[registered_FTMQ_responders].topic_length = strlen(topic);
+    FTMQ_responders[registered_FTMQ_responders].respond = cb;
+    registered_FTMQ_responders++;
+    return FTMQ_OK;
+#else
+    return FTMQ_ERR_FULL;
+#endif
+}
+
+uint8_t FTMQ_sub_lookup(const char *topic){
+    uint8_t topic_length = strlen(topic);
+    return find_static_topic((const uint8_t *)topic, topic_length, hash_topic((const uint8_t *)topic, topic_length));
+}
+
+// copies the last payload seen for the topic (published here or received by a subscription), returns its length, 0 if none
+uint16_t FTMQ_get_retained(const char *topic, uint8_t *buffer, uint16_t size){
+#ifdef FTMQ_RETAINED_ARENA
+    uint8_t *entry = find_retained((const uint8_t *)topic, strlen(topic));
+    if (entry == 0 || entry[2] > size)
+        return 0;
+    memcpy(buffer, entry + FTMQ_RETAINED_HEADER_LEN + entry[1], entry[2]);
+    return entry[2];
+#else
+    return 0;
+#endif
+}
+
+// asks the other nodes to publish again their last value of topic (every topic if 0), call it at startup
+uint8_t FTMQ_request_retained(uint8_t commid, const char *topic){
+    uint8_t frame = FTMQ_FRAME_RETAINED_REQUEST;
+    uint8_t topic_length = topic ? strlen(topic) : 0;
+    if (1 + topic_length > FTMQ_MAX_PACKET_LEN)
+        return FTMQ_ERR_TOO_LONG;
+    if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, 1 + topic_length) != 0)
+        return FTMQ_ERR_BUSY;
+    CCP_writePacket(commid, &frame, 1);
+    if (topic_length > 0)
+        CCP_writePacket(commid, (const uint8_t *)topic, topic_length);
+    if (CCP_endPacket(commid) != 0)
+        return FTMQ_ERR_BUSY;
+    return FTMQ_OK;
+}
+
+
+void manage_callbacks(uint8_t commid, uint8_t *data, int length){
+    if (length <= 0)
+        return;
+    switch (data[0]) {
+        case FTMQ_FRAME_FRAGMENT:
+            reassemble_fragment(data, length);
+            break;
+        case FTMQ_FRAME_TOPIC_ID:
+            dispatch_topic_id(commid, data, length);
+            break;
+        case FTMQ_FRAME_REGISTER:
+            register_topic_id(data, length);
+            break;
+        case FTMQ_FRAME_REGISTER_REQUEST:
+            request_registration(data, length);
+            break;
+        case FTMQ_FRAME_FILTERED:
+            dispatch_filtered(data, length);
+            break;
+        case FTMQ_FRAME_PACING:
+            set_pacing(data, length);
+            break;
+        case FTMQ_FRAME_RETAINED_REQUEST:
+            request_retained(commid, data, length);
+            break;
+        case FTMQ_FRAME_REQUEST:
+            answer_request(commid, data, length);
+            break;
+        case FTMQ_FRAME_RESPONSE:
+            dispatch_response(data, length);
+            break;
+        default:
+            dispatch_message(data, length);
+            break;
+    }
+}
+
+void FTMQ_set_pacing(uint8_t burst, uint16_t rate){
+#ifdef FTMQ_PACING_RATE
+    FTMQ_pacing_burst = burst;
+    FTMQ_pacing_rate = rate;
+    if (FTMQ_tokens > (int32_t)burst * FTMQ_TOKEN)
+        FTMQ_tokens = (int32_t)burst * FTMQ_TOKEN;
+#endif
+}
+
+uint8_t FTMQ_request_pacing(uint8_t commid){
+    uint8_t command = CCP_COMMAND_FTMQ_PACING;
+    if (CCP_sendPacket(commid, CCP_COMMAND_QUEUE, &command, 1) != 0)
+        return FTMQ_ERR_BUSY;
+    return FTMQ_OK;
+}
+
+// called every msec from CCP_poll_1msec
+void manage_timeouts(){
+    manage_pacing();
+    answer_retained();
+    manage_requests();
+#ifdef FTMQ_MAX_MESSAGE_LEN
+    for (uint8_t i = 0; i < FTMQ_REASSEMBLY_SLOTS; i++){
+        if (FTMQ_reassembly[i].timeout > 0)
+            FTMQ_reassembly[i].timeout--; // expired slots are freed, the partial message is dropped
+    }
+#endif
+#if defined(FTMQ_MAX_TOPIC_IDS) && defined(FTMQ_MAX_SUBSCRIPTIONS)
+    for (uint8_t i = 0; i < FTMQ_MAX_TOPIC_IDS; i++){
+        if (FTMQ_bindings[i].retry > 0)
+            FTMQ_bindings[i].retry--;
+    }
+#endif
+}
+
+// ------------ PRIVATE FUNCTIONS -------------------------------------
+
+// topic, separator and payload are framed straight into the ccp output buffer
+// over the pacing budget, telemetry is held back and sent later from the CCP tick (FTMQ_OK is returned)
+uint8_t publish_frame(uint8_t commid, const char *topic, uint8_t topic_length, const uint8_t* payload, uint16_t payload_length, uint8_t publish_class) {
+    if (topic_length + 1 + payload_length > FTMQ_MAX_PACKET_LEN) {
+        if (!take_tokens(publish_class, (topic_length + 1 + payload_length + FTMQ_FRAGMENT_CHUNK_LEN - 1) / FTMQ_FRAGMENT_CHUNK_LEN))
+            return FTMQ_ERR_BUSY; // too big to be held back
+        return publish_fragments(commid, topic, topic_length, payload, payload_length);
+    }
+    retain_message((const uint8_t *)topic, topic_length, payload, payload_length, FTMQ_RETAINED_OWN);
+    if (!take_tokens(publish_class, 1))
+        return hold_frame(commid, (const uint8_t *)topic, topic_length + 1, payload, payload_length); // topic\0 is the key
+    if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, topic_length + 1 + payload_length) != 0)
+        return FTMQ_ERR_BUSY;
+    CCP_writePacket(commid, (const uint8_t *)topic, topic_length);
+    CCP_writePacket(commid, &FTMQ_separator, 1);// include the null terminator
+    CCP_writePacket(commid, payload, payload_length);
+    if (CCP_endPacket(commid) != 0)
+        return FTMQ_ERR_BUSY;
+    return FTMQ_OK;
+}
+
+uint8_t subscribe_topic(uint8_t commid, const char *topic, uint8_t topic_length, uint32_t hash, FTMQ_receive_cb_t cb){
+#ifdef FTMQ_MAX_SUBSCRIPTIONS
+    if (topic_length >= FTMQ_MAX_PACKET_LEN)
+        return FTMQ_ERR_TOO_LONG;
     if (registered_FTMQ_callbacks < FTMQ_MAX_SUBSCRIPTIONS){
         FTMQ_callbacks[registered_FTMQ_callbacks].receive = cb;
-        FTMQ_callbacks[registered_FTMQ_callbacks].topic_length = strlen(topic);
-        memcpy(FTMQ_callbacks[registered_FTMQ_callbacks].msg, topic, FTMQ_callbacks[registered_FTMQ_callbacks].topic_length + 1);
+        FTMQ_callbacks[registered_FTMQ_callbacks].topic_length = topic_length;
+        FTMQ_callbacks[registered_FTMQ_callbacks].hash = hash;
+        memcpy(FTMQ_callbacks[registered_FTMQ_callbacks].msg, topic, topic_length);
+        FTMQ_callbacks[registered_FTMQ_callbacks].msg[topic_length] = 0;
+#ifdef FTMQ_DEFERRED_SLOTS
+        FTMQ_callbacks[registered_FTMQ_callbacks].deferred_first = FTMQ_NOT_DEFERRED;
+#endif
+        bind_subscription(registered_FTMQ_callbacks);
         registered_FTMQ_callbacks++;
+        return FTMQ_OK;
     }
+    return FTMQ_ERR_FULL;
+#else
+    if (registered_FTMQ_callbacks >= FTMQ_MAX_FILTERS)
+        return FTMQ_ERR_FULL;
+    // the first subscription drops the filters left by a previous run of the host
+    if (registered_FTMQ_callbacks == 0 && send_filter_command(commid, CCP_COMMAND_FTMQ_CLEAR_FILTERS, 0, 0) != FTMQ_OK)
+        return FTMQ_ERR_BUSY;
+    if (send_filter_command(commid, CCP_COMMAND_FTMQ_SUBSCRIBE, registered_FTMQ_callbacks, topic) != FTMQ_OK)
+        return FTMQ_ERR_BUSY;
+    FTMQ_callbacks[registered_FTMQ_callbacks].receive = cb;
+    FTMQ_callbacks[registered_FTMQ_callbacks].topic = topic;
+#ifdef FTMQ_DEFERRED_SLOTS
+    FTMQ_callbacks[registered_FTMQ_callbacks].deferred_first = FTMQ_NOT_DEFERRED;
+#endif
+    registered_FTMQ_callbacks++;
+    return FTMQ_OK;
+#endif
 }
 
-
-void manage_callbacks(uint8_t commid, uint8_t *data, int length){
+void dispatch_message(uint8_t *data, int length){
 #ifdef FTMQ_MAX_SUBSCRIPTIONS
+    uint8_t retained = 0;
+    uint8_t *separator = memchr(data, FTMQ_SEPARATOR, length);
+    if (separator == 0)
+        return;
+    // the topic is hashed once, the subscriptions compare the hash and the length before the string
+    uint8_t topic_length = separator - data;
+    uint32_t hash = hash_topic(data, topic_length);
+    uint8_t *payload = separator + 1;
+    int payload_length = length - (topic_length + 1);
+#ifdef FTMQ_STATIC_TOPICS
+    // one hash and one compare, topics out of the table are rejected without reading the subscriptions
+    uint8_t index = find_static_topic(data, topic_length, hash);
+    if (index != FTMQ_NO_STATIC_TOPIC && FTMQ_static_topics[index].receive != 0){
+        retain_message(data, topic_length, payload, payload_length, 0);
+        retained = 1;
+        FTMQ_static_topics[index].receive(payload, payload_length);
+    }
+    if (registered_FTMQ_callbacks == 0)
+        return; // hit or miss, the table was the only subscription
+#endif
     for (uint8_t i = 0; i < registered_FTMQ_callbacks;i++){
-        if (strncmp(data, FTMQ_callbacks[i].msg, FTMQ_callbacks[i].topic_length) == 0){
-            FTMQ_callbacks[i].receive(data + FTMQ_callbacks[i].topic_length + 1, length - (FTMQ_callbacks[i].topic_length + 1));
+        FTMQ_receive_callback *sub = &FTMQ_callbacks[i];
+        if (sub->hash == hash && sub->topic_length == topic_length && memcmp(data, sub->msg, topic_length) == 0){
+            if (!retained){ // before the callbacks, they may read it with FTMQ_get_retained
+                retain_message(data, topic_length, payload, payload_length, 0);
+                retained = 1;
+            }
+            deliver(i, payload, payload_length);
         }
     }
 #else
+    // the FT Click already matched the topic, see dispatch_filtered
+    uint8_t *separator = memchr(data, FTMQ_SEPARATOR, length);
+    if (separator != 0 && FTMQ_delivery_mask != 0){
+        retain_message(data, separator - data, separator + 1, length - (separator + 1 - data), 0);
+        deliver_filtered(separator + 1, length - (separator + 1 - data));
+    }
+#endif
+}
+
+// calls the subscription callback, or queues the message for FTMQ_process
+void deliver(uint8_t subscription, uint8_t *payload, int length){
+    FTMQ_receive_callback *sub = &FTMQ_callbacks[subscription];
+#ifdef FTMQ_DEFERRED_SLOTS
+    if (sub->deferred_first != FTMQ_NOT_DEFERRED){
+        uint8_t index;
+        if (length > FTMQ_MAX_PACKET_LEN)
+            return; // a reassembled message doesn't fit in a slot
+        if (sub->deferred_count == sub->deferred_depth){
+            if (sub->deferred_policy == FTMQ_DEFER_FIFO)
+                return; // full
+            index = sub->deferred_head; // latest only, the older message is replaced
+        } else {
+            index = (sub->deferred_head + sub->deferred_count) % sub->deferred_depth;
+            sub->deferred_count++;
+        }
+        FTMQ_deferred_message *message = &FTMQ_deferred[sub->deferred_first + index];
+        message->length = length;
+        memcpy(message->payload, payload, length);
+        return;
+    }
+#endif
+    sub->receive(payload, length);
+}
+
+// | FTMQ_FRAME_FILTERED | subscription mask | frame |, the frame is handled as usual but only delivered to the masked subscriptions
+void dispatch_filtered(uint8_t *data, int length){
+#ifndef FTMQ_MAX_SUBSCRIPTIONS
+    if (length <= FTMQ_FILTERED_HEADER_LEN)
+        return;
+    FTMQ_delivery_mask = data[1] | ((uint16_t)(data[2]) << 8);
+    data += FTMQ_FILTERED_HEADER_LEN;
+    length -= FTMQ_FILTERED_HEADER_LEN;
+    if (data[0] == FTMQ_FRAME_FRAGMENT)
+        reassemble_fragment(data, length);
+    else if (data[0] == FTMQ_FRAME_TOPIC_ID && length >= FTMQ_TOPIC_ID_HEADER_LEN)
+        deliver_filtered(data + FTMQ_TOPIC_ID_HEADER_LEN, length - FTMQ_TOPIC_ID_HEADER_LEN);
+    else
+        dispatch_message(data, length);
+    FTMQ_delivery_mask = 0;
+#endif
+}
+
+void deliver_filtered(uint8_t *payload, int length){
+#ifndef FTMQ_MAX_SUBSCRIPTIONS
+    for (uint8_t i = 0; i < registered_FTMQ_callbacks; i++){
+        if (FTMQ_delivery_mask & (1U << i))
+            deliver(i, payload, length);
+    }
+#endif
+}
+
+// | command | subscription index | topic |
+uint8_t send_filter_command(uint8_t commid, uint8_t command, uint8_t subscription, const char *topic){
+    uint8_t header[2] = { command, subscription };
+    uint8_t header_length = topic ? 2 : 1;
+    uint8_t topic_length = topic ? strlen(topic) : 0;
+    if (CCP_beginPacket(commid, CCP_COMMAND_QUEUE, header_length + topic_length) != 0)
+        return FTMQ_ERR_BUSY;
+    CCP_writePacket(commid, header, header_length);
+    if (topic_length > 0)
+        CCP_writePacket(commid, (const uint8_t *)topic, topic_length);
+    if (CCP_endPacket(commid) != 0)
+        return FTMQ_ERR_BUSY;
+    return FTMQ_OK;
+}
+
+// writes len bytes of the virtual message topic\0payload starting at offset
+void write_message_range(uint8_t commid, const char *topic, uint8_t topic_length, const uint8_t* payload, uint16_t offset, uint16_t len){
+    if (offset < topic_length){
+        uint16_t n = topic_length - offset;
+        if (n > len)
+            n = len;
+        CCP_writePacket(commid, (const uint8_t *)topic + offset, n);
+        offset += n;
+        len -= n;
+    }
+    if (len > 0 && offset == topic_length){
+        CCP_writePacket(commid, &FTMQ_separator, 1);
+        offset++;
+        len--;
+    }
+    if (len > 0)
+        CCP_writePacket(commid, payload + (offset - topic_length - 1), len);
+}
+
+uint8_t publish_fragments(uint8_t commid, const char *topic, uint8_t topic_length, const uint8_t* payload, uint16_t payload_length){
+#ifdef FTMQ_MAX_MESSAGE_LEN
+    uint16_t total = topic_length + 1 + payload_length;
+    if (total > FTMQ_MAX_MESSAGE_LEN)
+        return FTMQ_ERR_TOO_LONG;
+    uint8_t count = (total + FTMQ_FRAGMENT_CHUNK_LEN - 1) / FTMQ_FRAGMENT_CHUNK_LEN;
+    uint8_t msg_id = FTMQ_next_msg_id++;
+    for (uint8_t index = 0; index < count; index++){
+        uint16_t offset = (uint16_t)index * FTMQ_FRAGMENT_CHUNK_LEN;
+        uint16_t chunk = total - offset;
+        if (chunk > FTMQ_FRAGMENT_CHUNK_LEN)
+            chunk = FTMQ_FRAGMENT_CHUNK_LEN;
+        uint8_t header[FTMQ_FRAGMENT_HEADER_LEN];
+        header[0] = FTMQ_FRAME_FRAGMENT;
+        header[1] = (uint8_t)(FTMQ_source_id & 0x00ff);
+        header[2] = (uint8_t)((FTMQ_source_id & 0xff00) >> 8);
+        header[3] = msg_id;
+        header[4] = index;
+        header[5] = count;
+        if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, FTMQ_FRAGMENT_HEADER_LEN + chunk) != 0)
+            return FTMQ_ERR_BUSY;
+        CCP_writePacket(commid, header, FTMQ_FRAGMENT_HEADER_LEN);
+        write_message_range(commid, topic, topic_length, payload, offset, chunk);
+        if (CCP_endPacket(commid) != 0)
+            return FTMQ_ERR_BUSY;
+    }
+    return FTMQ_OK;
+#else
+    return FTMQ_ERR_TOO_LONG;
+#endif
+}
 
+void reassemble_fragment(uint8_t *data, int length){
+#ifdef FTMQ_MAX_MESSAGE_LEN
+    if (length <= FTMQ_FRAGMENT_HEADER_LEN)
+        return;
+    uint16_t source_id = data[1] | ((uint16_t)(data[2]) << 8);
+    uint8_t msg_id = data[3];
+    uint8_t index = data[4];
+    uint8_t count = data[5];
+    uint16_t chunk = length - FTMQ_FRAGMENT_HEADER_LEN;
+    FTMQ_reassembly_slot *slot = 0;
+
+    // look for the slot of this sender
+    for (uint8_t i = 0; i < FTMQ_REASSEMBLY_SLOTS; i++){
+        if (FTMQ_reassembly[i].timeout > 0 && FTMQ_reassembly[i].source_id == source_id){
+            slot = &FTMQ_reassembly[i];
+            break;
+        }
+    }
+    if (index == 0){
+        if (slot == 0){ // new sender, take a free slot or the one closest to expire
+            slot = &FTMQ_reassembly[0];
+            for (uint8_t i = 1; i < FTMQ_REASSEMBLY_SLOTS; i++){
+                if (FTMQ_reassembly[i].timeout < slot->timeout)
+                    slot = &FTMQ_reassembly[i];
+            }
+        }
+        // a first fragment always restarts the sender slot, the previous message is lost anyway
+        slot->source_id = source_id;
+        slot->msg_id = msg_id;
+        slot->count = count;
+        slot->next_index = 0;
+        slot->length = 0;
+    } else if (slot == 0 || slot->msg_id != msg_id){
+        return; // we missed the first fragment
+    }
+    if (index != slot->next_index || count != slot->count || slot->length + chunk > FTMQ_MAX_MESSAGE_LEN){
+        slot->timeout = 0; // lost or bad fragment, drop the message
+        return;
+    }
+    memcpy(slot->data + slot->length, data + FTMQ_FRAGMENT_HEADER_LEN, chunk);
+    slot->length += chunk;
+    slot->next_index++;
+    slot->timeout = FTMQ_REASSEMBLY_TIMEOUT;
+    if (slot->next_index == slot->count){
+        slot->timeout = 0; // free the slot before calling the application
+        dispatch_message(slot->data, slot->length);
+    }
+#endif
+}
+
+uint8_t send_topic_id_frame(uint8_t commid, uint8_t frame, uint16_t topic_id, const uint8_t *data, uint16_t length){
+    uint8_t header[FTMQ_TOPIC_ID_HEADER_LEN] = { frame, (uint8_t)(topic_id & 0x00ff), (uint8_t)((topic_id & 0xff00) >> 8) };
+    if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, FTMQ_TOPIC_ID_HEADER_LEN + length) != 0)
+        return FTMQ_ERR_BUSY;
+    CCP_writePacket(commid, header, FTMQ_TOPIC_ID_HEADER_LEN);
+    CCP_writePacket(commid, data, length);
+    if (CCP_endPacket(commid) != 0)
+        return FTMQ_ERR_BUSY;
+    return FTMQ_OK;
+}
+
+#ifdef FTMQ_MAX_TOPIC_IDS
+FTMQ_topic_alias *find_alias(uint16_t topic_id){
+    for (uint8_t i = 0; i < registered_FTMQ_topics; i++){
+        if (FTMQ_topics[i].id == topic_id)
+            return &FTMQ_topics[i];
+    }
+    return 0;
+}
+
+#ifdef FTMQ_MAX_SUBSCRIPTIONS
+// open addressing, the slot is the id modulo the table size
+FTMQ_topic_binding *find_binding(uint16_t topic_id){
+    uint8_t slot = topic_id % FTMQ_MAX_TOPIC_IDS;
+    for (uint8_t i = 0; i < FTMQ_MAX_TOPIC_IDS; i++){
+        if (FTMQ_bindings[slot].subscription == FTMQ_NO_SUBSCRIPTION)
+            return 0;
+        if (FTMQ_bindings[slot].id == topic_id)
+            return &FTMQ_bindings[slot];
+        slot = (slot + 1) % FTMQ_MAX_TOPIC_IDS;
+    }
+    return 0;
+}
+#endif
+#endif
+
+// links the subscription to the binding of its topic id, a full table only disables topic id frames for it
+void bind_subscription(uint8_t subscription){
+#if defined(FTMQ_MAX_TOPIC_IDS) && defined(FTMQ_MAX_SUBSCRIPTIONS)
+    FTMQ_receive_callback *sub = &FTMQ_callbacks[subscription];
+    uint16_t topic_id = fold_topic_id(sub->hash);
+    uint8_t slot = topic_id % FTMQ_MAX_TOPIC_IDS;
+    sub->next = FTMQ_NO_SUBSCRIPTION;
+    for (uint8_t i = 0; i < FTMQ_MAX_TOPIC_IDS; i++){
+        FTMQ_topic_binding *binding = &FTMQ_bindings[slot];
+        if (binding->subscription == FTMQ_NO_SUBSCRIPTION){
+            binding->id = topic_id;
+            binding->subscription = subscription;
+            binding->state = FTMQ_BINDING_UNBOUND;
+            binding->retry = 0;
+            return;
+        }
+        if (binding->id == topic_id){
+            FTMQ_receive_callback *first = &FTMQ_callbacks[binding->subscription];
+            if (first->topic_length != sub->topic_length || memcmp(first->msg, sub->msg, sub->topic_length) != 0)
+                binding->state = FTMQ_BINDING_CONFLICT; // two of our topics have the same id
+            sub->next = first->next;
+            first->next = subscription;
+            return;
+        }
+        slot = (slot + 1) % FTMQ_MAX_TOPIC_IDS;
+    }
+#endif
+}
+
+void dispatch_topic_id(uint8_t commid, uint8_t *data, int length){
+#if defined(FTMQ_MAX_TOPIC_IDS) && defined(FTMQ_MAX_SUBSCRIPTIONS)
+    if (length < FTMQ_TOPIC_ID_HEADER_LEN)
+        return;
+    uint16_t topic_id = data[1] | ((uint16_t)(data[2]) << 8);
+    uint8_t retained = 0;
+#ifdef FTMQ_STATIC_TOPICS
+    // the table knows its topics, their ids don't wait for an announcement
+    uint8_t index = find_static_topic_id(topic_id);
+    if (index != FTMQ_NO_STATIC_TOPIC && FTMQ_static_topics[index].receive != 0){
+        const FTMQ_static_topic *entry = &FTMQ_static_topics[index];
+        retain_message((const uint8_t*)entry->topic, entry->topic_length, data + FTMQ_TOPIC_ID_HEADER_LEN, length - FTMQ_TOPIC_ID_HEADER_LEN, 0);
+        retained = 1;
+        entry->receive(data + FTMQ_TOPIC_ID_HEADER_LEN, length - FTMQ_TOPIC_ID_HEADER_LEN);
+    }
+#endif
+    FTMQ_topic_binding *binding = find_binding(topic_id);
+    if (binding == 0)
+        return; // not subscribed
+    if (binding->state == FTMQ_BINDING_BOUND){
+        FTMQ_receive_callback *first = &FTMQ_callbacks[binding->subscription];
+        if (!retained)
+            retain_message(first->msg, first->topic_length, data + FTMQ_TOPIC_ID_HEADER_LEN, length - FTMQ_TOPIC_ID_HEADER_LEN, 0);
+        for (uint8_t i = binding->subscription; i != FTMQ_NO_SUBSCRIPTION; i = FTMQ_callbacks[i].next)
+            deliver(i, data + FTMQ_TOPIC_ID_HEADER_LEN, length - FTMQ_TOPIC_ID_HEADER_LEN);
+    } else if (binding->state == FTMQ_BINDING_UNBOUND && binding->retry == 0){
+        // we missed the announcement, ask the publisher to repeat it
+        send_topic_id_frame(commid, FTMQ_FRAME_REGISTER_REQUEST, topic_id, 0, 0);
+        binding->retry = FTMQ_REGISTER_RETRY;
+    }
+#endif
+}
+
+void register_topic_id(uint8_t *data, int length){
+#ifdef FTMQ_MAX_TOPIC_IDS
+    if (length <= FTMQ_TOPIC_ID_HEADER_LEN)
+        return;
+    uint16_t topic_id = data[1] | ((uint16_t)(data[2]) << 8);
+    const uint8_t *topic = data + FTMQ_TOPIC_ID_HEADER_LEN;
+    uint8_t topic_length = length - FTMQ_TOPIC_ID_HEADER_LEN;
+    // another node announcing a different topic with one of our ids
+    for (uint8_t i = 0; i < registered_FTMQ_topics; i++){
+        if (FTMQ_topics[i].id == topic_id &&
+            (FTMQ_topics[i].topic_length != topic_length || memcmp(FTMQ_topics[i].topic, topic, topic_length) != 0))
+            FTMQ_topics[i].flags |= FTMQ_ALIAS_CONFLICT;
+    }
+#ifdef FTMQ_MAX_SUBSCRIPTIONS
+#ifdef FTMQ_STATIC_TOPICS
+    uint8_t index = find_static_topic_id(topic_id);
+    if (index != FTMQ_NO_STATIC_TOPIC && (FTMQ_static_topics[index].topic_length != topic_length ||
+        memcmp(FTMQ_static_topics[index].topic, topic, topic_length) != 0))
+        FTMQ_static_conflicts[index / 8] |= 1 << (index % 8);
+#endif
+    FTMQ_topic_binding *binding = find_binding(topic_id);
+    if (binding == 0 || binding->state == FTMQ_BINDING_CONFLICT)
+        return;
+    FTMQ_receive_callback *sub = &FTMQ_callbacks[binding->subscription];
+    if (sub->topic_length == topic_length && memcmp(sub->msg, topic, topic_length) == 0)
+        binding->state = FTMQ_BINDING_BOUND;
+    else
+        binding->state = FTMQ_BINDING_CONFLICT;
+#endif
+#endif
+}
+
+// a subscriber missed the announcement, it is repeated before the next publish
+void request_registration(uint8_t *data, int length){
+#ifdef FTMQ_MAX_TOPIC_IDS
+    if (length < FTMQ_TOPIC_ID_HEADER_LEN)
+        return;
+    uint16_t topic_id = data[1] | ((uint16_t)(data[2]) << 8);
+    for (uint8_t i = 0; i < registered_FTMQ_topics; i++){
+        if (FTMQ_topics[i].id == topic_id)
+            FTMQ_topics[i].flags &= ~FTMQ_ALIAS_ANNOUNCED;
+    }
 #endif
 }
 
+// token bucket: telemetry waits for a whole frame token, commands are never held back but their debt delays the telemetry
+uint8_t take_tokens(uint8_t publish_class, uint8_t frames){
+#ifdef FTMQ_PACING_RATE
+#ifdef FTMQ_CLOCK_MS
+    refill_tokens(0);
+#endif
+    int32_t cost = (int32_t)frames * FTMQ_TOKEN;
+    if (publish_class == FTMQ_CLASS_COMMAND){
+        FTMQ_tokens -= cost;
+        if (FTMQ_tokens < -(int32_t)FTMQ_pacing_burst * FTMQ_TOKEN)
+            FTMQ_tokens = -(int32_t)FTMQ_pacing_burst * FTMQ_TOKEN;
+        return 1;
+    }
+    if (held_FTMQ_frames > 0 || FTMQ_tokens < cost)
+        return 0; // the held frames go first
+    FTMQ_tokens -= cost;
+#endif
+    return 1;
+}
+
+// a held frame with the same key (topic) takes the new payload, the old value is never sent
+uint8_t hold_frame(uint8_t commid, const uint8_t *key, uint8_t key_length, const uint8_t *payload, uint16_t payload_length){
+#ifdef FTMQ_PACING_RATE
+    FTMQ_paced_frame *frame = 0;
+    for (uint8_t i = 0; i < held_FTMQ_frames; i++){
+        if (FTMQ_held_frames[i].commid == commid && FTMQ_held_frames[i].key_length == key_length &&
+            memcmp(FTMQ_held_frames[i].data, key, key_length) == 0){
+            frame = &FTMQ_held_frames[i];
+            break;
+        }
+    }
+    if (frame == 0){
+        if (held_FTMQ_frames >= FTMQ_PACING_QUEUE)
+            return FTMQ_ERR_BUSY;
+        frame = &FTMQ_held_frames[held_FTMQ_frames++];
+    }
+    frame->commid = commid;
+    frame->key_length = key_length;
+    frame->length = key_length + payload_length;
+    memcpy(frame->data, key, key_length);
+    memcpy(frame->data + key_length, payload, payload_length);
+    return FTMQ_OK;
+#else
+    return FTMQ_ERR_BUSY;
+#endif
+}
+
+// adds the tokens of the elapsed ms, taken from FTMQ_CLOCK_MS when the platform has one
+void refill_tokens(uint32_t elapsed){
+#ifdef FTMQ_PACING_RATE
+#ifdef FTMQ_CLOCK_MS
+    uint32_t now = FTMQ_CLOCK_MS();
+    elapsed = now - FTMQ_pacing_time;
+    FTMQ_pacing_time = now;
+#endif
+    int32_t full = (int32_t)FTMQ_pacing_burst * FTMQ_TOKEN;
+    if (FTMQ_tokens >= full || FTMQ_pacing_rate == 0)
+        return;
+    if (elapsed > (uint32_t)(full - FTMQ_tokens) / FTMQ_pacing_rate)
+        FTMQ_tokens = full; // also keeps elapsed * rate from overflowing after a long pause
+    else
+        FTMQ_tokens += (int32_t)(elapsed * FTMQ_pacing_rate);
+#endif
+}
+
+// sends the held frames the bucket allows, a busy comm is left for the next call instead of waiting for it
+void send_held_frames(){
+#ifdef FTMQ_PACING_RATE
+    while (held_FTMQ_frames > 0 && FTMQ_tokens >= FTMQ_TOKEN){
+        FTMQ_paced_frame *frame = &FTMQ_held_frames[0];
+        if (CCP_busy(frame->commid) || CCP_sendPacket(frame->commid, CCP_FTMQ_QUEUE, frame->data, frame->length) != 0)
+            break;
+        FTMQ_tokens -= FTMQ_TOKEN;
+        held_FTMQ_frames--;
+        memmove(&FTMQ_held_frames[0], &FTMQ_held_frames[1], held_FTMQ_frames * sizeof(FTMQ_paced_frame));
+    }
+#endif
+}
+
+// refills the bucket and sends the held frames, called every msec
+void manage_pacing(){
+    refill_tokens(1);
+    send_held_frames();
+}
+
+// | FTMQ_FRAME_PACING | burst | rate (2 bytes) |, the budget the FT Click can take from this node
+void set_pacing(uint8_t *data, int length){
+    if (length < 4 || data[1] == 0)
+        return;
+    FTMQ_set_pacing(data[1], data[2] | ((uint16_t)(data[3]) << 8));
+}
+
+// replaces the entry of the topic, the oldest entries are dropped when the arena is full
+void retain_message(const uint8_t *topic, uint8_t topic_length, const uint8_t *payload, uint16_t payload_length, uint8_t flags){
+#ifdef FTMQ_RETAINED_ARENA
+    uint16_t size = FTMQ_RETAINED_HEADER_LEN + topic_length + payload_length;
+    if (size > FTMQ_RETAINED_ARENA || payload_length > 0xFF)
+        return;
+    uint8_t *entry = find_retained(topic, topic_length);
+    if (entry != 0){
+        flags |= entry[0]; // a pending answer gets the new value
+        if (entry[2] == payload_length){
+            entry[0] = flags;
+            memcpy(entry + FTMQ_RETAINED_HEADER_LEN + topic_length, payload, payload_length);
+            return;
+        }
+        remove_retained(entry);
+    }
+    while (FTMQ_retained_length + size > FTMQ_RETAINED_ARENA)
+        remove_retained(FTMQ_retained);
+    entry = FTMQ_retained + FTMQ_retained_length;
+    entry[0] = flags;
+    entry[1] = topic_length;
+    entry[2] = payload_length;
+    memcpy(entry + FTMQ_RETAINED_HEADER_LEN, topic, topic_length);
+    memcpy(entry + FTMQ_RETAINED_HEADER_LEN + topic_length, payload, payload_length);
+    FTMQ_retained_length += size;
+#endif
+}
+
+void reserve_retained(const char *topic, uint8_t topic_length, uint8_t *payload){
+#ifdef FTMQ_RETAINED_ARENA
+    FTMQ_reserved_topic = topic;
+    FTMQ_reserved_topic_length = topic_length;
+    FTMQ_reserved_payload = payload;
+#endif
+}
+
+// | FTMQ_FRAME_RETAINED_REQUEST | topic |, the entries published by this node are sent again, all of them if there is no topic
+void request_retained(uint8_t commid, uint8_t *data, int length){
+#ifdef FTMQ_RETAINED_ARENA
+    uint16_t pos = 0;
+    while (pos < FTMQ_retained_length){
+        uint8_t *entry = FTMQ_retained + pos;
+        if ((entry[0] & FTMQ_RETAINED_OWN) &&
+            (length == 1 || (entry[1] == length - 1 && memcmp(entry + FTMQ_RETAINED_HEADER_LEN, data + 1, entry[1]) == 0)))
+            entry[0] |= FTMQ_RETAINED_ANSWER;
+        pos += FTMQ_RETAINED_HEADER_LEN + entry[1] + entry[2];
+    }
+    FTMQ_retained_commid = commid;
+#endif
+}
+
+// publishes the requested entries as regular frames, as fast as the pacing allows, called every msec
+void answer_retained(){
+#ifdef FTMQ_RETAINED_ARENA
+    uint16_t pos = 0;
+    while (pos < FTMQ_retained_length){
+        uint8_t *entry = FTMQ_retained + pos;
+        uint8_t topic_length = entry[1];
+        uint8_t payload_length = entry[2];
+        if (entry[0] & FTMQ_RETAINED_ANSWER){
+            if (CCP_busy(FTMQ_retained_commid))
+                return; // the uart is still sending, the tick doesn't wait for it
+            if (!take_tokens(FTMQ_CLASS_TELEMETRY, 1))
+                return;
+            if (CCP_beginPacket(FTMQ_retained_commid, CCP_FTMQ_QUEUE, topic_length + 1 + payload_length) != 0)
+                return; // the token is lost, the answer goes on the next tick
+            CCP_writePacket(FTMQ_retained_commid, entry + FTMQ_RETAINED_HEADER_LEN, topic_length);
+            CCP_writePacket(FTMQ_retained_commid, &FTMQ_separator, 1);
+            CCP_writePacket(FTMQ_retained_commid, entry + FTMQ_RETAINED_HEADER_LEN + topic_length, payload_length);
+            if (CCP_endPacket(FTMQ_retained_commid) != 0)
+                return;
+            entry[0] &= ~FTMQ_RETAINED_ANSWER;
+        }
+        pos += FTMQ_RETAINED_HEADER_LEN + topic_length + payload_length;
+    }
+#endif
+}
+
+#ifdef FTMQ_RETAINED_ARENA
+uint8_t *find_retained(const uint8_t *topic, uint8_t topic_length){
+    uint16_t pos = 0;
+    while (pos < FTMQ_retained_length){
+        uint8_t *entry = FTMQ_retained + pos;
+        if (entry[1] == topic_length && memcmp(entry + FTMQ_RETAINED_HEADER_LEN, topic, topic_length) == 0)
+            return entry;
+        pos += FTMQ_RETAINED_HEADER_LEN + entry[1] + entry[2];
+    }
+    return 0;
+}
+
+void remove_retained(uint8_t *entry){
+    uint16_t size = FTMQ_RETAINED_HEADER_LEN + entry[1] + entry[2];
+    uint16_t end = (entry - FTMQ_retained) + size;
+    memmove(entry, entry + size, FTMQ_retained_length - end);
+    FTMQ_retained_length -= size;
+}
+#endif
+
+// the responder writes the response straight into the ccp output buffer
+void answer_request(uint8_t commid, uint8_t *data, int length){
+#ifdef FTMQ_MAX_RESPONDERS
+    if (length <= FTMQ_RPC_HEADER_LEN)
+        return;
+    uint8_t *topic = data + FTMQ_RPC_HEADER_LEN;
+    uint8_t *separator = memchr(topic, FTMQ_SEPARATOR, length - FTMQ_RPC_HEADER_LEN);
+    if (separator == 0)
+        return;
+    for (uint8_t i = 0; i < registered_FTMQ_responders; i++){
+        FTMQ_responder *responder = &FTMQ_responders[i];
+        if (responder->topic_length != separator - topic || memcmp(responder->topic, topic, responder->topic_length) != 0)
+            continue;
+        uint8_t header[FTMQ_RPC_HEADER_LEN] = { FTMQ_FRAME_RESPONSE, data[1], data[2], data[3] };
+        take_tokens(FTMQ_CLASS_COMMAND, 1);
+        if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, CCP_UNKNOWN_LENGTH) != 0)
+            return; // the requester times out
+        CCP_writePacket(commid, header, FTMQ_RPC_HEADER_LEN);
+        uint8_t *response = CCP_reservePacket(commid, FTMQ_MAX_PACKET_LEN - FTMQ_RPC_HEADER_LEN);
+        if (response == 0){
+            CCP_abortPacket(commid);
+            return;
+        }
+        uint16_t response_length = responder->respond(separator + 1, length - (separator + 1 - data), response, FTMQ_MAX_PACKET_LEN - FTMQ_RPC_HEADER_LEN);
+        if (CCP_commitPacket(commid, response_length) != 0){
+            CCP_abortPacket(commid);
+            return;
+        }
+        CCP_endPacket(commid);
+        return; // one response per node
+    }
+#endif
+}
+
+// the first response frees the request, the later ones (other responders) are dropped
+void dispatch_response(uint8_t *data, int length){
+#ifdef FTMQ_MAX_PENDING
+    if (length < FTMQ_RPC_HEADER_LEN)
+        return;
+    uint16_t source_id = data[1] | ((uint16_t)(data[2]) << 8);
+    if (source_id != FTMQ_source_id)
+        return; // response to another node
+    for (uint8_t i = 0; i < FTMQ_MAX_PENDING; i++){
+        FTMQ_pending_request *pending = &FTMQ_pending[i];
+        if (pending->timeout > 0 && pending->sequence == data[3]){
+            pending->timeout = 0; // free the slot before calling the application, it can send a new request
+            pending->cb(FTMQ_OK, data + FTMQ_RPC_HEADER_LEN, length - FTMQ_RPC_HEADER_LEN);
+            return;
+        }
+    }
+#endif
+}
+
+// called every msec, expired requests get FTMQ_ERR_TIMEOUT
+void manage_requests(){
+#ifdef FTMQ_MAX_PENDING
+    for (uint8_t i = 0; i < FTMQ_MAX_PENDING; i++){
+        FTMQ_pending_request *pending = &FTMQ_pending[i];
+        if (pending->timeout > 0 && --pending->timeout == 0)
+            pending->cb(FTMQ_ERR_TIMEOUT, 0, 0);
+    }
+#endif
+}
+
+// FNV-1a, also the first step of the topic id
+uint32_t hash_topic(const uint8_t *topic, uint8_t topic_length){
+    uint32_t hash = 2166136261UL;
+    for (uint8_t i = 0; i < topic_length; i++){
+        hash ^= topic[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+// FNV-1a folded to 16 bits
+uint16_t fold_topic_id(uint32_t hash){
+    return (uint16_t)(hash ^ (hash >> 16));
+}
+
+// minimal perfect hash: the seed of the bucket sends each topic of the table to its own slot
+uint8_t find_static_topic(const uint8_t *topic, uint8_t topic_length, uint32_t hash){
+#ifdef FTMQ_STATIC_TOPICS
+    uint16_t seed = FTMQ_static_seeds[hash % FTMQ_STATIC_BUCKETS];
+    uint8_t index = ((uint32_t)((hash ^ seed) * 2654435761UL) >> 16) % FTMQ_STATIC_TOPICS;
+    const FTMQ_static_topic *entry = &FTMQ_static_topics[index];
+    if (entry->hash != hash || entry->topic_length != topic_length || memcmp(entry->topic, topic, topic_length) != 0)
+        return FTMQ_NO_STATIC_TOPIC;
+    return index;
+#else
+    return FTMQ_NO_STATIC_TOPIC;
+#endif
+}
+
+// the entry of a topic id frame: the ids of the table are folded from its hashes (the generator rejects two equal ids)
+uint8_t find_static_topic_id(uint16_t topic_id){
+#if defined(FTMQ_STATIC_TOPICS) && defined(FTMQ_MAX_TOPIC_IDS)
+    for (uint8_t i = 0; i < FTMQ_STATIC_TOPICS; i++){
+        if (fold_topic_id(FTMQ_static_topics[i].hash) == topic_id)
+            return (FTMQ_static_conflicts[i / 8] & (1 << (i % 8))) ? FTMQ_NO_STATIC_TOPIC : i;
+    }
+#endif
+    return FTMQ_NO_STATIC_TOPIC;
+}
@@ -40,14 +40,130 @@
 #define FTMQ_H
 #include "stdint.h"
 
-#define FTMQ_MAX_PACKET_LEN 49 // limit of LonSendMsg. to support bigger we have to handle fragmentation
+#define FTMQ_MAX_PACKET_LEN 49 // limit of LonSendMsg. bigger messages are fragmented, see FTMQ_MAX_MESSAGE_LEN in ftmq_config.h
+
+// regular frames start with the topic (printable), extended frames start with one of these
+#define FTMQ_FRAME_FRAGMENT 0x01
+#define FTMQ_FRAME_TOPIC_ID 0x02
+#define FTMQ_FRAME_REGISTER 0x03
+#define FTMQ_FRAME_REGISTER_REQUEST 0x04
+#define FTMQ_FRAME_FILTERED 0x05 // FT Click to host only
+#define FTMQ_FRAME_PACING 0x06 // FT Click to host only: | FTMQ_FRAME_PACING | burst | rate (2 bytes) |
+#define FTMQ_FRAME_RETAINED_REQUEST 0x07 // | FTMQ_FRAME_RETAINED_REQUEST | topic (optional) |, see FTMQ_request_retained
+#define FTMQ_FRAME_REQUEST 0x08
+#define FTMQ_FRAME_RESPONSE 0x09
+
+// fragment frame: | FTMQ_FRAME_FRAGMENT | source id (2 bytes) | message id | index | count | chunk of topic\0payload |
+#define FTMQ_FRAGMENT_HEADER_LEN 6
+
+// topic id frame:          | FTMQ_FRAME_TOPIC_ID | topic id (2 bytes) | payload |
+// register frame:          | FTMQ_FRAME_REGISTER | topic id (2 bytes) | topic |
+// register request frame:  | FTMQ_FRAME_REGISTER_REQUEST | topic id (2 bytes) |
+#define FTMQ_TOPIC_ID_HEADER_LEN 3
+
+// filtered frame: | FTMQ_FRAME_FILTERED | mask of the matching host subscriptions (2 bytes) | frame |
+// sent by the FT Click when it handles the subscriptions (FTMQ_MAX_SUBSCRIPTIONS undefined)
+#define FTMQ_FILTERED_HEADER_LEN 3
+#define FTMQ_MAX_FILTERS 16 // one bit each in the mask
+
+// request frame:   | FTMQ_FRAME_REQUEST | source id (2 bytes) | sequence | topic\0payload |
+// response frame:  | FTMQ_FRAME_RESPONSE | source id of the requester (2 bytes) | sequence | payload |
+#define FTMQ_RPC_HEADER_LEN 4
+
+// return codes
+#define FTMQ_OK             0
+#define FTMQ_ERR_BUSY       1 // the comm couldn't start the transfer
+#define FTMQ_ERR_TOO_LONG   2 // topic + payload don't fit in a packet (or in FTMQ_MAX_MESSAGE_LEN)
+#define FTMQ_ERR_NO_TOPIC   3 // the topic id wasn't registered with FTMQ_register_topic
+#define FTMQ_ERR_FULL       4 // no room for another subscription (or pending request, responder)
+#define FTMQ_ERR_TIMEOUT    5 // no response to the request, given to the FTMQ_response_cb_t
+#define FTMQ_ERR_NO_SOURCE  6 // FTMQ_request needs FTMQ_set_source_id when the config has no FTMQ_DEFAULT_SOURCE_ID
+
+// deferred delivery policies, see FTMQ_subscribe_deferred
+#define FTMQ_DEFER_LATEST 0 // keeps only the newest message
+#define FTMQ_DEFER_FIFO   1 // keeps up to depth messages, newer ones are dropped while it is full
+
+// publish classes, see FTMQ_PACING_RATE in ftmq_config.h
+#define FTMQ_CLASS_TELEMETRY 0 // paced, held back (and coalesced by topic) when the node is over its budget
+#define FTMQ_CLASS_COMMAND   1 // never held back
 
 //callback function pointers to be registeres to spe topics
 typedef void (*FTMQ_receive_cb_t)(uint8_t *payload, uint16_t payload_length);
+// status is FTMQ_OK with the response payload, or FTMQ_ERR_TIMEOUT
+typedef void (*FTMQ_response_cb_t)(uint8_t status, uint8_t *payload, uint16_t payload_length);
+// serializes the response in place (up to max_response_length bytes) and returns its length
+typedef uint16_t (*FTMQ_responder_cb_t)(uint8_t *request, uint16_t request_length, uint8_t *response, uint16_t max_response_length);
+
+// build-time topic table (const, in flash) generated by utilities/ftmq_topic_table.py, see FTMQ_STATIC_TOPICS in ftmq_config.h
+typedef struct FTMQ_static_topic {
+    const char *topic;
+    uint32_t hash; // FNV-1a of the topic, compared before the string
+    uint8_t topic_length;
+    FTMQ_receive_cb_t receive; // 0 if the topic is only looked up
+} FTMQ_static_topic;
+
+#define FTMQ_NO_STATIC_TOPIC 0xFF
+
+// topic descriptor: length and hash computed at build time from a string literal, FTMQ_TOPIC("temperature")
+typedef struct FTMQ_topic {
+    const char *name;
+    uint8_t length;
+    uint32_t hash; // FNV-1a of the topic, the same as FTMQ_topic_id before folding
+} FTMQ_topic;
+
+#define FTMQ_FNV_OFFSET 2166136261UL
+#define FTMQ_FNV_PRIME  16777619UL
+#define FTMQ_TOPIC_ID(t) ((uint16_t)((t).hash ^ ((t).hash >> 16))) // the same as FTMQ_topic_id
+
+#ifdef __cplusplus
+extern "C++" {
+constexpr uint32_t FTMQ_hash_literal(const char *s, uint32_t hash) {
+    return *s ? FTMQ_hash_literal(s + 1, (uint32_t)((hash ^ (uint8_t)*s) * FTMQ_FNV_PRIME)) : hash;
+}
+template <uint32_t hash> struct FTMQ_hash_constant { static const uint32_t value = hash; }; // forces the build time evaluation
+}
+#define FTMQ_TOPIC(s) (FTMQ_topic{ s, (uint8_t)(sizeof(s) - 1), FTMQ_hash_constant<FTMQ_hash_literal(s, FTMQ_FNV_OFFSET)>::value })
+#else
+// one FNV-1a step per character, the steps past the end of the literal leave the hash as is. Constant folded by the compiler
+#define FTMQ_HASH_STEP(s, i, h) ((uint32_t)(((h) ^ (uint8_t)((i) < sizeof(s) - 1 ? (s)[(i) < sizeof(s) - 1 ? (i) : 0] : 0)) \
+                                            * ((i) < sizeof(s) - 1 ? FTMQ_FNV_PRIME : 1UL)))
+#define FTMQ_HASH_4(s, i, h)  FTMQ_HASH_STEP(s, (i) + 3, FTMQ_HASH_STEP(s, (i) + 2, FTMQ_HASH_STEP(s, (i) + 1, FTMQ_HASH_STEP(s, i, h))))
+#define FTMQ_HASH_16(s, i, h) FTMQ_HASH_4(s, (i) + 12, FTMQ_HASH_4(s, (i) + 8, FTMQ_HASH_4(s, (i) + 4, FTMQ_HASH_4(s, i, h))))
+#define FTMQ_HASH_LITERAL(s)  FTMQ_HASH_16(s, 32, FTMQ_HASH_16(s, 16, FTMQ_HASH_16(s, 0, FTMQ_FNV_OFFSET)))
+// the array size is negative (build error) for topics that don't fit in a frame
+#define FTMQ_TOPIC(s) ((FTMQ_topic){ s, (uint8_t)(sizeof(s) - 1 + 0 * sizeof(char[sizeof(s) < FTMQ_MAX_PACKET_LEN ? 1 : -1])), FTMQ_HASH_LITERAL(s) })
+#endif
 
 void FTMQ_init(void);
-uint8_t FTMQ_publish(uint8_t commid, const char *topic, const uint8_t* payload, uint16_t payload_length);
+uint8_t FTMQ_publish(uint8_t commid, const char *topic, const uint8_t* payload, uint16_t payload_length); // FTMQ_CLASS_TELEMETRY
+uint8_t FTMQ_publish_class(uint8_t commid, const char *topic, const uint8_t* payload, uint16_t payload_length, uint8_t publish_class);
+uint8_t FTMQ_publish_topic(uint8_t commid, FTMQ_topic topic, const uint8_t* payload, uint16_t payload_length); // FTMQ_publish_topic(commid, FTMQ_TOPIC("x"), ...)
+// zero copy publish: serialize the payload straight into the frame returned by FTMQ_reserve, then FTMQ_commit
+uint8_t *FTMQ_reserve(uint8_t commid, const char *topic, uint16_t max_payload_length);
+uint8_t FTMQ_commit(uint8_t commid, uint16_t payload_length);
+// without FTMQ_MAX_SUBSCRIPTIONS the FT Click filters the messages: topic can use the + and # wildcards and must stay valid (string literal)
 uint8_t FTMQ_subscribe(uint8_t commid, const char *topic, FTMQ_receive_cb_t cb);
-uint8_t FTMQ_sub_lookup(const char *topic);
+uint8_t FTMQ_subscribe_topic(uint8_t commid, FTMQ_topic topic, FTMQ_receive_cb_t cb);
+uint8_t FTMQ_resubscribe(uint8_t commid); // sends the subscriptions again after a FT Click reset
+// the messages are queued and the callback is called from FTMQ_process instead of CCP_poll_1msec, see FTMQ_DEFERRED_SLOTS
+uint8_t FTMQ_subscribe_deferred(uint8_t commid, const char *topic, FTMQ_receive_cb_t cb, uint8_t policy, uint8_t depth);
+uint8_t FTMQ_process(uint8_t budget); // delivers up to budget queued messages, returns how many are left
+void FTMQ_set_pacing(uint8_t burst, uint16_t rate); // frames, frames per second
+uint8_t FTMQ_request_pacing(uint8_t commid); // asks the FT Click for the budget it can take, answered with FTMQ_FRAME_PACING
+// latest value cache, see FTMQ_RETAINED_ARENA in ftmq_config.h
+uint16_t FTMQ_get_retained(const char *topic, uint8_t *buffer, uint16_t size); // returns the payload length, 0 if not cached
+uint8_t FTMQ_request_retained(uint8_t commid, const char *topic); // the publishers send their last value again, topic 0 for all
+uint8_t FTMQ_sub_lookup(const char *topic); // index in the build-time table (FTMQ_TOPIC_xxx), FTMQ_NO_STATIC_TOPIC if it isn't there
 uint8_t FTMQ_payload();
+void FTMQ_set_source_id(uint16_t source_id); // identifies this node in fragmented messages and requests, FTMQ_DEFAULT_SOURCE_ID() by default
+
+// request/response: the first response is given to cb, or FTMQ_ERR_TIMEOUT after timeout ms. See FTMQ_MAX_PENDING in ftmq_config.h
+uint8_t FTMQ_request(uint8_t commid, const char *topic, const uint8_t *payload, uint16_t payload_length, uint16_t timeout, FTMQ_response_cb_t cb);
+uint8_t FTMQ_respond(const char *topic, FTMQ_responder_cb_t cb); // answers the requests to topic, which must stay valid (string literal)
+
+// topic ids: frames carry a 16 bit id instead of the topic string, see FTMQ_MAX_TOPIC_IDS in ftmq_config.h
+uint16_t FTMQ_topic_id(const char *topic); // the same on every node
+uint16_t FTMQ_register_topic(uint8_t commid, const char *topic); // announces topic -> id, the topic must stay valid (string literal)
+uint8_t FTMQ_publish_id(uint8_t commid, uint16_t topic_id, const uint8_t* payload, uint16_t payload_length);
+uint8_t *FTMQ_reserve_id(uint8_t commid, uint16_t topic_id, uint16_t max_payload_length);
 #endif
@@ -159,7 +159,10 @@ int main(void)
   serial_comm_id = CCP_register_comm(&serial_comm);
 
   FTMQ_init();
-  FTMQ_subscribe(serial_comm_id, "button", ledCallback);
+  // ledCallback blocks on i2c, it runs from FTMQ_process with the newest button state
+  FTMQ_subscribe_deferred(serial_comm_id, "button", ledCallback, FTMQ_DEFER_LATEST, 1);
+  // the button node sends its last state again, the strip doesn't wait for the next press
+  FTMQ_request_retained(serial_comm_id, "button");
 
   ClickLED3_Reset();
   ClickLED3_SetIntensity(40);
@@ -170,6 +173,7 @@ int main(void)
 	// all code in ledCallback()
 	HAL_Delay(1);
 	CCP_poll_1msec();
+	FTMQ_process(1);
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -0,0 +1,191 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#include "ftmq_codec.h"
+
+#include "string.h"
+
+// ------------ PRIVATE FUNCTION PROTOTYPES ---------------------------------
+uint8_t codec_put(FTMQ_codec *codec, uint8_t tag, uint8_t type, uint32_t value, uint8_t size);
+uint8_t codec_type_size(uint8_t type);
+
+// ------------ PUBLIC FUNCTIONS -------------------------------------
+
+void FTMQ_codec_begin(FTMQ_codec *codec, uint8_t *buffer, uint16_t size) {
+    codec->buffer = buffer;
+    codec->size = size;
+    codec->length = 0;
+    if (size > 0)
+        codec->buffer[codec->length++] = FTMQ_CODEC_MARKER;
+}
+
+uint8_t FTMQ_codec_put_uint8(FTMQ_codec *codec, uint8_t tag, uint8_t value) {
+    return codec_put(codec, tag, FTMQ_TYPE_UINT8, value, 1);
+}
+
+uint8_t FTMQ_codec_put_int8(FTMQ_codec *codec, uint8_t tag, int8_t value) {
+    return codec_put(codec, tag, FTMQ_TYPE_INT8, (uint8_t)value, 1);
+}
+
+uint8_t FTMQ_codec_put_uint16(FTMQ_codec *codec, uint8_t tag, uint16_t value) {
+    return codec_put(codec, tag, FTMQ_TYPE_UINT16, value, 2);
+}
+
+uint8_t FTMQ_codec_put_int16(FTMQ_codec *codec, uint8_t tag, int16_t value) {
+    return codec_put(codec, tag, FTMQ_TYPE_INT16, (uint16_t)value, 2);
+}
+
+uint8_t FTMQ_codec_put_uint32(FTMQ_codec *codec, uint8_t tag, uint32_t value) {
+    return codec_put(codec, tag, FTMQ_TYPE_UINT32, value, 4);
+}
+
+uint8_t FTMQ_codec_put_int32(FTMQ_codec *codec, uint8_t tag, int32_t value) {
+    return codec_put(codec, tag, FTMQ_TYPE_INT32, (uint32_t)value, 4);
+}
+
+uint8_t FTMQ_codec_put_float(FTMQ_codec *codec, uint8_t tag, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, 4); // IEEE 754 single precision on both arm and avr
+    return codec_put(codec, tag, FTMQ_TYPE_FLOAT, bits, 4);
+}
+
+uint8_t FTMQ_codec_put_bytes(FTMQ_codec *codec, uint8_t tag, const uint8_t *data, uint8_t length) {
+    if (tag > FTMQ_MAX_TAG || codec->length + 2 + length > codec->size)
+        return 0;
+    codec->buffer[codec->length++] = (tag << 3) | FTMQ_TYPE_BYTES;
+    codec->buffer[codec->length++] = length;
+    memcpy(codec->buffer + codec->length, data, length);
+    codec->length += length;
+    return 1;
+}
+
+uint16_t FTMQ_codec_length(FTMQ_codec *codec) {
+    return codec->length;
+}
+
+uint8_t FTMQ_codec_is_binary(const uint8_t *payload, uint16_t length) {
+    return length > 0 && payload[0] == FTMQ_CODEC_MARKER;
+}
+
+void FTMQ_codec_open(FTMQ_codec *codec, const uint8_t *payload, uint16_t length) {
+    codec->buffer = (uint8_t *)payload;
+    codec->size = length;
+    codec->length = FTMQ_codec_is_binary(payload, length) ? 1 : length; // text payload, no fields to read
+}
+
+uint8_t FTMQ_codec_next(FTMQ_codec *codec, FTMQ_codec_field *field) {
+    if (codec->length >= codec->size)
+        return 0;
+    uint8_t key = codec->buffer[codec->length++];
+    field->tag = key >> 3;
+    field->type = key & 0x07;
+    if (field->type == FTMQ_TYPE_BYTES) {
+        if (codec->length >= codec->size)
+            return 0;
+        field->length = codec->buffer[codec->length++];
+    } else {
+        field->length = codec_type_size(field->type);
+    }
+    if (codec->length + field->length > codec->size) {
+        codec->length = codec->size; // truncated payload
+        return 0;
+    }
+    field->value = codec->buffer + codec->length;
+    codec->length += field->length;
+    return 1;
+}
+
+uint8_t FTMQ_codec_find(const uint8_t *payload, uint16_t length, uint8_t tag, FTMQ_codec_field *field) {
+    FTMQ_codec codec;
+    FTMQ_codec_open(&codec, payload, length);
+    while (FTMQ_codec_next(&codec, field)) {
+        if (field->tag == tag)
+            return 1;
+    }
+    return 0;
+}
+
+int32_t FTMQ_codec_get_int(const FTMQ_codec_field *field) {
+    const uint8_t *v = field->value;
+    switch (field->type) {
+        case FTMQ_TYPE_UINT8:  return v[0];
+        case FTMQ_TYPE_INT8:   return (int8_t)v[0];
+        case FTMQ_TYPE_UINT16: return (uint16_t)(v[0] | ((uint16_t)v[1] << 8));
+        case FTMQ_TYPE_INT16:  return (int16_t)(v[0] | ((uint16_t)v[1] << 8));
+        case FTMQ_TYPE_INT32:
+        case FTMQ_TYPE_UINT32: return (int32_t)(v[0] | ((uint32_t)v[1] << 8) | ((uint32_t)v[2] << 16) | ((uint32_t)v[3] << 24));
+        case FTMQ_TYPE_FLOAT:  return (int32_t)FTMQ_codec_get_float(field);
+        default:               return 0;
+    }
+}
+
+float FTMQ_codec_get_float(const FTMQ_codec_field *field) {
+    if (field->type == FTMQ_TYPE_FLOAT) {
+        const uint8_t *v = field->value;
+        uint32_t bits = v[0] | ((uint32_t)v[1] << 8) | ((uint32_t)v[2] << 16) | ((uint32_t)v[3] << 24);
+        float value;
+        memcpy(&value, &bits, 4);
+        return value;
+    }
+    if (field->type == FTMQ_TYPE_UINT32)
+        return (float)(uint32_t)FTMQ_codec_get_int(field);
+    return (float)FTMQ_codec_get_int(field);
+}
+
+// ------------ PRIVATE FUNCTIONS -------------------------------------
+
+uint8_t codec_put(FTMQ_codec *codec, uint8_t tag, uint8_t type, uint32_t value, uint8_t size) {
+    if (tag > FTMQ_MAX_TAG || codec->length + 1 + size > codec->size)
+        return 0;
+    codec->buffer[codec->length++] = (tag << 3) | type;
+    for (uint8_t i = 0; i < size; i++) {
+        codec->buffer[codec->length++] = (uint8_t)(value & 0xff);
+        value >>= 8;
+    }
+    return 1;
+}
+
+uint8_t codec_type_size(uint8_t type) {
+    switch (type) {
+        case FTMQ_TYPE_UINT8:
+        case FTMQ_TYPE_INT8:   return 1;
+        case FTMQ_TYPE_UINT16:
+        case FTMQ_TYPE_INT16:  return 2;
+        default:               return 4;
+    }
+}
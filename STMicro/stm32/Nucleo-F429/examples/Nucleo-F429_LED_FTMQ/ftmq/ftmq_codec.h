@@ -0,0 +1,106 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#ifndef FTMQ_CODEC_H
+#define FTMQ_CODEC_H
+#include "stdint.h"
+
+// Compact binary payloads, an alternative to JSON text.
+// | FTMQ_CODEC_MARKER | key | value | key | value | ...
+// key = tag << 3 | type, the value size depends on the type (little endian).
+// The marker is never the first byte of a text payload, so JSON and binary can share a topic.
+#define FTMQ_CODEC_MARKER 0xB1
+
+#define FTMQ_TYPE_UINT8   0
+#define FTMQ_TYPE_INT8    1
+#define FTMQ_TYPE_UINT16  2
+#define FTMQ_TYPE_INT16   3
+#define FTMQ_TYPE_INT32   4
+#define FTMQ_TYPE_FLOAT   5
+#define FTMQ_TYPE_BYTES   6 // length byte + data
+#define FTMQ_TYPE_UINT32  7
+
+#define FTMQ_MAX_TAG 31
+
+// well known tags, named the same in utilities/ftmq_codec.py. Applications can use from 16 to FTMQ_MAX_TAG
+#define FTMQ_TAG_VALUE        0
+#define FTMQ_TAG_TEMPERATURE  1
+#define FTMQ_TAG_HUMIDITY     2
+#define FTMQ_TAG_PRESSURE     3
+#define FTMQ_TAG_AQI          4
+#define FTMQ_TAG_LED          5
+#define FTMQ_TAG_BUTTON       6
+#define FTMQ_TAG_MIN          7 // window summaries, see ftmq_report.h
+#define FTMQ_TAG_MAX          8
+#define FTMQ_TAG_MEAN         9
+#define FTMQ_TAG_COUNT        10
+
+typedef struct FTMQ_codec {
+    uint8_t *buffer;
+    uint16_t size;
+    uint16_t length; // bytes written, or read position when decoding
+} FTMQ_codec;
+
+typedef struct FTMQ_codec_field {
+    uint8_t tag;
+    uint8_t type;
+    const uint8_t *value;
+    uint8_t length;
+} FTMQ_codec_field;
+
+// encoding, the put functions return 0 if there is no room left
+void FTMQ_codec_begin(FTMQ_codec *codec, uint8_t *buffer, uint16_t size);
+uint8_t FTMQ_codec_put_uint8(FTMQ_codec *codec, uint8_t tag, uint8_t value);
+uint8_t FTMQ_codec_put_int8(FTMQ_codec *codec, uint8_t tag, int8_t value);
+uint8_t FTMQ_codec_put_uint16(FTMQ_codec *codec, uint8_t tag, uint16_t value);
+uint8_t FTMQ_codec_put_int16(FTMQ_codec *codec, uint8_t tag, int16_t value);
+uint8_t FTMQ_codec_put_uint32(FTMQ_codec *codec, uint8_t tag, uint32_t value);
+uint8_t FTMQ_codec_put_int32(FTMQ_codec *codec, uint8_t tag, int32_t value);
+uint8_t FTMQ_codec_put_float(FTMQ_codec *codec, uint8_t tag, float value);
+uint8_t FTMQ_codec_put_bytes(FTMQ_codec *codec, uint8_t tag, const uint8_t *data, uint8_t length);
+uint16_t FTMQ_codec_length(FTMQ_codec *codec);
+
+// decoding
+uint8_t FTMQ_codec_is_binary(const uint8_t *payload, uint16_t length);
+void FTMQ_codec_open(FTMQ_codec *codec, const uint8_t *payload, uint16_t length);
+uint8_t FTMQ_codec_next(FTMQ_codec *codec, FTMQ_codec_field *field); // 0 when there are no more fields
+uint8_t FTMQ_codec_find(const uint8_t *payload, uint16_t length, uint8_t tag, FTMQ_codec_field *field);
+int32_t FTMQ_codec_get_int(const FTMQ_codec_field *field);
+float FTMQ_codec_get_float(const FTMQ_codec_field *field);
+
+#endif
@@ -36,4 +36,46 @@
 *
 ****************************************************************************************/
 
+// comment out FTMQ_MAX_SUBSCRIPTIONS to let the FTclick filter the subscriptions (needs ftmq_filter in the FTclick)
 #define FTMQ_MAX_SUBSCRIPTIONS 10
+
+// messages bigger than FTMQ_MAX_PACKET_LEN are sent in fragments and reassembled by the receivers
+// comment out FTMQ_MAX_MESSAGE_LEN to disable it (bigger messages are then rejected)
+#define FTMQ_MAX_MESSAGE_LEN 256
+#define FTMQ_REASSEMBLY_SLOTS 2 // senders that can be reassembled at the same time
+#define FTMQ_REASSEMBLY_TIMEOUT 1000 //ms
+// source id of the fragments and requests, set by FTMQ_init: folded from the unique id of the MCU, so each node has its own
+#define FTMQ_DEFAULT_SOURCE_ID() ((uint16_t)(((HAL_GetUIDw0() ^ HAL_GetUIDw1() ^ HAL_GetUIDw2()) * 2654435761UL) >> 16))
+
+// frames can carry a 16 bit topic id instead of the topic string, see FTMQ_register_topic
+// FTMQ_MAX_TOPIC_IDS is the number of topics this node publishes and subscribes by id
+#define FTMQ_MAX_TOPIC_IDS 8
+#define FTMQ_REGISTER_RETRY 1000 //ms between requests for a missed topic announcement
+
+// topics published with a reporting policy, see ftmq_report.h. They use topic ids, count them in FTMQ_MAX_TOPIC_IDS
+#define FTMQ_MAX_REPORTS 4
+
+// publish pacing (token bucket, in frames) to keep this node within its share of the FT channel
+// comment out FTMQ_PACING_RATE to disable it. The FT Click can change the budget, see FTMQ_request_pacing
+#define FTMQ_PACING_RATE 20 // frames per second
+#define FTMQ_PACING_BURST 8 // frames, also the biggest fragmented message
+#define FTMQ_PACING_QUEUE 4 // telemetry frames held back over the budget
+#include "stm32f4xx_hal.h"
+#define FTMQ_CLOCK_MS() HAL_GetTick() // refills by the clock, so FTMQ_process also sends the held frames
+
+// message slots shared by the FTMQ_subscribe_deferred subscriptions, their callbacks are called from FTMQ_process
+#define FTMQ_DEFERRED_SLOTS 4
+
+// latest value cache: the last payload of each topic published or received here, see FTMQ_get_retained
+// the topics published here are sent again when another node calls FTMQ_request_retained
+// comment out FTMQ_RETAINED_ARENA to disable it
+#define FTMQ_RETAINED_ARENA 256 // bytes, 3 + topic + payload each, the oldest entries are dropped first
+
+// request/response, see FTMQ_request. Comment out to disable either side
+// the responses are addressed with the source id (FTMQ_DEFAULT_SOURCE_ID, or FTMQ_set_source_id)
+#define FTMQ_MAX_PENDING 4 // requests waiting for their response
+#define FTMQ_MAX_RESPONDERS 4 // topics this node answers
+
+// build-time topic table: subscriptions known when the firmware is built live in flash and are found with one hash
+// generate ftmq_topics.h and ftmq_topics.c from the topic list with utilities/ftmq_topic_table.py, then include it here
+//#include "ftmq_topics.h"
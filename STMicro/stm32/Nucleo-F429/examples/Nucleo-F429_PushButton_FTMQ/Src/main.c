@@ -78,6 +78,15 @@ static void MX_USART6_UART_Init(void);
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+uint8_t uartcRxchar;
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *UartHandle){
+
+  if(UartHandle->Instance == CLICK_UART.Instance)
+    {
+
+      stm32_receive_IT();
+    }
+}
 
 
 extern void buttonPressedCallback(){  // Triggered from stm32f4xx_it.c
@@ -155,15 +164,24 @@ int main(void)
   FTMQ_init();
   SERIAL_DEBUG("Beginning\n\r");
   uint8_t payload[] = "{\"button\":1}";
+  uint32_t pressedTime = HAL_GetTick();
 
+  HAL_UART_Receive_IT(&CLICK_UART, &uartcRxchar, 1);
   while (1)
   {
+	// the CCP tick sends the paced frames and answers FTMQ_request_retained from the LED node
+	HAL_Delay(1);
+	CCP_poll_1msec();
+	FTMQ_process(1);
+
 	if (buttonPressed) {  // set via interrupt by buttonPressedCallback()
-		SERIAL_DEBUG("Button pressed\r\n");
-		FTMQ_publish(serial_comm_id, "button", payload, sizeof(payload));
-		HAL_Delay(100); // Debounce
+		if (HAL_GetTick() - pressedTime >= 100) { // Debounce
+			SERIAL_DEBUG("Button pressed\r\n");
+			FTMQ_publish_topic(serial_comm_id, FTMQ_TOPIC("button"), payload, sizeof(payload));
+			pressedTime = HAL_GetTick();
+			onDuty = true;
+		}
 		buttonPressed = false;
-		onDuty = true;
 	}
 
 	if (!onDuty) {
@@ -173,7 +191,7 @@ int main(void)
 			else
 			  ClickButtonLed_setPWM(500, 50);
 			ledStatus = !ledStatus;
-			blickCounter = 100;
+			blickCounter = 1000;
 		}
 		blickCounter--;
 	}
@@ -183,8 +201,6 @@ int main(void)
 		  ledStatus = false;
 		}
 	}
-
-	HAL_Delay(10);
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -61,6 +61,11 @@
 #define CCP_COMMAND_NODEID_GET          1
 #define CCP_COMMAND_BURST               9
 
+// FTMQ subscriptions kept by the FTclick, see FTMQ_subscribe
+#define CCP_COMMAND_FTMQ_SUBSCRIBE      10 // | command | subscription index | topic (+ and # wildcards) |
+#define CCP_COMMAND_FTMQ_CLEAR_FILTERS  11 // | command |, the FTclick forwards everything again
+#define CCP_COMMAND_FTMQ_PACING         12 // | command |, answered on the FTMQ queue, see FTMQ_FRAME_PACING
+
 // callback function pointers to be registered to specific queues
 typedef void (*CCP_receive_cb_t)(uint8_t comm_id, uint8_t *data, int length);
 // callbacks to register a comm interface (uart, spi, i2c)
@@ -71,6 +76,9 @@ typedef void (*CCP_comm_poll_cb_t)();
 typedef void (*CCP_comm_send_bytes_cb_t)(uint8_t *bytes, uint16_t length);
 typedef void (*CCP_comm_read_bytes_cb_t)(uint8_t *bytes, uint16_t length);
 typedef int (*CCP_comm_has_bytes_cb_t)();
+typedef int (*CCP_comm_busy_cb_t)(); // optional, non zero while the last send_bytes is still reading its buffer
+// callback called from CCP_poll_1msec, to drive timers of the upper layers
+typedef void (*CCP_tick_cb_t)();
 
 typedef struct CCP_Comm_HAL {
   CCP_comm_init_cb_t init;
@@ -80,12 +88,23 @@ typedef struct CCP_Comm_HAL {
   CCP_comm_send_bytes_cb_t send_bytes;
   CCP_comm_read_bytes_cb_t read_bytes;
   CCP_comm_has_bytes_cb_t has_bytes;
+  CCP_comm_busy_cb_t busy;
 } CCP_Comm_HAL;
 
 //CCP functions
 void CCP_poll_1msec(); // call every msec to refresh internal timeout and to receive packets
 int CCP_sendPacket(uint8_t comm_id, uint8_t queue, uint8_t *data, uint16_t length);
+// build a packet in place: begin, write/reserve+commit the payload segments, end sends it
+#define CCP_UNKNOWN_LENGTH 0xFFFF // payload length not known at begin, the crc is done at end
+int CCP_beginPacket(uint8_t comm_id, uint8_t queue, uint16_t length); // -1 if the comm is busy (waits up to CCP_BUSY_WAIT polls)
+int CCP_busy(uint8_t comm_id); // non zero while CCP_beginPacket would wait, tick callbacks retry on the next tick
+int CCP_writePacket(uint8_t comm_id, const uint8_t *data, uint16_t length);
+uint8_t *CCP_reservePacket(uint8_t comm_id, uint16_t length); // returns 0 if there isn't room
+int CCP_commitPacket(uint8_t comm_id, uint16_t length); // bytes used of the reserved room
+int CCP_endPacket(uint8_t comm_id);
+void CCP_abortPacket(uint8_t comm_id);
 void CCP_register_callback(uint8_t queue, CCP_receive_cb_t cb);
+void CCP_register_tick_callback(CCP_tick_cb_t cb);
 int CCP_register_comm(CCP_Comm_HAL *comm); // returns comm id
 void CCP_init();
 
@@ -40,3 +40,5 @@
 #define CCP_MAX_COMM 3
 #define CCP_COMM_READ_BUFFER_LEN 1
 #define CCP_MAX_RECEIVE_CALLBACKS 4
+#define CCP_MAX_TICK_CALLBACKS 2
+#define CCP_BUSY_WAIT 400000 // polls of the uart busy flag before CCP_beginPacket gives up, about 20 ms at 180 MHz
@@ -0,0 +1,236 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#include "ftmq_config.h"
+#include "ftmq_report.h"
+#include "ftmq.h"
+#include "ftmq_codec.h"
+#include "ccp.h"
+
+#include "math.h"
+
+// ---------------- CONSTANTS --------------------------------
+#define FTMQ_REPORT_PAYLOAD_LEN 6 // marker, key, float
+#define FTMQ_WINDOW_PAYLOAD_LEN 19 // marker, 3 floats and the count
+
+// report flags
+#define FTMQ_REPORT_SAMPLED   0x01 // there is a value to publish
+#define FTMQ_REPORT_PUBLISHED 0x02 // last_value is valid
+#define FTMQ_REPORT_PENDING   0x04 // the value changed, waiting for min_interval
+
+// -------------- CUSTOM TYPES ---------------------------------
+
+#ifdef FTMQ_MAX_REPORTS
+typedef struct FTMQ_report {
+    const char *topic;
+    uint16_t topic_id;
+    uint8_t commid;
+    uint8_t tag;
+    uint8_t flags;
+    uint8_t stats; // FTMQ_STAT_xxx of a window report, 0 for the deadband policy
+    float deadband;
+    uint16_t min_interval;
+    uint16_t max_interval; // the window of a window report
+    uint16_t elapsed; // ms since the last publish
+    float value; // last sample, the sum of the window samples
+    float last_value; // last published
+    float min;
+    float max;
+    uint16_t count; // samples in the window
+} FTMQ_report;
+#endif
+
+// ------------ PRIVATE FUNCTION PROTOTYPES ---------------------------------
+void manage_reports();
+#ifdef FTMQ_MAX_REPORTS
+void publish_report(FTMQ_report *report);
+void publish_window(FTMQ_report *report);
+#endif
+
+// ------------- LIBRARY GLOBAL VARIABLES ----------------------------
+#ifdef FTMQ_MAX_REPORTS
+uint8_t registered_FTMQ_reports = 0;
+FTMQ_report FTMQ_reports[FTMQ_MAX_REPORTS];
+#endif
+
+// ------------ PUBLIC FUNCTIONS -------------------------------------
+
+void FTMQ_report_init() {
+#ifdef FTMQ_MAX_REPORTS
+    CCP_register_tick_callback(manage_reports);
+#endif
+}
+
+uint8_t FTMQ_report_add(uint8_t commid, const char *topic, uint8_t tag, float deadband, uint16_t min_interval, uint16_t max_interval) {
+#ifdef FTMQ_MAX_REPORTS
+    if (registered_FTMQ_reports >= FTMQ_MAX_REPORTS)
+        return FTMQ_NO_REPORT;
+    FTMQ_report *report = &FTMQ_reports[registered_FTMQ_reports];
+    report->topic = topic;
+#ifdef FTMQ_MAX_TOPIC_IDS
+    report->topic_id = FTMQ_register_topic(commid, topic);
+#endif
+    report->commid = commid;
+    report->tag = tag;
+    report->flags = 0;
+    report->stats = 0;
+    report->deadband = deadband;
+    report->min_interval = min_interval;
+    report->max_interval = max_interval;
+    report->elapsed = 0xFFFF; // nothing published yet, the first sample goes out at once
+    return registered_FTMQ_reports++;
+#else
+    return FTMQ_NO_REPORT;
+#endif
+}
+
+// the samples are summed up as they come, the window takes the same memory whatever the sample rate
+uint8_t FTMQ_report_add_window(uint8_t commid, const char *topic, uint8_t stats, uint16_t window) {
+#ifdef FTMQ_MAX_REPORTS
+    uint8_t handle = FTMQ_report_add(commid, topic, FTMQ_TAG_VALUE, 0, 0, window);
+    if (handle == FTMQ_NO_REPORT || stats == 0 || window == 0)
+        return handle; // without stats or window it is a plain report
+    FTMQ_report *report = &FTMQ_reports[handle];
+    report->stats = stats;
+    report->elapsed = 0;
+    report->count = 0;
+    return handle;
+#else
+    return FTMQ_NO_REPORT;
+#endif
+}
+
+void FTMQ_report_sample(uint8_t handle, float value) {
+#ifdef FTMQ_MAX_REPORTS
+    if (handle >= registered_FTMQ_reports)
+        return;
+    FTMQ_report *report = &FTMQ_reports[handle];
+    if (report->stats) {
+        if (report->count == 0xFFFF)
+            return; // the window is full, the mean stays right
+        if (report->count == 0 || value < report->min)
+            report->min = value;
+        if (report->count == 0 || value > report->max)
+            report->max = value;
+        report->value = report->count == 0 ? value : report->value + value;
+        report->count++;
+        return;
+    }
+    report->value = value;
+    report->flags |= FTMQ_REPORT_SAMPLED;
+    if (!(report->flags & FTMQ_REPORT_PUBLISHED) || fabsf(value - report->last_value) > report->deadband)
+        report->flags |= FTMQ_REPORT_PENDING;
+    if ((report->flags & FTMQ_REPORT_PENDING) && report->elapsed >= report->min_interval)
+        publish_report(report);
+#endif
+}
+
+// called every msec from CCP_poll_1msec
+void manage_reports() {
+#ifdef FTMQ_MAX_REPORTS
+    for (uint8_t i = 0; i < registered_FTMQ_reports; i++) {
+        FTMQ_report *report = &FTMQ_reports[i];
+        if (report->elapsed < 0xFFFF)
+            report->elapsed++;
+        if (CCP_busy(report->commid))
+            continue; // the tick doesn't wait for the uart, the report is published on a later tick
+        if (report->stats) {
+            if (report->elapsed >= report->max_interval)
+                publish_window(report);
+            continue;
+        }
+        if (!(report->flags & FTMQ_REPORT_SAMPLED))
+            continue;
+        if (((report->flags & FTMQ_REPORT_PENDING) && report->elapsed >= report->min_interval) ||
+            (report->max_interval > 0 && report->elapsed >= report->max_interval))
+            publish_report(report);
+    }
+#endif
+}
+
+// ------------ PRIVATE FUNCTIONS -------------------------------------
+
+#ifdef FTMQ_MAX_REPORTS
+// a busy comm leaves the report pending, it is tried again on the next tick
+void publish_report(FTMQ_report *report) {
+    FTMQ_codec codec;
+#ifdef FTMQ_MAX_TOPIC_IDS
+    uint8_t *payload = FTMQ_reserve_id(report->commid, report->topic_id, FTMQ_REPORT_PAYLOAD_LEN);
+#else
+    uint8_t *payload = FTMQ_reserve(report->commid, report->topic, FTMQ_REPORT_PAYLOAD_LEN);
+#endif
+    if (payload == 0)
+        return;
+    FTMQ_codec_begin(&codec, payload, FTMQ_REPORT_PAYLOAD_LEN);
+    FTMQ_codec_put_float(&codec, report->tag, report->value);
+    if (FTMQ_commit(report->commid, FTMQ_codec_length(&codec)) != FTMQ_OK)
+        return;
+    report->last_value = report->value;
+    report->flags = (report->flags | FTMQ_REPORT_PUBLISHED) & ~FTMQ_REPORT_PENDING;
+    report->elapsed = 0;
+}
+
+// an empty window isn't published, a busy comm extends the window to the next tick
+void publish_window(FTMQ_report *report) {
+    FTMQ_codec codec;
+    if (report->count == 0) {
+        report->elapsed = 0;
+        return;
+    }
+#ifdef FTMQ_MAX_TOPIC_IDS
+    uint8_t *payload = FTMQ_reserve_id(report->commid, report->topic_id, FTMQ_WINDOW_PAYLOAD_LEN);
+#else
+    uint8_t *payload = FTMQ_reserve(report->commid, report->topic, FTMQ_WINDOW_PAYLOAD_LEN);
+#endif
+    if (payload == 0)
+        return;
+    FTMQ_codec_begin(&codec, payload, FTMQ_WINDOW_PAYLOAD_LEN);
+    if (report->stats & FTMQ_STAT_MIN)
+        FTMQ_codec_put_float(&codec, FTMQ_TAG_MIN, report->min);
+    if (report->stats & FTMQ_STAT_MAX)
+        FTMQ_codec_put_float(&codec, FTMQ_TAG_MAX, report->max);
+    if (report->stats & FTMQ_STAT_MEAN)
+        FTMQ_codec_put_float(&codec, FTMQ_TAG_MEAN, report->value / report->count);
+    if (report->stats & FTMQ_STAT_COUNT)
+        FTMQ_codec_put_uint16(&codec, FTMQ_TAG_COUNT, report->count);
+    if (FTMQ_commit(report->commid, FTMQ_codec_length(&codec)) != FTMQ_OK)
+        return;
+    report->count = 0;
+    report->elapsed = 0;
+}
+#endif
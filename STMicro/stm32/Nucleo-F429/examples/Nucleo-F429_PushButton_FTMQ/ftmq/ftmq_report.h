@@ -0,0 +1,61 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#ifndef FTMQ_REPORT_H
+#define FTMQ_REPORT_H
+#include "stdint.h"
+
+// Reporting policy: samples are fed with FTMQ_report_sample and published (as one ftmq_codec float field) when
+// - the value moved more than deadband from the last published one, but not before min_interval ms, or
+// - max_interval ms passed since the last publish (heartbeat, 0 disables it).
+// Window reports publish instead one summary of the samples (ftmq_codec fields FTMQ_TAG_MIN, MAX, MEAN, COUNT) every window ms.
+// Time comes from the CCP tick, CCP_poll_1msec must be called. See FTMQ_MAX_REPORTS in ftmq_config.h
+#define FTMQ_NO_REPORT 0xFF
+
+// statistics of a window report
+#define FTMQ_STAT_MIN   0x01
+#define FTMQ_STAT_MAX   0x02
+#define FTMQ_STAT_MEAN  0x04
+#define FTMQ_STAT_COUNT 0x08
+
+void FTMQ_report_init(void);
+// the topic must stay valid (string literal), returns the report handle or FTMQ_NO_REPORT
+uint8_t FTMQ_report_add(uint8_t commid, const char *topic, uint8_t tag, float deadband, uint16_t min_interval, uint16_t max_interval);
+uint8_t FTMQ_report_add_window(uint8_t commid, const char *topic, uint8_t stats, uint16_t window);
+void FTMQ_report_sample(uint8_t handle, float value);
+#endif
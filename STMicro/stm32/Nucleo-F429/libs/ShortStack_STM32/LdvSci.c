@@ -17,6 +17,7 @@
  * NONINFRINGEMENT, AND THEIR EQUIVALENTS.
  */
 
+#include <string.h>
 #include "LonPlatform.h"
 #include "LdvSci.h"
 #include "main.h"
@@ -49,11 +50,6 @@
 #include "cmsis_os.h"
 #include "main.h"
 
-#ifdef PRINT_LINK_LAYER
-#include "stdio.h"
-#include "string.h"
-#endif
-
 #include "ShortStackSupport.h"
 
 
@@ -63,14 +59,44 @@
  */
 #define PIV_1_MS                        3000
 
-LdvSysTxBuffer              TxBuffer[LDV_TXBUFCOUNT];
-LdvSysRxBuffer              RxBuffer[LDV_RXBUFCOUNT];
+/*
+ * Buffer memory: the small buffers come first in each arena, then the full size ones.
+ * RxBuffer/TxBuffer describe the slots in the same order.
+ */
+#define LDV_RXSMALLAREA             (LDV_RXSMALLCOUNT * LDV_SMALLBUFSIZE)
+#define LDV_TXSMALLAREA             (LDV_TXSMALLCOUNT * LDV_SMALLBUFSIZE)
+
+LonByte                     RxArena[LDV_RXSMALLAREA + LDV_RXBUFCOUNT * LDV_RXBUFSIZE];
+LonByte                     TxArena[LDV_TXSMALLAREA + LDV_TXBUFCOUNT * LDV_TXBUFSIZE];
+LdvSysTxBuffer              TxBuffer[LDV_TXSLOTS];
+LdvSysRxBuffer              RxBuffer[LDV_RXSLOTS];
+LonByte                     RxQueue[LDV_RXSLOTS + 1];   /* Received messages, in order */
+LonByte                     TxQueue[LDV_TXSLOTS + 1];   /* Messages to transmit, in order */
+LonByte                     TxPriQueue[LDV_TXSLOTS + 1];/* Priority messages to transmit, in order */
 volatile LdvDriverStatus    DriverStatus;
 
 extern UART_HandleTypeDef FT_UART;
 
 LonBool neuron_txint = FALSE;
 LonBool neuron_rxint = FALSE;
+#if defined(LDV_SCI_DMA) && !defined(STM32G071xx)
+LonByte rxNeuronData;       /* length byte of the next uplink message */
+#endif
+
+#ifdef LDV_SCI_DMA
+/*
+ * The whole payload arrives in one DMA transfer, so the receiver timer covers
+ * the transfer time of the payload on top of the usual inter-byte timeout.
+ */
+#define LDV_RXDMATIMEOUT(len)   ((LDV_RXTIMEOUT + (len) * 10000UL / LDV_SCI_BPS + 1) > 255 ? 255 : \
+                                 (LonByte)(LDV_RXTIMEOUT + (len) * 10000UL / LDV_SCI_BPS + 1))
+#endif
+
+/* Signaled by the interrupt handlers when the ShortStack task has work, see LdvFlushMsgs */
+osSemaphoreDef(LdvEvent);
+static osSemaphoreId LdvEventId = NULL;
+
+#define SignalEvent()   do { if (LdvEventId != NULL) osSemaphoreRelease(LdvEventId); } while (0)
 
 /* counters for debug purposes */
 LonUbits32 nRxErrors = 0;
@@ -90,6 +116,18 @@ unsigned nUtilityDownTimer[4] = {0}; 	/* 4 utility timers that count down */
 #define EnableGlobalInterrupts()   __enable_irq()
 #define DisableGlobalInterrupts()  __disable_irq()
 
+/*
+ * The receive and transmit buffers and queues are single producer, single consumer
+ * rings between the interrupt handlers and the ShortStack task: each index of
+ * DriverStatus is written by one side only, and the State of a buffer tells
+ * the other side when it changes hands. PublishBuffer() makes sure the content
+ * of a buffer is written before its new State, so no interrupt masking is needed.
+ */
+#define PublishBuffer()            __DMB()
+
+/* The Micro Server is quenched (HRDY) while the next full size receive buffer isn't free */
+#define RX_FULLSIZE_AVAILABLE()    (RxBuffer[DriverStatus.RxNextFullSize].State == LdvRxBufferEmpty)
+
 /*
  * Forward declarations for the interrupt handler functions.
 */
@@ -101,6 +139,7 @@ extern void PeriodicIntervalTimerHandler(void);
  */
 static void ResetMicroServer(void) 
 {
+    LDV_TRACE_EVENT(LDV_TRACE_RESET, 0);
 	ASSERT_RESET();
 	SleepMs(50);
 	DEASSERT_RESET(); // Must be configured as open drain, with pullup resistor
@@ -152,20 +191,12 @@ void ResumeSci(void)
      * before resuming it */
     if (DriverStatus.DriverState == LdvDriverSleep)
     {
-        unsigned int i;
-        
         DriverStatus.DriverState = LdvDriverNormal;
         /* Clear interrupts if any, by reading the status register */
         ENABLE_RX_INT();        /* Enable receive interrupt */
-        /* Resume Neuron if receive buffer is not full */
-        for (i = 0; i < LDV_RXBUFCOUNT; i ++)
-        {
-            if(RxBuffer[i].State == LdvRxBufferEmpty)
-            {
-                ASSERT_HRDY();
-                break;
-            }
-        }
+        /* Resume Neuron if a message of any size can be received */
+        if (RX_FULLSIZE_AVAILABLE())
+            ASSERT_HRDY();
     }
 }
 
@@ -176,45 +207,137 @@ static void CyclicIncrement(LdvIndexType index)
 {
     switch (index)
     {
-    case LdvIndexRxBufferReady:
-        if (++DriverStatus.RxBufferReadyIndex >= LDV_RXBUFCOUNT)
-            DriverStatus.RxBufferReadyIndex = 0;
+    case LdvIndexRxQueueHead:
+        if (++DriverStatus.RxQueueHead > LDV_RXSLOTS)
+            DriverStatus.RxQueueHead = 0;
+        break;
+    case LdvIndexRxQueueTail:
+        if (++DriverStatus.RxQueueTail > LDV_RXSLOTS)
+            DriverStatus.RxQueueTail = 0;
         break;
-    case LdvIndexRxBufferReceive:
-        if (++DriverStatus.RxBufferReceiveIndex >= LDV_RXBUFCOUNT)
-            DriverStatus.RxBufferReceiveIndex = 0;
+    case LdvIndexTxQueueHead:
+        if (++DriverStatus.TxQueueHead > LDV_TXSLOTS)
+            DriverStatus.TxQueueHead = 0;
         break;
-    case LdvIndexTxBufferEmpty:
-        if (++DriverStatus.TxBufferEmptyIndex >= LDV_TXBUFCOUNT)
-            DriverStatus.TxBufferEmptyIndex = 0;
+    case LdvIndexTxQueueTail:
+        if (++DriverStatus.TxQueueTail > LDV_TXSLOTS)
+            DriverStatus.TxQueueTail = 0;
         break;
-    case LdvIndexTxBufferTransmit:
-        if (++DriverStatus.TxBufferTransmitIndex >= LDV_TXBUFCOUNT)
-            DriverStatus.TxBufferTransmitIndex = 0;
+    case LdvIndexTxPriQueueHead:
+        if (++DriverStatus.TxPriQueueHead > LDV_TXSLOTS)
+            DriverStatus.TxPriQueueHead = 0;
+        break;
+    case LdvIndexTxPriQueueTail:
+        if (++DriverStatus.TxPriQueueTail > LDV_TXSLOTS)
+            DriverStatus.TxPriQueueTail = 0;
         break;
     default:
         break;
     }
 }
 
-#ifdef PRINT_LINK_LAYER
-static void PrintData(LonByte* pData, unsigned length, LonBool bTransmit)
+/*
+ * Internal helper functions returning the index of a buffer from its data pointer,
+ * or LDV_RXSLOTS/LDV_TXSLOTS if the pointer isn't one of the driver buffers
+ */
+static LonUbits8 RxBufferIndex(const void *pData)
+{
+    uintptr_t offset = (uintptr_t)pData - (uintptr_t)RxArena;
+
+    if (offset < LDV_RXSMALLAREA)
+        return offset % LDV_SMALLBUFSIZE ? LDV_RXSLOTS : (LonUbits8)(offset / LDV_SMALLBUFSIZE);
+    offset -= LDV_RXSMALLAREA;
+    if (offset >= LDV_RXBUFCOUNT * LDV_RXBUFSIZE || offset % LDV_RXBUFSIZE != 0)
+        return LDV_RXSLOTS;
+    return (LonUbits8)(LDV_RXSMALLCOUNT + offset / LDV_RXBUFSIZE);
+}
+
+static LonUbits8 TxBufferIndex(const void *pData)
 {
-    char sData[256];
-    char sByte[4];
-    unsigned i;
-    if (bTransmit) 
-        strcpy(sData, "Transmitted: ");
-    else
-        strcpy(sData, "Received   : ");
-    for (i = 0; i < length; i ++)
+    uintptr_t offset = (uintptr_t)pData - (uintptr_t)TxArena;
+
+    if (offset < LDV_TXSMALLAREA)
+        return offset % LDV_SMALLBUFSIZE ? LDV_TXSLOTS : (LonUbits8)(offset / LDV_SMALLBUFSIZE);
+    offset -= LDV_TXSMALLAREA;
+    if (offset >= LDV_TXBUFCOUNT * LDV_TXBUFSIZE || offset % LDV_TXBUFSIZE != 0)
+        return LDV_TXSLOTS;
+    return (LonUbits8)(LDV_TXSMALLCOUNT + offset / LDV_TXBUFSIZE);
+}
+
+/*
+ * Internal helper function claiming a receive buffer for an uplink message of the
+ * given length byte, from the small buffers first. Each size class is a ring of
+ * buffers claimed in order, so only its next buffer needs to be checked.
+ * Returns LDV_RXSLOTS if the message can't be stored.
+ */
+static LonByte ClaimRxBuffer(LonByte length)
+{
+    LonByte index;
+
+    if (LDV_RXSMALLCOUNT != 0 && length < (LDV_SMALLBUFSIZE - sizeof(LonSmipHdr)))
     {
-        sprintf(sByte, "%X ", pData[i]);
-        strcat(sData, sByte);
+        index = DriverStatus.RxNextSmall;
+        if (RxBuffer[index].State == LdvRxBufferEmpty)
+        {
+            DriverStatus.RxNextSmall = (index + 1 < LDV_RXSMALLCOUNT) ? index + 1 : 0;
+            return index;
+        }
+    }
+    if (length < (LDV_RXBUFSIZE - sizeof(LonSmipHdr)))
+    {
+        index = DriverStatus.RxNextFullSize;
+        if (RxBuffer[index].State == LdvRxBufferEmpty)
+        {
+            DriverStatus.RxNextFullSize = (index + 1 < LDV_RXSLOTS) ? index + 1 : LDV_RXSMALLCOUNT;
+            return index;
+        }
     }
-    printf("%s\n", sData);
+    return LDV_RXSLOTS;
+}
+
+/*
+ * Internal helper function claiming a transmit buffer of at least size bytes,
+ * the same way. Returns LDV_TXSLOTS if there is none.
+ */
+static LonByte ClaimTxBuffer(unsigned size)
+{
+    LonByte index;
+
+    if (LDV_TXSMALLCOUNT != 0 && size <= LDV_SMALLBUFSIZE)
+    {
+        index = DriverStatus.TxNextSmall;
+        if (TxBuffer[index].State == LdvTxBufferEmpty)
+        {
+            DriverStatus.TxNextSmall = (index + 1 < LDV_TXSMALLCOUNT) ? index + 1 : 0;
+            return index;
+        }
+    }
+    if (size <= LDV_TXBUFSIZE)
+    {
+        index = DriverStatus.TxNextFullSize;
+        if (TxBuffer[index].State == LdvTxBufferEmpty)
+        {
+            DriverStatus.TxNextFullSize = (index + 1 < LDV_TXSLOTS) ? index + 1 : LDV_TXSMALLCOUNT;
+            return index;
+        }
+    }
+    return LDV_TXSLOTS;
+}
+
+/*
+ * Internal helper function telling if a downlink message is for a priority queue
+ * of the Micro Server. Priority messages overtake the others in the driver too, so
+ * a buffer may be released out of order: ClaimTxBuffer then waits for its next
+ * buffer, at most LDV_TXPRIORITYBURST messages later.
+ */
+static LonBool IsPriorityMsg(const LonSmipMsg* pMsg)
+{
+    LonByte command = pMsg->Header.Command;
+    LonByte queue = command & 0x0F;
+
+    return ((command & 0xF0) == LonNiComm || (command & 0xF0) == LonNiNetManagement)
+           && (queue == LonNiTxQueuePriority || queue == LonNiNonTxQueuePriority);
 }
-#endif
 
 /*
  * Function: LdvInit
@@ -231,23 +354,51 @@ void LdvInit(const char *usartName )
     DriverStatus.DriverState            = LdvDriverSleep;
     DriverStatus.RxState                = LdvRxIdle;
     DriverStatus.RxBufferReceiveIndex   = 0;
-    DriverStatus.RxBufferReadyIndex     = 0;
+    DriverStatus.RxQueueHead            = 0;
+    DriverStatus.RxQueueTail            = 0;
+    DriverStatus.RxNextSmall            = 0;
+    DriverStatus.RxNextFullSize         = LDV_RXSMALLCOUNT;
     DriverStatus.TxState                = LdvTxIdle;
-    DriverStatus.TxBufferTransmitIndex  = 0;
-    DriverStatus.TxBufferEmptyIndex     = 0;
+    DriverStatus.TxQueueHead            = 0;
+    DriverStatus.TxQueueTail            = 0;
+    DriverStatus.TxPriQueueHead         = 0;
+    DriverStatus.TxPriQueueTail         = 0;
+    DriverStatus.TxPriorityBurst        = 0;
+    DriverStatus.TxNextSmall            = 0;
+    DriverStatus.TxNextFullSize         = LDV_TXSMALLCOUNT;
     DriverStatus.pTxMsg                 = 0;
     DriverStatus.DrvWakeupTime          = LDV_DRVWAKEUPTIME;
     DriverStatus.RxTimeout              = 0;
     DriverStatus.KeepAliveTimeout       = LDV_KEEPALIVETIMEOUT;
     DriverStatus.PutMsgTimeout          = 0;
 
-    /* Mark all receiver buffers as empty */
-    for (i = 0; i < LDV_RXBUFCOUNT; i ++)
+    if (LdvEventId == NULL)
+        LdvEventId = osSemaphoreCreate(osSemaphore(LdvEvent), 1);
+
+#if (__CORTEX_M >= 3)
+    /* Start the cycle counter of LdvGetTimestamp. A debugger or a profiler may
+       already have enabled the trace unit or started the counter, leave them as they are */
+    if (!(CoreDebug->DEMCR & CoreDebug_DEMCR_TRCENA_Msk))
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk))
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+    /* Mark all receiver buffers as empty, and lay them out in the arena */
+    for (i = 0; i < LDV_RXSLOTS; i ++)
+    {
         RxBuffer[i].State = LdvRxBufferEmpty;
+        RxBuffer[i].Data = (i < LDV_RXSMALLCOUNT) ? &RxArena[i * LDV_SMALLBUFSIZE]
+                                                  : &RxArena[LDV_RXSMALLAREA + (i - LDV_RXSMALLCOUNT) * LDV_RXBUFSIZE];
+    }
 
-    /* Mark all transmit buffers as empty */
-    for (i = 0; i < LDV_TXBUFCOUNT; i ++)
+    /* Mark all transmit buffers as empty, and lay them out in the arena */
+    for (i = 0; i < LDV_TXSLOTS; i ++)
+    {
         TxBuffer[i].State = LdvTxBufferEmpty;
+        TxBuffer[i].Data = (i < LDV_TXSMALLCOUNT) ? &TxArena[i * LDV_SMALLBUFSIZE]
+                                                  : &TxArena[LDV_TXSMALLAREA + (i - LDV_TXSMALLCOUNT) * LDV_TXBUFSIZE];
+    }
         
     // On ST Micro, UARTS and GPIOs (CTS/RTS/HRDY) have been initialized by the HAL.
     // Hardly any more work needs to be done here
@@ -277,6 +428,9 @@ void LdvReset(void)
 {
     DISABLE_TX_INT();
     DISABLE_RX_INT();
+#ifdef LDV_SCI_DMA
+    HAL_UART_AbortTransmit(&FT_UART);   /* Drop the segment being transmitted */
+#endif
     DEASSERT_RTS();
     DEASSERT_HRDY();
     DriverStatus.DriverState = LdvDriverSleep;       /* Put the driver into sleep mode to begin with */
@@ -305,27 +459,82 @@ void LdvReset(void)
 LonApiError LdvGetMsg(LonSmipMsg **ppMsg)
 {
     LonApiError result = LonApiRxMsgNotAvailable;
-    LonUbits8 i;
-    
-    for (i = 0; i < LDV_RXBUFCOUNT; i ++)
+
+    /* Messages are queued in the order they are received */
+    if (DriverStatus.RxQueueTail != DriverStatus.RxQueueHead)
     {
-        DisableGlobalInterrupts();
-        if (RxBuffer[DriverStatus.RxBufferReadyIndex].State == LdvRxBufferReady)
-        {
-            RxBuffer[DriverStatus.RxBufferReadyIndex].State = LdvRxBufferProcessing;
-            *ppMsg = (LonSmipMsg*) RxBuffer[DriverStatus.RxBufferReadyIndex].Data;
-            EnableGlobalInterrupts();
-            CyclicIncrement(LdvIndexRxBufferReady);
-            result = LonApiNoError;
-            break;
-        }
-        EnableGlobalInterrupts();
-        CyclicIncrement(LdvIndexRxBufferReady);
+        LonByte index = RxQueue[DriverStatus.RxQueueTail];
+        RxBuffer[index].State = LdvRxBufferProcessing;
+        *ppMsg = (LonSmipMsg*) RxBuffer[index].Data;
+        CyclicIncrement(LdvIndexRxQueueTail);
+        result = LonApiNoError;
     }
-    
+
     return result;
 }
 
+/*
+ * Function: LdvGetMsgCount
+ * Returns the number of received messages waiting for <LdvGetMsg>.
+ */
+unsigned LdvGetMsgCount(void)
+{
+    LonByte head = DriverStatus.RxQueueHead;
+    LonByte tail = DriverStatus.RxQueueTail;
+
+    return (head >= tail) ? head - tail : head + LDV_RXSLOTS + 1 - tail;
+}
+
+/*
+ * Function: LdvGetTimestamp
+ * Returns a free running time stamp, for <LdvGetElapsedMicros>.
+ *
+ * Remarks:
+ * The DWT cycle counter (started in LdvInit) on Cortex-M3 and up, the HAL
+ * millisecond tick on the Cortex-M0+, which has no cycle counter.
+ */
+LonUbits32 LdvGetTimestamp(void)
+{
+#if (__CORTEX_M >= 3)
+    return DWT->CYCCNT;
+#else
+    return HAL_GetTick();
+#endif
+}
+
+/*
+ * Function: LdvGetElapsedMicros
+ * Returns the microseconds elapsed since *timestamp* was taken with <LdvGetTimestamp>.
+ *
+ * Remarks:
+ * The DWT cycle counter wraps after 2^32 / SystemCoreClock seconds (23.8 s at
+ * 180 MHz), the HAL tick variant after 71 minutes of microseconds.
+ */
+LonUbits32 LdvGetElapsedMicros(LonUbits32 timestamp)
+{
+#if (__CORTEX_M >= 3)
+    return (uint32_t) (DWT->CYCCNT - timestamp) / (SystemCoreClock / 1000000);
+#else
+    return (uint32_t) (HAL_GetTick() - timestamp) * 1000;
+#endif
+}
+
+/*
+ * Function: LdvAdvanceTimestamp
+ * Returns *timestamp* moved forward by *micros*, as returned by <LdvGetElapsedMicros>.
+ *
+ * Remarks:
+ * The cycles (or ticks) of whole microseconds only, the remainder stays in the interval.
+ */
+LonUbits32 LdvAdvanceTimestamp(LonUbits32 timestamp, LonUbits32 micros)
+{
+#if (__CORTEX_M >= 3)
+    return timestamp + micros * (SystemCoreClock / 1000000);
+#else
+    return timestamp + micros / 1000;
+#endif
+}
+
 /*
  * Function: LdvReleaseMsg
  * Releases a message buffer back to the serial driver.
@@ -342,25 +551,17 @@ LonApiError LdvGetMsg(LonSmipMsg **ppMsg)
  */
 void LdvReleaseMsg(const LonSmipMsg *pMsg)
 {
-    LonUbits8 i;
-    const LonSmipMsg *pTMsg;
-    
-    for (i = 0; i < LDV_RXBUFCOUNT; i ++) 
+    LonUbits8 i = RxBufferIndex(pMsg);
+
+    if (i < LDV_RXSLOTS)
     {
-        DisableGlobalInterrupts();
-        pTMsg = (const LonSmipMsg *)RxBuffer[i].Data;
-        if (pTMsg == pMsg)
-        {
-            /* Found the message to be released in the buffer */
-            RxBuffer[i].State = LdvRxBufferEmpty;
-            EnableGlobalInterrupts();
-            
-            /* Resume ShortStack Micro Server if driver is in normal state */
-            if (DriverStatus.DriverState == LdvDriverNormal)
-                ASSERT_HRDY();
-            break;
-        }
-        EnableGlobalInterrupts();
+        /* Give the buffer back to the receiver */
+        RxBuffer[i].State = LdvRxBufferEmpty;
+
+        /* Resume ShortStack Micro Server if driver is in normal state
+         * and a message of any size can be received */
+        if (DriverStatus.DriverState == LdvDriverNormal && RX_FULLSIZE_AVAILABLE())
+            ASSERT_HRDY();
     }
 }
 
@@ -383,32 +584,41 @@ void LdvReleaseMsg(const LonSmipMsg *pMsg)
  * Previously named ldv_allocate_msg.
  */
 LonApiError LdvAllocateMsg(LonSmipMsg **ppMsg)
+{
+    return LdvAllocateMsgSized(ppMsg, LDV_TXBUFSIZE);
+}
+
+/*
+ * Function: LdvAllocateMsgSized
+ * Allocates a transmit buffer of at least the given size from the serial driver.
+ *
+ * Parameters:
+ * ppMsg - pointer to the transmit buffer pointer that will be returned.
+ * size - number of bytes of the message, header included.
+ *
+ * Returns:
+ * <LonApiError> - LonApiNoError if the message was successfully allocated, 
+ *                 an appropriate error code, otherwise.
+ *
+ * Remarks:
+ * Same as <LdvAllocateMsg>, but short messages get one of the small buffers
+ * while there is one, and the caller must not write past *size* bytes.
+ */
+LonApiError LdvAllocateMsgSized(LonSmipMsg **ppMsg, unsigned size)
 {
     LonApiError result = LonApiTxBufIsFull;
-    LonUbits8 i;
-    LonUbits8 *pMsg;
-    
-    for (i = 0; i < LDV_TXBUFCOUNT; i ++)
+    LonByte index = ClaimTxBuffer(size);
+
+    if (index < LDV_TXSLOTS)
     {
-        DisableGlobalInterrupts();
-        if (TxBuffer[DriverStatus.TxBufferEmptyIndex].State == LdvTxBufferEmpty)
-        {
-            /* Found an empty message buffer */
-            TxBuffer[DriverStatus.TxBufferEmptyIndex].State = LdvTxBufferFilling;
-            pMsg = TxBuffer[DriverStatus.TxBufferEmptyIndex].Data;
-            *ppMsg = (LonSmipMsg*) pMsg;
-            EnableGlobalInterrupts();
-            CyclicIncrement(LdvIndexTxBufferEmpty);
-            result = LonApiNoError;
-            break;
-        }
-        EnableGlobalInterrupts();
-        CyclicIncrement(LdvIndexTxBufferEmpty);
+        TxBuffer[index].State = LdvTxBufferFilling;
+        *ppMsg = (LonSmipMsg*) TxBuffer[index].Data;
+        result = LonApiNoError;
     }
-    
+
     if (result != LonApiNoError)
         nTxBufUnavailable ++;
-    
+
     return result;
 }
 
@@ -428,24 +638,52 @@ LonApiError LdvAllocateMsg(LonSmipMsg **ppMsg)
  */
 void LdvPutMsg(const LonSmipMsg* pMsg)
 {
-    LonUbits8 i;
-    const LonSmipMsg *pTMsg;
-   
-    for (i = 0; i < LDV_TXBUFCOUNT; i ++)
+    LonUbits8 i = TxBufferIndex(pMsg);
+
+    if (i < LDV_TXSLOTS)
     {
-        DisableGlobalInterrupts();
-        pTMsg = (const LonSmipMsg *)TxBuffer[i].Data;
-        if (pTMsg == pMsg) 
+        /* The message is complete before the transmitter can see it */
+        PublishBuffer();
+        TxBuffer[i].State = LdvTxBufferReady;
+        /* Messages of each queue are transmitted in the order they are put */
+        if (IsPriorityMsg(pMsg))
         {
-            /* Found the message to be transmitted */
-            TxBuffer[i].State = LdvTxBufferReady;
-            EnableGlobalInterrupts();
-            break;
+            TxPriQueue[DriverStatus.TxPriQueueHead] = i;
+            CyclicIncrement(LdvIndexTxPriQueueHead);
+        }
+        else
+        {
+            TxQueue[DriverStatus.TxQueueHead] = i;
+            CyclicIncrement(LdvIndexTxQueueHead);
         }
-        EnableGlobalInterrupts();
     }
 }
 
+/*
+ * Function: LdvFindQueuedMsg
+ * Finds a message put with <LdvPutMsg> that the driver hasn't started to transmit.
+ *
+ * Remarks:
+ * Messages leave TxQueue/TxPriQueue only in LdvFlushMsgs, so the ones between the
+ * tail and the head of a queue aren't seen by the transmitter yet.
+ */
+LonSmipMsg* LdvFindQueuedMsg(const LonSmipMsg* pMsg, unsigned length)
+{
+    LonByte i;
+
+    for (i = DriverStatus.TxQueueTail; i != DriverStatus.TxQueueHead; i = (i < LDV_TXSLOTS) ? i + 1 : 0)
+    {
+        if (memcmp(TxBuffer[TxQueue[i]].Data, pMsg, length) == 0)
+            return (LonSmipMsg*) TxBuffer[TxQueue[i]].Data;
+    }
+    for (i = DriverStatus.TxPriQueueTail; i != DriverStatus.TxPriQueueHead; i = (i < LDV_TXSLOTS) ? i + 1 : 0)
+    {
+        if (memcmp(TxBuffer[TxPriQueue[i]].Data, pMsg, length) == 0)
+            return (LonSmipMsg*) TxBuffer[TxPriQueue[i]].Data;
+    }
+    return NULL;
+}
+
 /*
  * Function: LdvPutMsgBlocking
  * Sends a message downlink using a blocking call.
@@ -525,16 +763,16 @@ LonApiError LdvPutMsgBlocking(const LonSmipMsg* pMsg)
  *
  * Remarks:
  * This function must be called during the idle loop to complete pending 
- * transmissions.
+ * transmissions. Unless a received message is waiting, it then sleeps until
+ * an interrupt handler signals an event, or for LDV_EVENT_TIMEOUT ms.
  * Previously named ldv_flush_msgs.
  */
 void LdvFlushMsgs(void)
 {
-    LonUbits8 i;
-
     if (CHECK_CTS_DEASSERTED()) /* If CTS is asserted, there is already a message being transmitted */
     {
-        DisableGlobalInterrupts();
+        /* The transmitter leaves the idle state only after RTS is asserted below,
+         * so these checks don't race with the interrupt handlers */
         if (DriverStatus.TxState == LdvTxIdle && DriverStatus.DriverState != LdvDriverSleep) 
         {
             /* The driver is awake and is ready to transmit */
@@ -543,34 +781,39 @@ void LdvFlushMsgs(void)
                 /* There is already a message that needs to be transmitted.
                  * Assert the RTS line and then the interrupt routine will handle the transfer */
                 ASSERT_RTS();
-                EnableGlobalInterrupts();
             }
-            else
+            else if (DriverStatus.TxPriQueueTail != DriverStatus.TxPriQueueHead
+                     && (DriverStatus.TxPriorityBurst < LDV_TXPRIORITYBURST
+                         || DriverStatus.TxQueueTail == DriverStatus.TxQueueHead))
             {
-                /* The driver doesn't have any pending messages to transmit.
-                 * Time to pull out any buffered messages */
-                for (i = 0; i < LDV_TXBUFCOUNT; i ++) 
-                {
-                    DisableGlobalInterrupts();
-                    if (TxBuffer[DriverStatus.TxBufferTransmitIndex].State == LdvTxBufferReady) 
-                    {
-                        /* Found a buffer that is ready for transmission */
-                        DriverStatus.pTxMsg = TxBuffer[DriverStatus.TxBufferTransmitIndex].Data;
-                        EnableGlobalInterrupts();
-                        CyclicIncrement(LdvIndexTxBufferTransmit);
-                        /* Assert the RTS line and then the interrupt routine will handle the transfer */
-                        ASSERT_RTS();
-                        break;
-                    }
-                    EnableGlobalInterrupts();
-                    CyclicIncrement(LdvIndexTxBufferTransmit);
-                }
+                /* The next priority message goes first */
+                DriverStatus.pTxMsg = TxBuffer[TxPriQueue[DriverStatus.TxPriQueueTail]].Data;
+                CyclicIncrement(LdvIndexTxPriQueueTail);
+                if (DriverStatus.TxQueueTail != DriverStatus.TxQueueHead)
+                    DriverStatus.TxPriorityBurst ++;
+                /* Assert the RTS line and then the interrupt routine will handle the transfer */
+                ASSERT_RTS();
+            }
+            else if (DriverStatus.TxQueueTail != DriverStatus.TxQueueHead)
+            {
+                /* The next buffered message is ready for transmission */
+                DriverStatus.pTxMsg = TxBuffer[TxQueue[DriverStatus.TxQueueTail]].Data;
+                CyclicIncrement(LdvIndexTxQueueTail);
+                DriverStatus.TxPriorityBurst = 0;
+                /* Assert the RTS line and then the interrupt routine will handle the transfer */
+                ASSERT_RTS();
             }
         }
+    }
+
+    /* Sleep until the driver has something to do, unless a message is already waiting */
+    if (DriverStatus.RxQueueTail == DriverStatus.RxQueueHead)
+    {
+        if (LdvEventId != NULL)
+            osSemaphoreWait(LdvEventId, LDV_EVENT_TIMEOUT);
         else
-            EnableGlobalInterrupts();
+            osDelay(LDV_EVENT_TIMEOUT);
     }
-		osDelay(1);
 }
 
 /* 
@@ -581,6 +824,7 @@ void CtsInterruptHandler(void)
     /* Acknowledge the interrupt - not required for STMicro HAL done prior to this call */
 
     /* CTS line has changed since there is no other cause for this interrupt to occur */
+    LDV_TRACE_EVENT(LDV_TRACE_CTS, CHECK_CTS_ASSERTED() ? 1 : 0);
     if (CHECK_CTS_ASSERTED())
     {
         /* Micro Server is ready to receive data */
@@ -598,6 +842,30 @@ void CtsInterruptHandler(void)
             DriverStatus.TxState = LdvTxPayload;
     }
     /* Else end of transmission of a packet, nothing needs to be done */
+
+    /* Either way the ShortStack task has the next step of the transfer to take */
+    SignalEvent();
+}
+
+/*
+ * Internal function called when the whole payload of an uplink message is in its buffer
+ */
+static void RxMessageComplete(LonByte rcvIndex)
+{
+    LDV_TRACE_FRAME(LDV_TRACE_RX, RxBuffer[rcvIndex].Data);
+    DriverStatus.RxState = LdvRxIdle;
+    RxBuffer[rcvIndex].State = LdvRxBufferReady;
+    DriverStatus.RxTimeout = 0;
+    RxQueue[DriverStatus.RxQueueHead] = rcvIndex;
+    PublishBuffer();
+    CyclicIncrement(LdvIndexRxQueueHead);
+
+    /* If a full size message can't be received, quench the neuron */
+    if (!RX_FULLSIZE_AVAILABLE()) {
+        DEASSERT_HRDY();
+    }
+    /* Wake up the ShortStack task to process the message */
+    SignalEvent();
 }
 
 /* 
@@ -605,8 +873,6 @@ void CtsInterruptHandler(void)
  */
 void RxInterruptHandler(LonByte data)
 {
-				int i = 0;
-
         LonByte rxChar;
         rxChar = data;  /* Read data */
 
@@ -616,7 +882,10 @@ void RxInterruptHandler(LonByte data)
             switch (DriverStatus.RxState)
             {
             case LdvRxIdle:
+            {
                 /* Length byte has arrived */
+                LonByte rcvIndex;
+                LDV_TRACE_EVENT(LDV_TRACE_RX_START, rxChar);
                 /* Initially assume no receive buffer is available */
                 DriverStatus.RxState = LdvRxIgnore;
 
@@ -624,26 +893,29 @@ void RxInterruptHandler(LonByte data)
                 DriverStatus.RxPayloadLen = rxChar + 1;
                 DriverStatus.RxTimeout = LDV_RXTIMEOUT;
 
-                if (rxChar < (LDV_RXBUFSIZE - sizeof(LonSmipHdr)))
+                /* Claim the smallest buffer this message fits in */
+                rcvIndex = ClaimRxBuffer(rxChar);
+                if (rcvIndex < LDV_RXSLOTS)
                 {
-                    /* Find an empty buffer to store this data */
-                    for (i = 0; i < LDV_RXBUFCOUNT; i ++)
-                    {
-                        LonByte rcvIndex = DriverStatus.RxBufferReceiveIndex;
-                        if (RxBuffer[rcvIndex].State == LdvRxBufferEmpty)
-                        {
-                            /* Found an empty buffer */
-                            DriverStatus.RxNextFree = 0;                        /* Initialize the buffer receive counter */
-                            DriverStatus.RxState = LdvRxPayload;                /* Change the driver receive state */
-                            RxBuffer[rcvIndex].State = LdvRxBufferReceiving;    /* Change the buffer state */
-                            RxBuffer[rcvIndex].Data[DriverStatus.RxNextFree ++] = rxChar;  /* Store the data in the buffer */
-
-                            break;
-                        }
-                        CyclicIncrement(LdvIndexRxBufferReceive);
-                    }
+                    /* Found an empty buffer */
+                    DriverStatus.RxBufferReceiveIndex = rcvIndex;
+                    DriverStatus.RxNextFree = 0;                        /* Initialize the buffer receive counter */
+                    DriverStatus.RxState = LdvRxPayload;                /* Change the driver receive state */
+                    RxBuffer[rcvIndex].State = LdvRxBufferReceiving;    /* Change the buffer state */
+                    RxBuffer[rcvIndex].Data[DriverStatus.RxNextFree ++] = rxChar;  /* Store the data in the buffer */
+#ifdef LDV_SCI_DMA
+                    /* The rest of the message goes straight into the buffer, see LdvRxCompleteHandler */
+                    DriverStatus.RxTimeout = LDV_RXDMATIMEOUT(DriverStatus.RxPayloadLen);
+                    DriverStatus.RxNextFree += DriverStatus.RxPayloadLen;
+                    HAL_UART_Receive_DMA(&FT_UART, &RxBuffer[rcvIndex].Data[1], DriverStatus.RxPayloadLen);
+#endif
+                }
+                else
+                {
+                    LDV_TRACE_EVENT(LDV_TRACE_RX_DROP, rxChar);
                 }
                 break;
+            }
 
             case LdvRxPayload:
             {
@@ -654,23 +926,7 @@ void RxInterruptHandler(LonByte data)
                 if (-- DriverStatus.RxPayloadLen == 0)
                 {
                     /* All bytes have been received */
-                    #ifdef PRINT_LINK_LAYER
-                    PrintData((LonByte*) &RxBuffer[rcvIndex].Data[0], DriverStatus.RxNextFree, 0);
-                    #endif
-                    DriverStatus.RxState = LdvRxIdle;
-                    RxBuffer[rcvIndex].State = LdvRxBufferReady;
-                    DriverStatus.RxTimeout = 0;
-                    CyclicIncrement(LdvIndexRxBufferReceive);
-
-                    /* Check if there is still an empty receive buffer */
-                    for (i = 0; i < LDV_RXBUFCOUNT; i ++)
-                        if (RxBuffer[i].State == LdvRxBufferEmpty)
-                            /* There is an empty receive buffer, we are done */
-                            break;
-                    /* If there is no empty receive buffer, quench the neuron */
-                    if (i == LDV_RXBUFCOUNT) {
-                        DEASSERT_HRDY();
-                    }
+                    RxMessageComplete(rcvIndex);
                 }
                 else
                 {
@@ -702,6 +958,129 @@ void RxInterruptHandler(LonByte data)
 }
 
 
+#ifdef LDV_SCI_DMA
+/*
+ * Function: LdvRxCompleteHandler
+ * Receive complete handler of the DMA mode.
+ *
+ * Remarks:
+ * Called from HAL_UART_RxCpltCallback for FT_UART, either for the length byte
+ * (interrupt) or for the payload (DMA) of an uplink message.
+ */
+void LdvRxCompleteHandler(void)
+{
+    if (DriverStatus.RxState == LdvRxPayload)
+    {
+        /* The DMA transfer has stored the whole payload */
+        DriverStatus.RxPayloadLen = 0;
+        RxMessageComplete(DriverStatus.RxBufferReceiveIndex);
+        DriverStatus.KeepAliveTimeout = LDV_KEEPALIVETIMEOUT;
+    }
+    else
+    {
+        /* Length byte, or a byte of a message that is ignored */
+        RxInterruptHandler(rxNeuronData);
+    }
+    /* Wait for the next byte, unless the payload is on its way by DMA */
+    if (DriverStatus.RxState != LdvRxPayload && NEURON_RXINT_ENABLED())
+        HAL_UART_Receive_IT(&FT_UART, &rxNeuronData, 1);
+}
+
+/*
+ * Transmit handler of the DMA mode: each call starts the DMA transfer of a whole segment
+ * (header, info or payload) and sets the next state. It is called again when the CTS line
+ * is asserted for the next segment (ENABLE_TX_INT), or when the last segment is complete.
+ */
+void TxInterruptHandler(void)
+{
+    static LonByte info[2];
+    int i = 0;
+
+    /* If data needs to be transmitted, make sure that the CTS line is still asserted */
+    if ((DriverStatus.TxState != LdvTxDone)  &&  CHECK_CTS_DEASSERTED())
+    {
+        /* Something unusual happened (such as Neuron reset) */
+        ResetMicroServer();
+        return;
+    }
+
+    const LonByte* pTM = DriverStatus.pTxMsg;
+    switch (DriverStatus.TxState)
+    {
+    case LdvTxIdle:
+        if (pTM == 0)
+            break;
+        i = TxBufferIndex(pTM);
+        if ((i < LDV_TXSLOTS) && (TxBuffer[i].State == LdvTxBufferReady))
+            TxBuffer[i].State = LdvTxBufferTransmitting;
+        /* Length and command */
+        DriverStatus.TxPayloadLen = pTM[0];
+        DriverStatus.TxNextChar = 2;
+        if (pTM[1] == (LonNiNv | LON_NV_ESCAPE_SEQUENCE))
+        {
+            DriverStatus.TxState = LdvTxHandShake;
+            DriverStatus.TxNextState = LdvTxInfo_1;
+            DISABLE_TX_INT();
+        }
+        else if (DriverStatus.TxPayloadLen != 0)
+        {
+            DriverStatus.TxState = LdvTxHandShake;
+            DriverStatus.TxNextState = LdvTxPayload;
+            DISABLE_TX_INT();
+        }
+        else
+        {
+            DriverStatus.TxState = LdvTxDone;
+        }
+        HAL_UART_Transmit_DMA(&FT_UART, (uint8_t *)pTM, 2);
+        break;
+
+    case LdvTxInfo_1:
+        /* Both info bytes, the second one is 0x00 for now */
+        info[0] = ((LonSicb*) ((LonSmipMsg*) pTM)->Payload)->NvMessage.Index;
+        info[1] = 0x00;
+        if (DriverStatus.TxPayloadLen != 0)
+        {
+            DriverStatus.TxState = LdvTxHandShake;
+            DriverStatus.TxNextState = LdvTxPayload;
+            DISABLE_TX_INT();
+        }
+        else
+        {
+            DriverStatus.TxState = LdvTxDone;
+        }
+        HAL_UART_Transmit_DMA(&FT_UART, info, 2);
+        break;
+
+    case LdvTxPayload:
+        {
+            LonByte length = DriverStatus.TxPayloadLen;
+            DriverStatus.TxState = LdvTxDone;
+            DriverStatus.TxNextChar += length;
+            DriverStatus.TxPayloadLen = 0;
+            HAL_UART_Transmit_DMA(&FT_UART, (uint8_t *)&pTM[DriverStatus.TxNextChar - length], length);
+        }
+        break;
+
+    case LdvTxDone:
+        LDV_TRACE_FRAME(LDV_TRACE_TX, (const uint8_t*) pTM);
+        i = TxBufferIndex(pTM);
+        if ((i < LDV_TXSLOTS) && (TxBuffer[i].State == LdvTxBufferTransmitting))
+            TxBuffer[i].State = LdvTxBufferEmpty;
+        DriverStatus.pTxMsg = 0;
+        DISABLE_TX_INT();
+        DriverStatus.TxState = LdvTxIdle;
+        SignalEvent();      /* The next message can be transmitted */
+        break;
+
+    default:
+        break;
+    }
+    /* Restart the keep-alive timer */
+    DriverStatus.KeepAliveTimeout = LDV_KEEPALIVETIMEOUT;
+}
+
+#else
 
 void TxInterruptHandler(void)
 {
@@ -726,16 +1105,11 @@ void TxInterruptHandler(void)
                 /* Transmit length */
                 if (pTM != 0)
                 {
-                    for (i = 0; i < LDV_TXBUFCOUNT; i ++)
-                    {
-                        /* See if this message belongs to any buffer.
-                         * If found and the buffer is ready to transmit, change its state */
-                        if ((TxBuffer[i].Data == pTM) && (TxBuffer[i].State == LdvTxBufferReady))
-                        {
-                            TxBuffer[i].State = LdvTxBufferTransmitting;
-                            break;
-                        }
-                    }
+                    /* See if this message belongs to a buffer.
+                     * If so and the buffer is ready to transmit, change its state */
+                    i = TxBufferIndex(pTM);
+                    if ((i < LDV_TXSLOTS) && (TxBuffer[i].State == LdvTxBufferReady))
+                        TxBuffer[i].State = LdvTxBufferTransmitting;
                     DriverStatus.TxNextChar = 0;
                     DriverStatus.TxPayloadLen = pTM[0];   /* The first byte in the message is the payload length */
                     DriverStatus.TxState = LdvTxCmd;
@@ -806,21 +1180,15 @@ void TxInterruptHandler(void)
                 break;
 
             case LdvTxDone:
-                #ifdef PRINT_LINK_LAYER
-                PrintData((LonByte*) pTM, DriverStatus.TxNextChar, 1);
-                #endif
-                for (i = 0; i < LDV_TXBUFCOUNT; i ++)
-                {
-                    /* Find the buffer which was being transmitted if any, and if found, change its state to empty */
-                    if (TxBuffer[i].State == LdvTxBufferTransmitting)
-                    {
-                        TxBuffer[i].State = LdvTxBufferEmpty;
-                        break;
-                    }
-                }
+                LDV_TRACE_FRAME(LDV_TRACE_TX, (const uint8_t*) pTM);
+                /* If the message was in a buffer, give it back to the allocator */
+                i = TxBufferIndex(pTM);
+                if ((i < LDV_TXSLOTS) && (TxBuffer[i].State == LdvTxBufferTransmitting))
+                    TxBuffer[i].State = LdvTxBufferEmpty;
                 DriverStatus.pTxMsg = 0;
                 DISABLE_TX_INT();        /* We are done transmitting, disable transmit interrupt */
                 DriverStatus.TxState = LdvTxIdle;
+                SignalEvent();           /* The next message can be transmitted */
                 break;
 
             default:
@@ -830,6 +1198,7 @@ void TxInterruptHandler(void)
             DriverStatus.KeepAliveTimeout = LDV_KEEPALIVETIMEOUT;
         }
 }
+#endif /* LDV_SCI_DMA */
 
 /*
  * Interrupt handler function for the periodic interval timer
@@ -858,6 +1227,18 @@ void PeriodicIntervalTimerHandler1ms(void)
         {
             /* Receive timer has expired! */
             nRxTimeout ++;
+            LDV_TRACE_EVENT(LDV_TRACE_RX_TIMEOUT, DriverStatus.RxState);
+#ifdef LDV_SCI_DMA
+            /* Stop the payload DMA before waiting for a length byte again, the HAL
+               refuses a new receive while one is running, and the next bytes would
+               land in the middle of the dropped message */
+            HAL_UART_AbortReceive(&FT_UART);
+            if (DriverStatus.RxState == LdvRxPayload)
+                RxBuffer[DriverStatus.RxBufferReceiveIndex].State = LdvRxBufferEmpty;
+            DriverStatus.RxState = LdvRxIdle;
+            if (NEURON_RXINT_ENABLED())
+                HAL_UART_Receive_IT(&FT_UART, &rxNeuronData, 1);
+#endif
             /* The driver and the Micro Server may have become out of sync */
             /* Reset the Micro Server and start over. Once the Micro Server resets,
                the uplink reset message will come in and it will reset this driver also  */
@@ -878,11 +1259,11 @@ void PeriodicIntervalTimerHandler1ms(void)
             DriverStatus.RxState        = LdvRxIdle;
 
             /* Abort ongoing receive transactions if any */
-            for (i = 0; i < LDV_RXBUFCOUNT; i ++)
+            for (i = 0; i < LDV_RXSLOTS; i ++)
                 if (RxBuffer[i].State == LdvRxBufferReceiving)
                     RxBuffer[i].State = LdvRxBufferEmpty;
             /* Restart ongoing transmit transactions if any */
-            for (i = 0; i < LDV_TXBUFCOUNT; i ++)
+            for (i = 0; i < LDV_TXSLOTS; i ++)
                 if (TxBuffer[i].State == LdvTxBufferTransmitting)
                     TxBuffer[i].State = LdvTxBufferReady;
 
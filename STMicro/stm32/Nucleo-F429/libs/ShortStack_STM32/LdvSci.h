@@ -76,8 +76,30 @@
  *******************************************************************************************/
 #define LDV_RXBUFSIZE           LON_APP_INPUT_BUFSIZE
 #define LDV_TXBUFSIZE           LON_APP_OUTPUT_BUFSIZE
-#define LDV_RXBUFCOUNT          5
-#define LDV_TXBUFCOUNT          5
+#define LDV_RXBUFCOUNT          3
+#define LDV_TXBUFCOUNT          3
+
+/*
+ * On top of the LDV_RXBUFCOUNT/LDV_TXBUFCOUNT full size buffers, the driver has
+ * small buffers of LDV_SMALLBUFSIZE bytes, used first for the messages that fit:
+ * 16 bytes hold an NV update of up to 9 bytes (7 bytes of overhead, see above).
+ * The defaults take about the RAM of 5 full size buffers, and hold 9 messages.
+ * Set a count to 0 to use full size buffers only.
+ */
+#define LDV_SMALLBUFSIZE        16
+#define LDV_RXSMALLCOUNT        6
+#define LDV_TXSMALLCOUNT        6
+
+#define LDV_RXSLOTS             (LDV_RXSMALLCOUNT + LDV_RXBUFCOUNT)
+#define LDV_TXSLOTS             (LDV_TXSMALLCOUNT + LDV_TXBUFCOUNT)
+
+/*
+ * Downlink messages for the priority queues of the Micro Server (LonNiTxQueuePriority,
+ * LonNiNonTxQueuePriority) are transmitted before the others. After LDV_TXPRIORITYBURST
+ * priority messages in a row, a waiting normal message is transmitted, so that a stream of
+ * priority messages can't hold the others back forever.
+ */
+#define LDV_TXPRIORITYBURST     4
 
 /* The following literal selects the bit rate of the SCI communication        
  * interface on the host processor. The following table gives the bit rate    
@@ -94,6 +116,34 @@
  */
 #define SS_BAUD_RATE            1
 
+#if (SS_BAUD_RATE == 0)
+    #define LDV_SCI_BPS         76800
+#elif (SS_BAUD_RATE == 1)
+    #define LDV_SCI_BPS         38400
+#elif (SS_BAUD_RATE == 2)
+    #define LDV_SCI_BPS         19200
+#else
+    #define LDV_SCI_BPS         9600
+#endif
+
+/*
+ * Uncomment to move the SCI link to DMA: the payload of an uplink message is received
+ * with one DMA transfer straight into its receive buffer, and the header, info and payload
+ * of a downlink message are transmitted with one DMA transfer each, between the RTS/CTS
+ * handshakes. The FT_UART needs its RX and TX DMA channels (CubeMX), and the HAL callbacks
+ * of the application call LdvRxCompleteHandler() and, while NEURON_TXINT_ENABLED(),
+ * TxInterruptHandler() for FT_UART.
+ */
+//#define LDV_SCI_DMA
+
+/*
+ * Uncomment to record the link layer in a RAM ring of binary records, see LdvTrace.h.
+ * The application sends them with LdvTraceDrain() and utilities/ldv_trace.py decodes them.
+ */
+//#define LDV_TRACE
+
+#include "LdvTrace.h"
+
 /*
  * Specify timeout value for the receiver, and the wakeup time value 
  * for the driver. MUST adjust these values according to actual SCI baud rate.
@@ -114,6 +164,14 @@
 #endif
 #define LDV_DRVWAKEUPTIME       255 
 
+/*
+ * LdvFlushMsgs() sleeps until the CTS, receive or transmit interrupt handlers
+ * signal the ShortStack task, or at most LDV_EVENT_TIMEOUT ms so that the
+ * timers of the event loop keep running. It doesn't sleep when a received
+ * message is already waiting.
+ */
+#define LDV_EVENT_TIMEOUT       1
+
 /*
  * Specify the keepalive timeout value for the serial link.
  * If there is no activity on the serial lines for an extended period of time, 
@@ -152,13 +210,13 @@
 #define CHECK_CTS_DEASSERTED() 	(HAL_GPIO_ReadPin(SS_I_CTS_GPIO_Port, SS_I_CTS_Pin))
 #define CHECK_CTS_ASSERTED()    (!CHECK_CTS_DEASSERTED())
 
-#define DEASSERT_RTS()          (HAL_GPIO_WritePin(SS_O_RTS_GPIO_Port, SS_O_RTS_Pin, GPIO_PIN_SET))
-#define ASSERT_RTS()          	(HAL_GPIO_WritePin(SS_O_RTS_GPIO_Port, SS_O_RTS_Pin, GPIO_PIN_RESET))
+#define DEASSERT_RTS()          (HAL_GPIO_WritePin(SS_O_RTS_GPIO_Port, SS_O_RTS_Pin, GPIO_PIN_SET), LDV_TRACE_EVENT(LDV_TRACE_RTS, 0))
+#define ASSERT_RTS()          	(HAL_GPIO_WritePin(SS_O_RTS_GPIO_Port, SS_O_RTS_Pin, GPIO_PIN_RESET), LDV_TRACE_EVENT(LDV_TRACE_RTS, 1))
 #define CHECK_RTS_DEASSERTED()  (HAL_GPIO_ReadPin(SS_O_RTS_GPIO_Port, SS_O_RTS_Pin))
 
 #ifdef FT_HRDY_Pin
-	#define DEASSERT_HRDY()         (HAL_GPIO_WritePin(FT_HRDY_GPIO_Port, FT_HRDY_Pin, GPIO_PIN_SET))
-	#define ASSERT_HRDY()           (HAL_GPIO_WritePin(FT_HRDY_GPIO_Port, FT_HRDY_Pin, GPIO_PIN_RESET))
+	#define DEASSERT_HRDY()         (HAL_GPIO_WritePin(FT_HRDY_GPIO_Port, FT_HRDY_Pin, GPIO_PIN_SET), LDV_TRACE_EVENT(LDV_TRACE_HRDY, 0))
+	#define ASSERT_HRDY()           (HAL_GPIO_WritePin(FT_HRDY_GPIO_Port, FT_HRDY_Pin, GPIO_PIN_RESET), LDV_TRACE_EVENT(LDV_TRACE_HRDY, 1))
 #else  // HRDY line can be attached to GND if the host server is always ready
 	#warning No FT_HRDY line defined
 	#define DEASSERT_HRDY()
@@ -176,7 +234,14 @@
 
 //#define ENABLE_RX_INT()         (AT91F_US_EnableIt(COM0, AT91C_US_RXRDY | AT91C_US_OVRE | AT91C_US_FRAME | AT91C_US_PARE))
 
-#ifdef STM32G071xx
+#ifdef LDV_SCI_DMA
+	/* The length byte is received with an interrupt, the rest of the message with DMA */
+	extern LonByte rxNeuronData;
+	extern LonBool neuron_rxint;
+	#define DISABLE_RX_INT()        ((neuron_rxint = FALSE), HAL_UART_AbortReceive(&FT_UART))
+	#define ENABLE_RX_INT()         ((neuron_rxint = TRUE), HAL_UART_Receive_IT(&FT_UART, &rxNeuronData, 1))
+	#define NEURON_RXINT_ENABLED()  (neuron_rxint)
+#elif defined(STM32G071xx)
 	extern LonByte rxNeuronData;
 	extern LonBool neuron_rxint;
 	#define DISABLE_RX_INT()        (neuron_rxint = FALSE)/* (huart1.Instance->CR1 &= ~(USART_CR1_RXNEIE_RXFNEIE_Msk))*/
@@ -188,7 +253,7 @@
 #endif
 
 
-#ifdef STM32G071xx
+#if defined(STM32G071xx) || defined(LDV_SCI_DMA)
 	extern LonBool neuron_txint;
 	#define ENABLE_TX_INT()       (neuron_txint = TRUE);         TxInterruptHandler()/*  (huart1.Instance->CR1 |= (USART_CR1_TXEIE_TXFNFIE_Msk))*/
 	#define DISABLE_TX_INT()       (neuron_txint = FALSE)/* (huart1.Instance->CR1 &= ~(USART_CR1_TXEIE_TXFNFIE_Msk))*/
@@ -202,6 +267,9 @@
 
 void TxInterruptHandler(void);
 void RxInterruptHandler(LonByte data);
+#ifdef LDV_SCI_DMA
+void LdvRxCompleteHandler(void);    /* HAL_UART_RxCpltCallback of FT_UART */
+#endif
 
 #define SleepMs(a)	osDelay(a)
 
@@ -237,17 +305,24 @@ typedef LON_STRUCT_BEGIN(LdvDriverStatus)
 {
     LdvDriverState      DriverState;
     LdvRxStates         RxState;
-    LonByte             RxBufferReadyIndex;     /* Receive buffer index which contains an incoming message */
+    LonByte             RxQueueHead;            /* RxQueue entry where the next received message is stored */
+    LonByte             RxQueueTail;            /* RxQueue entry of the next message for LdvGetMsg */
     LonByte             RxBufferReceiveIndex;   /* Receive buffer index which is in the process of receiving 
                                                  * an incoming message */
+    LonByte             RxNextSmall;            /* Next small receive buffer to claim */
+    LonByte             RxNextFullSize;         /* Next full size receive buffer to claim */
     LonByte             RxNextFree;             /* Position into the receive buffer where the next incoming
                                                  * byte will be stored */
     LonByte             RxPayloadLen;           /* Size of the incoming message payload */
     LdvTxStates         TxState;
     LdvTxStates         TxNextState;
-    LonByte             TxBufferEmptyIndex;     /* Transmit buffer index which is empty */
-    LonByte             TxBufferTransmitIndex;  /* Transmit buffer index which is in the process of
-                                                 * transmitting an outgoing message */
+    LonByte             TxQueueHead;            /* TxQueue entry where the next message put is stored */
+    LonByte             TxQueueTail;            /* TxQueue entry of the next message to transmit */
+    LonByte             TxPriQueueHead;         /* Same as TxQueueHead for the priority messages */
+    LonByte             TxPriQueueTail;         /* Same as TxQueueTail for the priority messages */
+    LonByte             TxPriorityBurst;        /* Priority messages transmitted while a normal one waits */
+    LonByte             TxNextSmall;            /* Next small transmit buffer to allocate */
+    LonByte             TxNextFullSize;         /* Next full size transmit buffer to allocate */
     LonByte             TxNextChar;             /* Position into the transmit buffer where the next byte to be
                                                  * transmitted is stored */
     LonByte             TxPayloadLen;           /* Size of the outgoing message payload */
@@ -276,8 +351,8 @@ typedef LON_ENUM_BEGIN(LdvRxBufferState)
 /* Definition of receive buffer    */
 typedef LON_STRUCT_BEGIN(LdvSysRxBuffer)
 {
-    LdvRxBufferState    State;
-    LonByte             Data[LDV_RXBUFSIZE];
+    volatile LdvRxBufferState State;    /* Written by the side that owns the buffer, see PublishBuffer */
+    LonByte*            Data;           /* LDV_SMALLBUFSIZE or LDV_RXBUFSIZE bytes of RxArena */
 } LON_STRUCT_END(LdvSysRxBuffer);
 
 /* Transmit buffer state    */
@@ -292,17 +367,19 @@ typedef LON_ENUM_BEGIN(LdvTxBufferState)
 /* Definition of transmit buffer    */
 typedef LON_STRUCT_BEGIN(LdvSysTxBuffer)
 {
-    LdvTxBufferState    State;
-    LonByte             Data[LDV_TXBUFSIZE];
+    volatile LdvTxBufferState State;    /* Written by the side that owns the buffer, see PublishBuffer */
+    LonByte*            Data;           /* LDV_SMALLBUFSIZE or LDV_TXBUFSIZE bytes of TxArena */
 } LON_STRUCT_END(LdvSysTxBuffer);
 
 /* Types of index used for incrementing. See function CyclicIncrement */
 typedef LON_ENUM_BEGIN(LdvIndexType)
 {
-    LdvIndexRxBufferReady,
-    LdvIndexRxBufferReceive,
-    LdvIndexTxBufferEmpty,
-    LdvIndexTxBufferTransmit
+    LdvIndexRxQueueHead,
+    LdvIndexRxQueueTail,
+    LdvIndexTxQueueHead,
+    LdvIndexTxQueueTail,
+    LdvIndexTxPriQueueHead,
+    LdvIndexTxPriQueueTail
 } LON_ENUM_END(LdvIndexType);
 
 /*
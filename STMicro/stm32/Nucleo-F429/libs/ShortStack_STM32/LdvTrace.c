@@ -0,0 +1,202 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+/*
+ * Filename: LdvTrace.c
+ *
+ * Description: Binary tracer of the ShortStack SCI link layer, see LdvTrace.h.
+ */
+
+#include <string.h>
+#include "LonPlatform.h"
+#include "LdvSci.h"
+
+#ifdef LDV_TRACE
+
+/*
+ * Timestamp of the records: the DWT cycle counter when the core has one,
+ * else the SysTick count, which the HAL uses as its 1 ms time base.
+ */
+#if (__CORTEX_M >= 3)
+    #define TraceTimestamp()    (DWT->CYCCNT)
+    #define TRACE_TIMESTAMP_HZ  SystemCoreClock
+#else
+    #define TraceTimestamp()    TraceSysTick()
+    #define TRACE_TIMESTAMP_HZ  SystemCoreClock
+#endif
+
+extern volatile LdvDriverStatus DriverStatus;
+
+static LdvTraceRecord TraceRing[LDV_TRACE_RECORDS];
+static volatile uint32_t TraceHead = 0;    /* Records written */
+static uint32_t TraceTail = 0;             /* Records sent or lost */
+static uint16_t TraceLost = 0;
+static LdvTraceWrite TraceWrite = 0;
+
+#if (__CORTEX_M < 3)
+static uint32_t TraceSysTick(void)
+{
+    uint32_t tick;
+    uint32_t count;
+
+    do
+    {
+        tick = HAL_GetTick();
+        count = SysTick->VAL;
+    } while (tick != HAL_GetTick());
+    return tick * (SysTick->LOAD + 1) + (SysTick->LOAD - count);
+}
+#endif
+
+/*
+ * Internal function writing a record: interrupts are masked for the copy only,
+ * since the records come from the interrupt handlers and from the ShortStack task.
+ */
+static void TraceWriteRecord(const LdvTraceRecord* pRecord)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    TraceRing[TraceHead & (LDV_TRACE_RECORDS - 1)] = *pRecord;
+    TraceRing[TraceHead & (LDV_TRACE_RECORDS - 1)].Timestamp = TraceTimestamp();
+    TraceHead ++;
+    __set_PRIMASK(primask);
+}
+
+static uint8_t TraceState(void)
+{
+    return (uint8_t) (DriverStatus.TxState | (DriverStatus.RxState << 3) | (DriverStatus.DriverState << 7));
+}
+
+void LdvTraceInit(LdvTraceWrite write)
+{
+#if (__CORTEX_M >= 3)
+    /* The counter is shared with LdvGetTimestamp and may be running already,
+       resetting it would break the intervals being measured */
+    if (!(CoreDebug->DEMCR & CoreDebug_DEMCR_TRCENA_Msk))
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk))
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    TraceWrite = write;
+}
+
+void LdvTraceFrame(uint8_t event, const uint8_t* pFrame)
+{
+    LdvTraceRecord record;
+    uint8_t length = pFrame[0];
+
+    record.Event = event;
+    record.State = TraceState();
+    record.Length = length;
+    record.Command = pFrame[1];
+    if (length > LDV_TRACE_DATA_BYTES)
+        length = LDV_TRACE_DATA_BYTES;
+    memcpy(record.Data, &pFrame[2], length);
+    memset(&record.Data[length], 0, LDV_TRACE_DATA_BYTES - length);
+    TraceWriteRecord(&record);
+}
+
+void LdvTraceEvent(uint8_t event, uint8_t value)
+{
+    LdvTraceRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.Event = event;
+    record.State = TraceState();
+    record.Length = value;
+    TraceWriteRecord(&record);
+}
+
+void LdvTraceDrain(void)
+{
+    static uint8_t packet[LDV_TRACE_HEADER_LEN + LDV_TRACE_PACKET_RECORDS * sizeof(LdvTraceRecord)];
+    uint32_t head = TraceHead;
+    uint32_t count;
+    uint32_t i;
+
+    if (TraceWrite == 0 || head == TraceTail)
+        return;
+    if (head - TraceTail > LDV_TRACE_RECORDS)
+    {
+        /* The writers went around the ring */
+        TraceLost += (uint16_t) (head - TraceTail - LDV_TRACE_RECORDS);
+        TraceTail = head - LDV_TRACE_RECORDS;
+    }
+    count = head - TraceTail;
+    if (count > LDV_TRACE_PACKET_RECORDS)
+        count = LDV_TRACE_PACKET_RECORDS;
+    for (i = 0; i < count; i ++)
+        memcpy(&packet[LDV_TRACE_HEADER_LEN + i * sizeof(LdvTraceRecord)],
+               &TraceRing[(TraceTail + i) & (LDV_TRACE_RECORDS - 1)], sizeof(LdvTraceRecord));
+    /* Records overwritten during the copy are lost, they may be torn */
+    head = TraceHead;
+    if (head - TraceTail > LDV_TRACE_RECORDS)
+    {
+        uint32_t torn = head - TraceTail - LDV_TRACE_RECORDS;
+        if (torn >= count)
+        {
+            TraceLost += (uint16_t) count;
+            TraceTail += count;
+            return;
+        }
+        TraceLost += (uint16_t) torn;
+        TraceTail += torn;
+        count -= torn;
+        memmove(&packet[LDV_TRACE_HEADER_LEN], &packet[LDV_TRACE_HEADER_LEN + torn * sizeof(LdvTraceRecord)],
+                count * sizeof(LdvTraceRecord));
+    }
+
+    packet[0] = 'L';
+    packet[1] = 'T';
+    packet[2] = LDV_TRACE_VERSION;
+    packet[3] = sizeof(LdvTraceRecord);
+    packet[4] = (uint8_t) TRACE_TIMESTAMP_HZ;
+    packet[5] = (uint8_t) (TRACE_TIMESTAMP_HZ >> 8);
+    packet[6] = (uint8_t) (TRACE_TIMESTAMP_HZ >> 16);
+    packet[7] = (uint8_t) (TRACE_TIMESTAMP_HZ >> 24);
+    packet[8] = (uint8_t) TraceLost;
+    packet[9] = (uint8_t) (TraceLost >> 8);
+    if (TraceWrite(packet, (uint16_t) (LDV_TRACE_HEADER_LEN + count * sizeof(LdvTraceRecord))) == 0)
+    {
+        TraceTail += count;
+        TraceLost = 0;
+    }
+}
+
+#endif /* LDV_TRACE */
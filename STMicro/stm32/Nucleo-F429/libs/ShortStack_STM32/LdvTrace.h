@@ -0,0 +1,133 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+/*
+ * Filename: LdvTrace.h
+ *
+ * Description: Binary tracer of the ShortStack SCI link layer (LdvSci.c).
+ *
+ * With LDV_TRACE defined (LdvSci.h), the driver records its frames and the
+ * RTS/CTS/HRDY handshake as fixed size records in a RAM ring, from the
+ * interrupt handlers, at the cost of a timestamp and a 16 byte copy.
+ * LdvTraceDrain() sends the records in the background with the write
+ * function given to LdvTraceInit(), for example:
+ *
+ *   static int TraceToCcp(const uint8_t* pData, uint16_t length)
+ *   {
+ *       return CCP_sendPacket(commid, CCP_DEBUG_QUEUE, (uint8_t*) pData, length);
+ *   }
+ *
+ * or a HAL_UART_Transmit on the debug UART. utilities/ldv_trace.py decodes them.
+ *
+ * Packet: | 'L' | 'T' | version | record size | timestamp Hz (4) | lost records (2) | records |
+ * Record: | timestamp (4) | event | state | length | command | data (8) |
+ * little endian; state is TxState | RxState << 3 | DriverState << 7,
+ * for CTS/RTS/HRDY events length is the line level (1 = asserted).
+ */
+
+#ifndef LDV_TRACE_H
+#define LDV_TRACE_H
+
+#include <stdint.h>
+
+/* Trace events */
+#define LDV_TRACE_RX            1   /* Uplink frame received */
+#define LDV_TRACE_TX            2   /* Downlink frame transmitted */
+#define LDV_TRACE_RX_START      3   /* Length byte of an uplink frame */
+#define LDV_TRACE_RX_DROP       4   /* Uplink frame ignored, no receive buffer */
+#define LDV_TRACE_CTS           5
+#define LDV_TRACE_RTS           6
+#define LDV_TRACE_HRDY          7
+#define LDV_TRACE_RESET         8   /* Micro Server reset by the driver */
+#define LDV_TRACE_RX_TIMEOUT    9   /* Uplink frame not completed in time */
+
+#define LDV_TRACE_VERSION       1
+#define LDV_TRACE_DATA_BYTES    8   /* First bytes of the frame payload in a record */
+#ifndef LDV_TRACE_RECORDS
+#define LDV_TRACE_RECORDS       64  /* Power of 2 */
+#endif
+#define LDV_TRACE_HEADER_LEN    10
+#define LDV_TRACE_PACKET_RECORDS 11 /* Fits the 189 bytes of a CCP packet */
+
+typedef struct LdvTraceRecord
+{
+    uint32_t    Timestamp;
+    uint8_t     Event;
+    uint8_t     State;
+    uint8_t     Length;
+    uint8_t     Command;
+    uint8_t     Data[LDV_TRACE_DATA_BYTES];
+} LdvTraceRecord;
+
+/* Sends one packet, returns 0 if it was sent, non-zero to try again later */
+typedef int (*LdvTraceWrite)(const uint8_t* pData, uint16_t length);
+
+#ifdef LDV_TRACE
+    #define LDV_TRACE_FRAME(event, pFrame)  LdvTraceFrame(event, pFrame)
+    #define LDV_TRACE_EVENT(event, value)   LdvTraceEvent(event, value)
+#else
+    #define LDV_TRACE_FRAME(event, pFrame)  ((void)0)
+    #define LDV_TRACE_EVENT(event, value)   ((void)0)
+#endif
+
+/*
+ * Function: LdvTraceInit
+ * Starts the cycle counter (Cortex-M3 and up) and sets the function LdvTraceDrain sends with.
+ */
+void LdvTraceInit(LdvTraceWrite write);
+
+/*
+ * Function: LdvTraceFrame
+ * Records a frame: pFrame points to its length byte, followed by the command and the payload.
+ */
+void LdvTraceFrame(uint8_t event, const uint8_t* pFrame);
+
+/*
+ * Function: LdvTraceEvent
+ * Records an event without a frame, value goes in the length field.
+ */
+void LdvTraceEvent(uint8_t event, uint8_t value);
+
+/*
+ * Function: LdvTraceDrain
+ * Sends the records in packets of up to LDV_TRACE_PACKET_RECORDS, call it from the idle loop.
+ * Records overwritten before they could be sent are counted in the next packet.
+ */
+void LdvTraceDrain(void);
+
+#endif /* LDV_TRACE_H */
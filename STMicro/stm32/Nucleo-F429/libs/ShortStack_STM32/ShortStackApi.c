@@ -33,6 +33,9 @@
 #define EXPMSG  (PSICB->ExplicitMessage)
 #define NVMSG   (PSICB->NvMessage)
 
+/* Size of an NV message carrying len bytes of data, header included */
+#define NVMSG_SIZE(len) (sizeof(LonSmipHdr) + sizeof(LonNvMessage) - sizeof(((LonNvMessage*)0x0)->NvData) + (len))
+
 /*
  * Following is the reset message buffer. Any uplink reset message will be copied
  * into this buffer, which serves as a source for validation of various indices 
@@ -74,6 +77,127 @@ extern const LonApiError SendNvPollResponse(const LonSmipMsg* pSmipMsg);
 extern const LonApiError SendLocal(const LonSmipCmd command, const void* const pData, const LonByte length);
 extern const LonApiError WriteNvLocal(const LonByte index, const void* const pData, const LonByte length);
 
+#if LON_APPLICATION_MESSAGES && LON_PENDING_REQUESTS
+
+#if LON_PENDING_REQUESTS > 255
+#   error LON_PENDING_REQUESTS is limited to 255
+#endif
+
+/*
+ * The open transactions of LonSendRequest. The Micro Server reports the responses
+ * and the completion of the requests of a tag in the order they were sent, so an
+ * event goes to the oldest entry of its tag. An entry that timed out or was canceled
+ * stays, closed, until its completion, not to take the events of the next one.
+ */
+typedef struct
+{
+    LonRequestHandle handle;        /* LON_INVALID_REQUEST: free entry */
+    LonUbits16 sequence;            /* send order */
+    LonByte tag;
+    LonBool closed;                 /* the callback had its last event */
+    LonUbits32 remaining;           /* microseconds before the timeout, 0 for none */
+    LonRequestCallback callback;
+    void* context;
+} PendingRequest;
+
+static PendingRequest pendingRequests[LON_PENDING_REQUESTS];
+static LonUbits16 requestSequence;
+static LonUbits32 lastRequestSweep;
+
+/* The oldest open transaction of the tag, NULL if none */
+static PendingRequest* FindRequest(const unsigned tag)
+{
+    PendingRequest* pOldest = NULL;
+    unsigned i;
+
+    for (i = 0; i < LON_PENDING_REQUESTS; i++)
+    {
+        PendingRequest* p = &pendingRequests[i];
+
+        if (p->handle != LON_INVALID_REQUEST && p->tag == tag
+            && (pOldest == NULL 
+                || (LonUbits16)(requestSequence - p->sequence) > (LonUbits16)(requestSequence - pOldest->sequence)))
+            pOldest = p;
+    }
+    return pOldest;
+}
+
+/* Gives a response to its transaction, FALSE if it isn't one of LonSendRequest */
+static LonBool RequestResponse(const LonResponseAddress* const pAddress, const unsigned tag, const LonByte code, 
+                               const LonByte* const pData, const unsigned dataLength)
+{
+    PendingRequest* p = FindRequest(tag);
+
+    if (p == NULL)
+        return FALSE;
+    if (!p->closed)
+        p->callback(p->handle, p->context, LonRequestResponse, pAddress, code, pData, dataLength);
+    return TRUE;
+}
+
+/* 
+ * Frees the entry, then gives the last event if the transaction is still open:
+ * the callback can send the next request. 
+ */
+static void CloseRequest(PendingRequest* const p, const LonRequestEvent event)
+{
+    LonRequestHandle handle = p->handle;
+    LonBool closed = p->closed;
+
+    p->handle = LON_INVALID_REQUEST;
+    if (!closed)
+        p->callback(handle, p->context, event, NULL, 0, NULL, 0);
+}
+
+/* Completes a transaction, FALSE if it isn't one of LonSendRequest */
+static LonBool RequestCompleted(const unsigned tag, const LonBool success)
+{
+    PendingRequest* p = FindRequest(tag);
+
+    if (p == NULL)
+        return FALSE;
+    CloseRequest(p, success ? LonRequestCompleted : LonRequestFailed);
+    return TRUE;
+}
+
+/* The Micro Server reset, its transactions are lost */
+static void FailRequests(void)
+{
+    unsigned i;
+
+    for (i = 0; i < LON_PENDING_REQUESTS; i++)
+        if (pendingRequests[i].handle != LON_INVALID_REQUEST)
+            CloseRequest(&pendingRequests[i], LonRequestFailed);
+}
+
+/* Times out the open transactions, called by LonEventHandler */
+static void SweepRequests(void)
+{
+    LonUbits32 elapsed = LdvGetElapsedMicros(lastRequestSweep);
+    unsigned i;
+
+    if (elapsed == 0)
+        return;
+    /* Advance by what elapsed accounts for, the sub-microsecond remainder goes to the next sweep */
+    lastRequestSweep = LdvAdvanceTimestamp(lastRequestSweep, elapsed);
+    for (i = 0; i < LON_PENDING_REQUESTS; i++)
+    {
+        PendingRequest* p = &pendingRequests[i];
+
+        if (p->handle == LON_INVALID_REQUEST || p->closed || p->remaining == 0)
+            continue;
+        if (p->remaining > elapsed)
+            p->remaining -= elapsed;
+        else
+        {
+            p->remaining = 0;
+            p->closed = TRUE;
+            p->callback(p->handle, p->context, LonRequestTimedOut, NULL, 0, NULL, 0);
+        }
+    }
+}
+#endif    /* LON_APPLICATION_MESSAGES && LON_PENDING_REQUESTS */
+
 #if LON_ISI_ENABLED
 extern LonApiError SendDownlinkRpc(IsiDownlinkRpcCode code, LonByte param1, LonByte param2, void* pData, unsigned len);
 extern void HandleDownlinkRpcAck(IsiRpcMessage* pMsg, LonBool bSuccess);
@@ -192,13 +316,32 @@ const LonApiError LonInit(const char *usartName )
  * the application.
  */
 void LonEventHandler(void)
+{
+    (void) LonEventHandlerEx(1, 0);
+}
+
+/*
+ * Function: LonEventHandlerEx
+ * Same as <LonEventHandler>, but processes several received messages per call.
+ *
+ * Remarks:
+ * Transmissions are flushed once, before the messages are processed: when messages
+ * are waiting, LdvFlushMsgs doesn't sleep.
+ */
+unsigned LonEventHandlerEx(unsigned maxMsgs, LonUbits32 maxMicros)
 {
     LonSmipMsg* pSmipMsg = NULL;
+    LonUbits32 start = LdvGetTimestamp();
+    unsigned count = 0;
 
     /* Force the serial driver to flush its transmit buffers */
     LdvFlushMsgs();
 
-    if (LdvGetMsg(&pSmipMsg) == LonApiNoError)
+    #if LON_APPLICATION_MESSAGES && LON_PENDING_REQUESTS
+    SweepRequests();
+    #endif
+
+    while ((maxMsgs == 0 || count < maxMsgs) && LdvGetMsg(&pSmipMsg) == LonApiNoError)
     {
         /* A message has been retrieved from driver's receive buffer    */
         LonCorrelator correlator = {0};
@@ -375,6 +518,11 @@ void LonEventHandler(void)
                     else
                     {
                         #if    LON_APPLICATION_MESSAGES
+                            #if    LON_PENDING_REQUESTS
+                            if (RequestCompleted(LON_GET_ATTRIBUTE(EXPMSG, LON_EXPMSG_TAG), 
+                                                 (LonBool)(LON_GET_ATTRIBUTE(EXPMSG, LON_EXPMSG_COMPLETIONCODE) == LonCompletionSuccess)))
+                                break;
+                            #endif    /* LON_PENDING_REQUESTS */
                             LonMsgCompleted(LON_GET_ATTRIBUTE(EXPMSG, LON_EXPMSG_TAG), 
                                             (LonBool)(LON_GET_ATTRIBUTE(EXPMSG, LON_EXPMSG_COMPLETIONCODE) == LonCompletionSuccess));
                         #endif    /* LON_APPLICATION_MESSAGES */
@@ -462,6 +610,16 @@ void LonEventHandler(void)
                         {
                             /* Explicit message response. */
                             #if    LON_APPLICATION_MESSAGES
+                                #if    LON_PENDING_REQUESTS
+                                    #if    LON_EXPLICIT_ADDRESSING
+                                    if (RequestResponse(&(EXPMSG.Address.Response), 
+                                    #else
+                                    if (RequestResponse(NULL, 
+                                    #endif
+                                                        LON_GET_ATTRIBUTE(EXPMSG, LON_EXPMSG_TAG), 
+                                                        EXPMSG.Code, EXPMSG.Data.Data, (LonByte)(EXPMSG.Length-1)))
+                                        break;
+                                #endif    /* LON_PENDING_REQUESTS */
                                 #if    LON_EXPLICIT_ADDRESSING
                                     LonResponseArrived(&(EXPMSG.Address.Response), 
                                                        LON_GET_ATTRIBUTE(EXPMSG, LON_EXPMSG_TAG), 
@@ -483,6 +641,9 @@ void LonEventHandler(void)
                 /* Reset the serial driver to get back in sync. */
                 LdvReset();
                 CurrentNmNdStatus = NO_NM_ND_PENDING;
+                #if LON_APPLICATION_MESSAGES && LON_PENDING_REQUESTS
+                FailRequests();
+                #endif
                 memcpy((void*)&lastResetNotification, (LonResetNotification *) pSmipMsg, sizeof(LonResetNotification)); 
                 LonResetOccurred((LonResetNotification *) pSmipMsg);
                 break;
@@ -565,7 +726,13 @@ void LonEventHandler(void)
 
         /* Release the receive buffer back to the serial driver. */
         LdvReleaseMsg(pSmipMsg);
+
+        /* The time budget is checked between messages, a message is always completed */
+        count ++;
+        if (maxMicros != 0 && LdvGetElapsedMicros(start) >= maxMicros)
+            break;
     }
+    return LdvGetMsgCount();
 }
 
 /*
@@ -619,7 +786,7 @@ const LonApiError LonPollNv(const unsigned nvIndex)
             /* ...that has been declared with the polled attribute */
             result = LonApiNvPollNotPolledNv;
         } 
-        else if(LdvAllocateMsg(&pSmipMsg) != LonApiNoError) 
+        else if(LdvAllocateMsgSized(&pSmipMsg, NVMSG_SIZE(0)) != LonApiNoError) 
         {
             /* ...and if we have a buffer for this request */
             result = LonApiTxBufIsFull;
@@ -998,6 +1165,98 @@ const LonApiError LonSendMsg(const unsigned tag, const LonBool priority, const L
     }
     return result;
 }
+
+#if LON_PENDING_REQUESTS
+/*
+ * Function: LonSendRequest
+ * Send a request message, with a continuation for its responses.
+ *
+ * Parameters:
+ * tag - message tag for this message
+ * priority - priority attribute of the message
+ * authenticated - TRUE to use authenticated service
+ * pDestAddr - pointer to destination address
+ * code - message code
+ * pData - message data, is NULL if length is zero
+ * length - number of valid bytes available through pData
+ * callback - <LonRequestCallback> of the transaction
+ * context - passed to callback
+ * timeout - milliseconds before the transaction is given up, 0 to wait for the Micro Server
+ * pHandle - receives the <LonRequestHandle> of the transaction, can be NULL
+ *
+ * Returns:
+ * <LonApiError>. LonApiTxBufIsFull when LON_PENDING_REQUESTS transactions are open.
+ *
+ * Remarks:
+ * The handle carries the table entry and the low byte of the send sequence, so 
+ * that <LonCancelRequest> can tell a stale handle. The time elapsed since the 
+ * last sweep is added to the timeout, SweepRequests takes it off again.
+ */
+const LonApiError LonSendRequest(const unsigned tag, const LonBool priority, const LonBool authenticated,
+            const LonSendAddress* const pDestAddr, const LonByte code, 
+            const LonByte* const pData, const unsigned length,
+            const LonRequestCallback callback, void* const context,
+            const unsigned timeout, LonRequestHandle* const pHandle)
+{
+    PendingRequest* p = NULL;
+    LonApiError result = LonApiNoError;
+    unsigned i;
+
+    for (i = 0; i < LON_PENDING_REQUESTS && p == NULL; i++)
+        if (pendingRequests[i].handle == LON_INVALID_REQUEST)
+            p = &pendingRequests[i];
+
+    if (pHandle != NULL)
+        *pHandle = LON_INVALID_REQUEST;
+
+    if (callback == NULL)
+        result = LonApiInvalidParameter;
+    else if (p == NULL)
+        /* As many transactions open as the table takes */
+        result = LonApiTxBufIsFull;
+    else if ((result = LonSendMsg(tag, priority, LonServiceRequest, authenticated, pDestAddr, code, pData, length)) == LonApiNoError)
+    {
+        requestSequence++;
+        p->sequence = requestSequence;
+        p->handle = (LonRequestHandle) (((requestSequence & 0xFF) << 8) | (p - pendingRequests + 1));
+        p->tag = (LonByte) tag;
+        p->closed = FALSE;
+        p->remaining = timeout ? (LonUbits32) timeout * 1000 + LdvGetElapsedMicros(lastRequestSweep) : 0;
+        p->callback = callback;
+        p->context = context;
+        if (pHandle != NULL)
+            *pHandle = p->handle;
+    }
+    return result;
+}
+
+/*
+ * Function: LonCancelRequest
+ * Stops the callbacks of a transaction started with <LonSendRequest>.
+ *
+ * Parameters:
+ * handle - the handle returned by <LonSendRequest>
+ *
+ * Returns:
+ * <LonApiError>. LonApiInvalidParameter when the transaction already had its last event.
+ *
+ * Remarks:
+ * The entry stays until the Micro Server completes the transaction.
+ */
+const LonApiError LonCancelRequest(const LonRequestHandle handle)
+{
+    unsigned entry = (handle & 0xFF) - 1;
+    LonApiError result = LonApiInvalidParameter;
+
+    if (handle != LON_INVALID_REQUEST && entry < LON_PENDING_REQUESTS
+        && pendingRequests[entry].handle == handle && !pendingRequests[entry].closed)
+    {
+        pendingRequests[entry].closed = TRUE;
+        result = LonApiNoError;
+    }
+    return result;
+}
+#endif    /* LON_PENDING_REQUESTS */
 #endif    /* LON_APPLICATION_MESSAGES    */
 
 #if LON_NM_QUERY_FUNCTIONS
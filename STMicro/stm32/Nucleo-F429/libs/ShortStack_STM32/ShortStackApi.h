@@ -44,6 +44,29 @@
 
 #include "ShortStackTypes.h"
 
+/*
+ * Set LON_NV_COALESCE to 1 (ShortStackDev.h or the compiler options) so that
+ * <LonPropagateNv> updates the queued NV-update message of the same network
+ * variable, if it hasn't been transmitted yet, instead of queueing another one.
+ * A fast changing output then takes one transmit buffer and the Micro Server
+ * only gets its latest value, with one <LonNvUpdateCompleted> event.
+ * That single event completes all the propagates merged into the message: the
+ * application gets fewer completion events than successful <LonPropagateNv>
+ * calls, and must not wait for one event per call.
+ */
+#ifndef LON_NV_COALESCE
+#   define LON_NV_COALESCE 0
+#endif
+
+/*
+ * Set LON_PENDING_REQUESTS to the number of request transactions that
+ * <LonSendRequest> can keep open at a time (up to 255). With 0, the default,
+ * <LonSendRequest> and its table are left out.
+ */
+#ifndef LON_PENDING_REQUESTS
+#   define LON_PENDING_REQUESTS 0
+#endif
+
 /*
  * ******************************************************************************
  * SECTION: API FUNCTIONS
@@ -91,6 +114,26 @@ extern const LonApiError LonInit(const char *usartName );
  */
 extern void LonEventHandler(void);
 
+/*
+ * Function: LonEventHandlerEx
+ * Same as <LonEventHandler>, but processes several received messages per call.
+ *
+ * Parameters:
+ * maxMsgs - maximum number of received messages processed, 0 for no limit
+ * maxMicros - no message is started after this many microseconds, 0 for no limit
+ *
+ * Returns:
+ * The number of received messages still waiting. If it is non-zero, call again
+ * after other urgent work instead of waiting for the next idle loop iteration.
+ *
+ * Remarks:
+ * <LonEventHandler> processes one message per call, so a burst of uplink messages
+ * takes as many idle loop iterations. At least one waiting message is processed,
+ * whatever the time budget. Each processed message frees its receive buffer, so
+ * the Micro Server is resumed (HRDY) as soon as a full size buffer is free.
+ */
+extern unsigned LonEventHandlerEx(unsigned maxMsgs, LonUbits32 maxMicros);
+
 /*
  * Function: LonPollNv
  * Polls a bound, polling, input network variable.
@@ -147,6 +190,11 @@ extern const LonApiError LonPollNv(const unsigned index);
  * This function returns LonApiNoError if the outgoing NV-update message has been 
  * buffered by the driver, otherwise, an appropriate error code is returned.
  * See <LonNvUpdateCompleted> for the completion event that accompanies this API.
+ * With LON_NV_COALESCE, an update still waiting in the driver is given the new value,
+ * and this call gets no <LonNvUpdateCompleted> of its own: the event of the queued
+ * update completes both.
+ *
+ * Call it from the task that calls <LonEventHandler> only (see <LdvAllocateMsg>).
  */
 extern const LonApiError LonPropagateNv(const unsigned index);
 
@@ -341,6 +389,8 @@ extern const volatile LonResetNotification* const LonGetLastResetNotification(vo
  * work:  the application will receive a successful completion event (because 
  * the API will successfully pass the request to the Micro Server), but there 
  * will be no effect, and the application will not receive a callback (if any).
+ *
+ * Like <LonPropagateNv>, it must be called from the task that calls <LonEventHandler>.
  */
 extern const LonApiError LonSendMsg(const unsigned tag, const LonBool priority, 
                                     const LonServiceType serviceType, 
@@ -349,6 +399,111 @@ extern const LonApiError LonSendMsg(const unsigned tag, const LonBool priority,
                                     const LonByte code, 
                                     const LonByte* const pData, const unsigned length);
 
+#if LON_PENDING_REQUESTS
+
+/*
+ * Typedef: LonRequestHandle
+ * Identifies a transaction started with <LonSendRequest>.
+ * LON_INVALID_REQUEST is never given to a transaction.
+ */
+typedef LonUbits16 LonRequestHandle;
+#define LON_INVALID_REQUEST 0
+
+/*
+ * Enumeration: LonRequestEvent
+ * Events given to the <LonRequestCallback> of a transaction.
+ */
+typedef LON_ENUM_BEGIN(LonRequestEvent)
+{
+    LonRequestResponse  = 0,    /* a response arrived, one per responding device */
+    LonRequestCompleted = 1,    /* all the responses arrived, last event */
+    LonRequestFailed    = 2,    /* responses missing or Micro Server reset, last event */
+    LonRequestTimedOut  = 3     /* the timeout of <LonSendRequest> expired, last event */
+} LON_ENUM_END(LonRequestEvent);
+
+/*
+ * Typedef: LonRequestCallback
+ * Continuation of a transaction started with <LonSendRequest>.
+ *
+ * Parameters:
+ * handle - the handle returned by <LonSendRequest>
+ * context - the context given to <LonSendRequest>
+ * event - <LonRequestEvent>
+ * pAddress - address of the response (see <LonResponseAddress>), NULL without
+ *   LON_EXPLICIT_ADDRESSING and for the other events
+ * code - response code
+ * pData - pointer to response data, might be NULL if dataLength is zero
+ * dataLength - number of bytes available through pData
+ *
+ * Remarks:
+ * Called from <LonEventHandler>, pointers are only valid for the duration of the callback.
+ */
+typedef void (*LonRequestCallback)(const LonRequestHandle handle, void* const context, 
+                                   const LonRequestEvent event, 
+                                   const LonResponseAddress* const pAddress, const LonByte code, 
+                                   const LonByte* const pData, const unsigned dataLength);
+
+/*
+ * Function: LonSendRequest
+ * Send a request message, with a continuation for its responses.
+ *
+ * Parameters:
+ * tag - message tag for this message
+ * priority - priority attribute of the message
+ * authenticated - TRUE to use authenticated service
+ * pDestAddr - pointer to destination address
+ * code - message code
+ * pData - message data, is NULL if length is zero
+ * length - number of valid bytes available through pData
+ * callback - <LonRequestCallback> of the transaction
+ * context - passed to callback
+ * timeout - milliseconds before the transaction is given up, 0 to wait for the Micro Server
+ * pHandle - receives the <LonRequestHandle> of the transaction, can be NULL
+ *
+ * Returns:
+ * <LonApiError>. LonApiTxBufIsFull when LON_PENDING_REQUESTS transactions are open.
+ *
+ * Remarks:
+ * Same as <LonSendMsg> with the request service, but the responses and the 
+ * completion go to *callback* instead of <LonResponseArrived> and <LonMsgCompleted>:
+ * *callback* gets a LonRequestResponse event per response, then one of the 
+ * other events. Any number of transactions can be open on the same tag, the
+ * Micro Server reports them in the order they were sent.
+ *
+ * The timeout is counted down by <LonEventHandler>, which must be called more 
+ * often than the cycle counter wraps (see <LdvGetElapsedMicros>). A transaction that timed out or 
+ * was canceled keeps its entry, without further callbacks, until the Micro 
+ * Server completes it. Don't send requests with <LonSendMsg> on the tags used 
+ * here, and give priority and non-priority requests different tags.
+ *
+ * The table of open transactions isn't locked either: send the requests from
+ * the task that calls <LonEventHandler>, like <LonSendMsg>.
+ */
+extern const LonApiError LonSendRequest(const unsigned tag, const LonBool priority, 
+                                        const LonBool authenticated,
+                                        const LonSendAddress* const pDestAddr, 
+                                        const LonByte code, 
+                                        const LonByte* const pData, const unsigned length,
+                                        const LonRequestCallback callback, void* const context,
+                                        const unsigned timeout, LonRequestHandle* const pHandle);
+
+/*
+ * Function: LonCancelRequest
+ * Stops the callbacks of a transaction started with <LonSendRequest>.
+ *
+ * Parameters:
+ * handle - the handle returned by <LonSendRequest>
+ *
+ * Returns:
+ * <LonApiError>. LonApiInvalidParameter when the transaction already had its last event.
+ *
+ * Remarks:
+ * The message may still be sent, the Micro Server completes it as usual.
+ */
+extern const LonApiError LonCancelRequest(const LonRequestHandle handle);
+
+#endif    /* LON_PENDING_REQUESTS */
+
 #endif    /* LON_APPLICATION_MESSAGES */
 
 /*
@@ -942,6 +1097,8 @@ extern void LonNvUpdateOccurred(const unsigned index, const LonReceiveAddress* c
  * This callback completes the transaction that was started by calling the 
  * <LonPropagateNv> or <LonPollNv> API functions.  The index parameter 
  * delivered with this callback matches the one from the API invocation.
+ * With LON_NV_COALESCE, one callback may complete several <LonPropagateNv>
+ * calls of the same network variable.
  */
 extern void LonNvUpdateCompleted(const unsigned index, const LonBool success);
 
@@ -1028,7 +1185,7 @@ extern void LonMsgArrived(const LonReceiveAddress* const pAddress,
  *
  * Remarks:
  * This callback occurs when a message arrives in response to an earlier request, 
- * sent with the <LonSendMsg> API.
+ * sent with the <LonSendMsg> API. The responses to <LonSendRequest> go to its callback.
  */
 extern void LonResponseArrived(const LonResponseAddress* const pAddress, 
                                const unsigned tag, 
@@ -1054,6 +1211,7 @@ extern void LonResponseArrived(const LonResponseAddress* const pAddress,
  * considered successful when the Micro Server receives a response from each of the 
  * destination devices, and unsuccessful if the transaction timeout expires 
  * before responses have been received from all destinations devices.
+ * The completions of <LonSendRequest> go to its callback.
  */
 extern void LonMsgCompleted(const unsigned tag, const LonBool success);
 
@@ -1453,9 +1611,32 @@ extern void LdvFlushMsgs(void);
  * return from the call. The caller must free the memory to the driver later 
  * by calling <LdvPutMsg>. 
  * Previously named ldv_allocate_msg.
+ *
+ * The transmit buffers have a single producer: the claim of a buffer and 
+ * <LdvPutMsg> are safe against the interrupt handlers, not against another
+ * task preempting them. Allocate and put all the downlink messages from one task, the one 
+ * that calls <LdvFlushMsgs> (<LonEventHandler>), or serialize the callers.
  */
 extern LonApiError LdvAllocateMsg(LonSmipMsg **ppMsg); 
 
+/*
+ * Function: LdvAllocateMsgSized
+ * Allocates a transmit buffer of at least *size* bytes from the serial driver.
+ *
+ * Parameters:
+ * ppMsg - pointer to the transmit buffer pointer that will be returned.
+ * size - number of bytes of the message, header included.
+ *
+ * Returns:
+ * <LonApiError> - LonApiNoError if the message was successfully allocated, 
+ *                 an appropriate error code, otherwise.
+ *
+ * Remarks:
+ * Same as <LdvAllocateMsg>, for short messages that can use a small buffer.
+ * The caller must not write past *size* bytes.
+ */
+extern LonApiError LdvAllocateMsgSized(LonSmipMsg **ppMsg, unsigned size); 
+
 /*
  * Function: LdvPutMsg
  * Sends a message downlink.
@@ -1469,9 +1650,28 @@ extern LonApiError LdvAllocateMsg(LonSmipMsg **ppMsg);
  * that upon return, the memory pointed to by *pMsg* has been returned to 
  * the driver. Therefore, the caller must not use this memory anymore.
  * Previously named ldv_put_msg.
+ * Same task as <LdvAllocateMsg>.
  */
 extern void LdvPutMsg(const LonSmipMsg* pMsg);
 
+/*
+ * Function: LdvFindQueuedMsg
+ * Finds a message put with <LdvPutMsg> that the driver hasn't started to transmit.
+ *
+ * Parameters:
+ * pMsg - the message to compare with.
+ * length - number of bytes to compare, header included.
+ *
+ * Returns:
+ * The queued message whose first *length* bytes are those of *pMsg*, or NULL.
+ *
+ * Remarks:
+ * The caller may change the data of the message that is returned, in place and
+ * without changing its length, up to its next call to <LdvFlushMsgs>.
+ * Must be called from the task that calls <LdvFlushMsgs>.
+ */
+extern LonSmipMsg* LdvFindQueuedMsg(const LonSmipMsg* pMsg, unsigned length);
+
 /*
  * Function: LdvPutMsgBlocking
  * Sends a message downlink using a blocking call.
@@ -1529,4 +1729,37 @@ extern LonApiError LdvGetMsg(LonSmipMsg** pMsg);
  */
 extern void LdvReleaseMsg(const LonSmipMsg* pMsg);
 
+/*
+ * Function: LdvGetMsgCount
+ * Returns the number of received messages waiting for <LdvGetMsg>.
+ */
+extern unsigned LdvGetMsgCount(void);
+
+/*
+ * Function: LdvGetTimestamp
+ * Returns a free running time stamp, for <LdvGetElapsedMicros>.
+ */
+extern LonUbits32 LdvGetTimestamp(void);
+
+/*
+ * Function: LdvGetElapsedMicros
+ * Returns the microseconds elapsed since *timestamp* was taken with <LdvGetTimestamp>.
+ *
+ * Remarks:
+ * The resolution depends on the platform, see LdvSci.c. The DWT cycle counter 
+ * wraps after 2^32 / SystemCoreClock seconds (23.8 s at 180 MHz), a longer 
+ * interval comes out short by that much.
+ */
+extern LonUbits32 LdvGetElapsedMicros(LonUbits32 timestamp);
+
+/*
+ * Function: LdvAdvanceTimestamp
+ * Returns *timestamp* moved forward by *micros*, as returned by <LdvGetElapsedMicros>.
+ *
+ * Remarks:
+ * Moves a reference time stamp by the microseconds taken from it, the part 
+ * of a microsecond <LdvGetElapsedMicros> dropped is counted in the next interval.
+ */
+extern LonUbits32 LdvAdvanceTimestamp(LonUbits32 timestamp, LonUbits32 micros);
+
 #endif /* _SHORTSTACK_API_H */
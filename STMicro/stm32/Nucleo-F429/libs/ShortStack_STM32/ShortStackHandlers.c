@@ -19,6 +19,9 @@
 
 #include "ShortStackDev.h"
 #include "ShortStackApi.h"
+#ifdef FTMQ_LON
+#include "ftmq_lon.h"
+#endif
 #if LON_DMF_ENABLED
 #include "string.h"         /* Required for memcpy */
 #endif /* LON_DMF_ENABLED */
@@ -166,6 +169,9 @@ void LonServicePinHeld(void)
 void LonNvUpdateOccurred(const unsigned index, const LonReceiveAddress* const pSourceAddress)
 {
     // myNvUpdateOccurred(index, pSourceAddress);
+#ifdef FTMQ_LON
+    FTMQ_lon_nv_updated(index); // bound input NVs go to the host as FTMQ messages
+#endif
 }
 #endif
 
@@ -29,6 +29,9 @@
 #define EXPMSG  (PSICB->ExplicitMessage)
 #define NVMSG   (PSICB->NvMessage)
 
+/* Size of an NV message carrying len bytes of data, header included */
+#define NVMSG_SIZE(len) (sizeof(LonSmipHdr) + sizeof(LonNvMessage) - sizeof(((LonNvMessage*)0x0)->NvData) + (len))
+
 /* 
  * Forward declarations for functions used internally by the ShortStack Api.
  */
@@ -105,7 +108,8 @@ const LonApiError VerifyNv(const LonByte nvIndex, LonByte nvLength)
  **********************************************************************************/
 void PrepareNvMessage(LonSmipMsg* pSmipMsg, const LonByte nvIndex, const LonByte* const pData, const LonByte len)
 {
-    memset(pSmipMsg, 0, sizeof(LonSmipMsg));
+    /* The buffer may be a small one, sized with NVMSG_SIZE */
+    memset(pSmipMsg, 0, NVMSG_SIZE(0));
     
     /* if the nv index is less than 63, it is also stored in the command byte */
     pSmipMsg->Header.Command = (LonSmipCmd) (nvIndex < LON_NV_ESCAPE_SEQUENCE ? (LonNiNv | nvIndex) : (LonNiNv | LON_NV_ESCAPE_SEQUENCE));
@@ -137,14 +141,27 @@ const LonApiError SendNv(const LonByte nvIndex)
     if (result == LonApiNoError) 
     {
         LonSmipMsg* pSmipMsg = NULL;
-        if (LdvAllocateMsg(&pSmipMsg) != LonApiNoError) 
+        const LonNvDescription* const pNvTable = LonGetNvTable();
+#if LON_NV_COALESCE
+        /* An update of this NV still in the driver gets the new value: it has the
+         * same header, which also means the same length */
+        LonSmipMsg header;
+
+        PrepareNvMessage(&header, nvIndex, NULL, (LonByte) LonGetCurrentNvSize(nvIndex));
+        pSmipMsg = LdvFindQueuedMsg(&header, NVMSG_SIZE(0));
+        if (pSmipMsg != NULL)
+        {
+            memcpy(NVMSG.NvData, (const void*) pNvTable[nvIndex].pData, LonGetCurrentNvSize(nvIndex));
+        }
+        else
+#endif
+        if (LdvAllocateMsgSized(&pSmipMsg, NVMSG_SIZE(LonGetCurrentNvSize(nvIndex))) != LonApiNoError) 
         {
             /* Return failure if transmit buffer is full */
             result = LonApiTxBufIsFull;
         } 
         else 
         {
-            const LonNvDescription* const pNvTable = LonGetNvTable();
             PrepareNvMessage(pSmipMsg, nvIndex, (LonByte *) pNvTable[nvIndex].pData, (LonByte) LonGetCurrentNvSize(nvIndex));
             LdvPutMsg(pSmipMsg);
         }
@@ -170,7 +187,7 @@ const LonApiError SendNvPollResponse(const LonSmipMsg* pSmipMsg)
     if (result == LonApiNoError) 
     {
         LonSmipMsg* pSmipResponse = NULL;
-        if ((result = LdvAllocateMsg(&pSmipResponse)) == LonApiNoError) 
+        if ((result = LdvAllocateMsgSized(&pSmipResponse, NVMSG_SIZE(LonGetCurrentNvSize(nvIndex)))) == LonApiNoError) 
         {
             const unsigned aliasIndex = NVMSG.AliasIndex;
             const unsigned nvLength = LonGetCurrentNvSize(nvIndex);
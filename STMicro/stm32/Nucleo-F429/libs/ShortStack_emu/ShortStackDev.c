@@ -0,0 +1,89 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+/*
+ * Demo device of the ShortStack emulator, see ShortStackDev.h
+ */
+#include "ShortStackDev.h"
+
+volatile LonWord nviValue;
+volatile LonWord nvoValue;
+volatile LonByte nviBlock[LON_BLOCK_SIZE];
+volatile LonByte nvoBlock[LON_BLOCK_SIZE];
+
+static const LonNvDescription nvTable[LON_NV_COUNT] =
+{
+    { &nviValue, sizeof(nviValue), 0 },
+    { &nvoValue, sizeof(nvoValue), LON_NVDESC_OUTPUT_MASK },
+    { nviBlock, sizeof(nviBlock), 0 },
+    { nvoBlock, sizeof(nvoBlock), LON_NVDESC_OUTPUT_MASK },
+};
+
+/*
+ * Application initialization data (program ID, then fields the emulated Micro Server
+ * doesn't check, the NV count last), followed by one NV initialization byte per NV
+ * (0x80 for the outputs).
+ */
+static const LonByte appInitData[LON_APP_INIT_MSG_SIZE + LON_NV_COUNT] =
+{
+    0x9F, 0xFF, 0xFF, 0x05, 0x00, 0x04, 0x04, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, LON_MT_COUNT, LON_NV_COUNT,
+    0x00, 0x80, 0x00, 0x80
+};
+
+static const char siData[] = "&3.0@0,3;ShortStack emulator demo";
+
+const LonNvDescription* const LonGetNvTable(void)
+{
+    return nvTable;
+}
+
+const LonByte* LonGetAppInitData(void)
+{
+    return appInitData;
+}
+
+const LonByte* LonGetSiData(unsigned* pLength)
+{
+    *pLength = sizeof(siData);
+    return (const LonByte*) siData;
+}
+
+void LonFrameworkInit(void)
+{
+}
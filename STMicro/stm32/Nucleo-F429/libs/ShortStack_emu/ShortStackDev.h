@@ -0,0 +1,125 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+/*
+ * Demo device of the ShortStack emulator, in place of the files generated by the
+ * LonTalk Interface Developer (ShortStackDev.h, ShortStackDev.c) for a real application.
+ * It has two NVs of 2 bytes and two of 31 bytes (the largest NV size), and four message tags.
+ */
+#ifndef DEFINED_SHORTSTACKDEV_H
+#define DEFINED_SHORTSTACKDEV_H
+
+#include "LonPlatform.h"
+
+/* The application provides the callbacks that ShortStackHandlers.c leaves to the framework */
+#define LON_FRAMEWORK_TYPE_III
+
+#define LON_APPLICATION_MESSAGES    1
+#define LON_EXPLICIT_ADDRESSING     0
+#define LON_NM_QUERY_FUNCTIONS      0
+#define LON_NM_UPDATE_FUNCTIONS     0
+#define LON_UTILITY_FUNCTIONS       0
+#define LON_DMF_ENABLED             0
+#define LON_ISI_ENABLED             0
+#define LON_PERSISTENT_NVS          0
+
+/* Open transactions of LonSendRequest */
+#define LON_PENDING_REQUESTS        8
+
+/* Application buffers of the Micro Server */
+#define LON_APP_INPUT_BUFSIZE       50
+#define LON_APP_OUTPUT_BUFSIZE      50
+
+/* NV indices from 63 are sent with the info bytes of the link layer */
+#define LON_NV_ESCAPE_SEQUENCE      0x3F
+
+#define LON_APP_INIT_MSG_SIZE       16
+#define LON_MAX_NVS_IN_NV_INIT      16
+
+#define LON_NV_COUNT                4
+#define LON_MT_COUNT                4
+#define LonNvCount                  LON_NV_COUNT
+#define LonMtCount                  LON_MT_COUNT
+
+#define NV_nviValue_index           0
+#define NV_nvoValue_index           1
+#define NV_nviBlock_index           2
+#define NV_nvoBlock_index           3
+
+#define LON_BLOCK_SIZE              31
+
+#include "ShortStackTypes.h"
+
+/*
+ *  Typedef: LonNvDescription
+ *  An entry of the network variable table, see LonGetNvTable.
+ */
+#define LON_NVDESC_OUTPUT_MASK      0x01    /* output network variable */
+#define LON_NVDESC_OUTPUT_SHIFT     0
+#define LON_NVDESC_OUTPUT_FIELD     Attributes
+
+#define LON_NVDESC_POLLED_MASK      0x02    /* input polled, or output polled by the application */
+#define LON_NVDESC_POLLED_SHIFT     1
+#define LON_NVDESC_POLLED_FIELD     Attributes
+
+#define LON_NVDESC_CHANGEABLE_MASK  0x04    /* changeable type, the current size may differ */
+#define LON_NVDESC_CHANGEABLE_SHIFT 2
+#define LON_NVDESC_CHANGEABLE_FIELD Attributes
+
+#define LON_NVDESC_PERSISTENT_MASK  0x08    /* stored in non-volatile memory, see LonNvdDeserializeNvs */
+#define LON_NVDESC_PERSISTENT_SHIFT 3
+#define LON_NVDESC_PERSISTENT_FIELD Attributes
+
+typedef LON_STRUCT_BEGIN(LonNvDescription)
+{
+    volatile void*  pData;          /* the value */
+    LonByte         DeclaredSize;   /* size of the value in bytes */
+    LonByte         Attributes;     /* use LON_NVDESC_* macros */
+} LON_STRUCT_END(LonNvDescription);
+
+extern volatile LonWord nviValue;
+extern volatile LonWord nvoValue;
+extern volatile LonByte nviBlock[LON_BLOCK_SIZE];
+extern volatile LonByte nvoBlock[LON_BLOCK_SIZE];
+
+extern const LonNvDescription* const LonGetNvTable(void);
+extern const LonByte* LonGetAppInitData(void);
+extern const LonByte* LonGetSiData(unsigned* pLength);
+extern void LonFrameworkInit(void);
+
+#endif  /* DEFINED_SHORTSTACKDEV_H */
@@ -0,0 +1,58 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#ifndef CMSIS_OS_H
+#define CMSIS_OS_H
+// The part of CMSIS-RTOS (v1) used by the ShortStack driver, implemented by the emulator (ss_emu.c).
+// The application is the only task: waiting runs the simulated interrupts up to the end of the wait.
+#include <stdint.h>
+
+typedef enum { osOK = 0, osEventTimeout = 0x40, osErrorOS = 0xFF } osStatus;
+
+typedef struct os_semaphore_def { uint32_t dummy; } osSemaphoreDef_t;
+typedef struct os_semaphore_cb *osSemaphoreId;
+
+#define osSemaphoreDef(name) const osSemaphoreDef_t os_semaphore_def_##name = { 0 }
+#define osSemaphore(name) &os_semaphore_def_##name
+
+osSemaphoreId osSemaphoreCreate(const osSemaphoreDef_t *semaphore_def, int32_t count);
+int32_t osSemaphoreWait(osSemaphoreId semaphore_id, uint32_t millisec);
+osStatus osSemaphoreRelease(osSemaphoreId semaphore_id);
+osStatus osDelay(uint32_t millisec);
+
+#endif
@@ -0,0 +1,58 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#ifndef MAIN_H
+#define MAIN_H
+// Board definitions of the ShortStack emulator, in place of the CubeMX main.h of the FT Click firmware.
+// The pins are the GPIO lines of the SCI link to the emulated Micro Server (ss_emu.c).
+#include "stm32g0xx_hal.h"
+
+extern UART_HandleTypeDef huart1;
+#define FT_UART huart1
+
+extern GPIO_TypeDef SS_emu_port;
+#define SS_O_RTS_GPIO_Port  (&SS_emu_port)
+#define SS_O_RTS_Pin        0x0001
+#define SS_I_CTS_GPIO_Port  (&SS_emu_port)
+#define SS_I_CTS_Pin        0x0002
+#define FT_HRDY_GPIO_Port   (&SS_emu_port)
+#define FT_HRDY_Pin         0x0004
+#define FT_RESET_GPIO_Port  (&SS_emu_port)
+#define FT_RESET_Pin        0x0008
+
+#endif
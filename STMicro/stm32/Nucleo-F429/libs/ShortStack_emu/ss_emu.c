@@ -0,0 +1,772 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#include <string.h>
+#include "LdvSci.h"
+#include "ShortStackSupport.h"
+#include "cmsis_os.h"
+#include "ss_emu.h"
+
+// ShortStack Micro Server emulator, see ss_emu.h
+
+extern void PeriodicIntervalTimerHandler1ms(void);
+
+UART_HandleTypeDef huart1;
+GPIO_TypeDef SS_emu_port;
+LonByte rxNeuronData; // the board defines it for the STM32G071 driver
+
+#define PSICB(m) ((LonSicb *) (m)->Payload)
+#define NS_PER_US 1000ULL
+#define NS_PER_MS 1000000ULL
+#define EMU_EVENTS 32
+#define POLL_NS NS_PER_US // time of an __enable_irq in the task
+#define UPLINK_RESERVED (2 * SS_EMU_MAX_BUFFERS + 1) // response and completion of each output buffer, reset
+
+// simulated interrupts, and the steps of the Micro Server
+enum {
+    EV_TICK, // 1 ms timer of the driver
+    EV_UART_TX, // a downlink byte has been sent, it is on the Micro Server
+    EV_UPLINK_START, // the Micro Server may start the next uplink message
+    EV_UPLINK, // an uplink byte has been received by the host UART
+    EV_CTS_ON, // the Micro Server answers RTS
+    EV_CTS_OFF, // end of a downlink segment
+    EV_COMPLETE, // network transaction of the oldest output buffer complete
+    EV_WATCHDOG, // SS_emu_reset
+    EV_RX_TIMEOUT, // the bytes of a downlink message stopped
+    EV_RESET_DONE // the Micro Server is up again, and sends its reset notification
+};
+
+typedef struct emu_event {
+    uint64_t time;
+    uint32_t seq; // same time, in order
+    uint8_t kind;
+} emu_event;
+
+// downlink segments, each with its RTS/CTS handshake
+enum { SEG_HEADER, SEG_INFO, SEG_PAYLOAD };
+
+static SS_emu_config config;
+static SS_emu_stats stats;
+static uint64_t now; // ns
+static uint64_t byte_ns;
+static emu_event events[EMU_EVENTS];
+static unsigned event_count;
+static uint32_t event_seq;
+static unsigned isr_depth; // > 0 while a simulated interrupt runs
+static int32_t tokens; // the semaphore of the driver (LdvEvent)
+
+static uint16_t pins; // set: deasserted (high), the lines are active low
+static int16_t nv_values[256]; // last data byte of the NV updates on the network, by NV index, -1: none
+
+static struct {
+    uint8_t tx[LON_APP_OUTPUT_BUFSIZE + 2];
+    uint16_t tx_size;
+    uint16_t tx_next;
+    uint8_t *rx;
+    uint16_t rx_left;
+} uart;
+
+static struct {
+    uint8_t resetting; // until EV_RESET_DONE
+    uint8_t reset_line; // RESET asserted by the host
+    uint8_t reset_cause; // LonResetCause of the next notification
+    uint8_t initialized; // application initialization received, kept over the resets (EEPROM)
+    // downlink
+    uint8_t segment; // SEG_xxx expected with the next CTS
+    uint8_t receiving; // CTS asserted for the segment
+    uint8_t waiting; // RTS is waiting for a free output buffer
+    uint8_t count; // bytes of the segment
+    uint8_t info[2];
+    LonSmipMsg msg;
+    // output buffers, in order of completion
+    LonSmipMsg out[SS_EMU_MAX_BUFFERS];
+    uint8_t out_head;
+    uint8_t out_count;
+    // uplink queue
+    LonSmipMsg up[SS_EMU_UPLINK_FRAMES];
+    uint8_t up_head;
+    uint8_t up_count;
+    uint8_t sending; // the first message of the queue is being sent
+    uint8_t up_next; // its next byte
+} ms;
+
+static void schedule(uint8_t kind, uint64_t delay)
+{
+    emu_event e = { now + delay, event_seq++, kind };
+    unsigned i = event_count;
+
+    if (event_count == EMU_EVENTS)
+        return; // can't happen, one or two of each kind at most
+    while (i > 0 && events[i - 1].time > e.time) {
+        events[i] = events[i - 1];
+        i--;
+    }
+    events[i] = e;
+    event_count++;
+}
+
+static uint8_t scheduled(uint8_t kind)
+{
+    for (unsigned i = 0; i < event_count; i++)
+        if (events[i].kind == kind)
+            return 1;
+    return 0;
+}
+
+static void cancel(uint8_t kind)
+{
+    unsigned j = 0;
+
+    for (unsigned i = 0; i < event_count; i++)
+        if (events[i].kind != kind)
+            events[j++] = events[i];
+    event_count = j;
+}
+
+static void dispatch(uint8_t kind);
+static void cts_request(void);
+
+// runs the interrupts due until end, or until the driver signals its semaphore
+static void run_until(uint64_t end, uint8_t stop_on_token)
+{
+    while (!(stop_on_token && tokens > 0) && event_count > 0 && events[0].time <= end) {
+        emu_event e = events[0];
+
+        memmove(&events[0], &events[1], (event_count - 1) * sizeof(emu_event));
+        event_count--;
+        if (e.time > now)
+            now = e.time;
+        isr_depth++;
+        dispatch(e.kind);
+        isr_depth--;
+    }
+    if (!(stop_on_token && tokens > 0) && end > now)
+        now = end;
+}
+
+// CTS line of the Micro Server, the board calls CtsInterruptHandler on both edges (EXTI)
+static void set_cts(uint8_t asserted)
+{
+    uint16_t level = asserted ? 0 : SS_I_CTS_Pin;
+
+    if ((pins & SS_I_CTS_Pin) == level)
+        return;
+    pins = (pins & ~SS_I_CTS_Pin) | level;
+    CtsInterruptHandler();
+}
+
+// HAL_UART_TxCpltCallback of the board
+static void uart_tx_complete(void)
+{
+    if (NEURON_TXINT_ENABLED())
+        TxInterruptHandler();
+}
+
+// HAL_UART_RxCpltCallback of the board
+static void uart_rx_complete(void)
+{
+#ifdef LDV_SCI_DMA
+    LdvRxCompleteHandler();
+#else
+    if (NEURON_RXINT_ENABLED())
+        RxInterruptHandler(rxNeuronData);
+    else
+        stats.uplink_lost++;
+    HAL_UART_Receive_IT(&FT_UART, &rxNeuronData, 1);
+#endif
+}
+
+static void uart_receive(uint8_t data)
+{
+    if (uart.rx_left == 0) {
+        stats.uplink_lost++;
+        return;
+    }
+    *uart.rx++ = data;
+    if (--uart.rx_left == 0)
+        uart_rx_complete();
+}
+
+static void uplink_start(uint64_t delay)
+{
+    if (!ms.sending && !scheduled(EV_UPLINK_START))
+        schedule(EV_UPLINK_START, delay);
+}
+
+// queues an uplink message, the network traffic leaves room for the events of the output buffers
+static uint8_t uplink(const LonSmipMsg *msg, uint8_t network)
+{
+    if (ms.up_count >= SS_EMU_UPLINK_FRAMES - (network ? UPLINK_RESERVED : 0)) {
+        stats.uplink_dropped++;
+        return 0;
+    }
+    memcpy(&ms.up[(ms.up_head + ms.up_count) % SS_EMU_UPLINK_FRAMES], msg, sizeof(LonSmipMsg));
+    ms.up_count++;
+    if (!ms.resetting)
+        uplink_start(config.latency_us * NS_PER_US);
+    return 1;
+}
+
+static void uplink_byte(void)
+{
+    const LonSmipMsg *msg = &ms.up[ms.up_head];
+
+    uart_receive(((const uint8_t *) msg)[ms.up_next++]);
+    stats.uplink_bytes++;
+    if (ms.up_next < msg->Header.Length + sizeof(LonSmipHdr)) {
+        schedule(EV_UPLINK, byte_ns);
+        return;
+    }
+    stats.uplink_messages++;
+    ms.sending = 0;
+    ms.up_head = (ms.up_head + 1) % SS_EMU_UPLINK_FRAMES;
+    ms.up_count--;
+    if (ms.up_count)
+        uplink_start(config.gap_us * NS_PER_US);
+}
+
+static void reset_notification(void)
+{
+    LonResetNotification reset;
+
+    memset(&reset, 0, sizeof(reset));
+    reset.Header.Command = LonNiReset;
+    reset.Header.Length = sizeof(LonResetNotification) - sizeof(LonSmipHdr);
+    reset.Version = LON_LINK_LAYER_PROTOCOL_VERSION;
+    if (ms.initialized)
+        LON_SET_ATTRIBUTE(reset, LON_RESET_INITIALIZED, 1);
+    reset.ResetCause = ms.reset_cause;
+    reset.UniqueId[0] = 0x80;
+    reset.UniqueId[5] = 0x01;
+    reset.MaxAddresses = 15;
+    reset.MaxDomains = 2;
+    reset.MaxAliases = 10;
+    uplink((const LonSmipMsg *) &reset, 0);
+}
+
+// the Micro Server stops, and drops the messages it has
+static void reset_begin(uint8_t cause)
+{
+    cancel(EV_UPLINK_START);
+    cancel(EV_UPLINK);
+    cancel(EV_CTS_ON);
+    cancel(EV_COMPLETE);
+    cancel(EV_RESET_DONE);
+    cancel(EV_RX_TIMEOUT);
+    ms.resetting = 1;
+    ms.reset_cause = cause;
+    ms.segment = SEG_HEADER;
+    ms.receiving = 0;
+    ms.waiting = 0;
+    ms.out_count = 0;
+    ms.up_count = 0;
+    ms.sending = 0;
+    stats.resets++;
+    schedule(EV_CTS_OFF, 0);
+    if (!ms.reset_line)
+        schedule(EV_RESET_DONE, config.reset_ms * NS_PER_MS);
+}
+
+// restarts the receive timeout of the downlink message
+static void rx_timer(void)
+{
+    cancel(EV_RX_TIMEOUT);
+    if (config.rx_timeout_ms)
+        schedule(EV_RX_TIMEOUT, config.rx_timeout_ms * NS_PER_MS);
+}
+
+static void rx_timeout(void)
+{
+    stats.downlink_timeouts++;
+    ms.segment = SEG_HEADER;
+    ms.receiving = 0;
+    cancel(EV_CTS_OFF);
+    set_cts(0);
+    if (!(pins & SS_O_RTS_Pin))
+        cts_request();
+}
+
+static void cts_request(void)
+{
+    if (!scheduled(EV_CTS_ON))
+        schedule(EV_CTS_ON, config.latency_us * NS_PER_US);
+}
+
+static void cts_on(void)
+{
+    if (ms.resetting || (pins & SS_O_RTS_Pin) || !(pins & SS_I_CTS_Pin))
+        return; // no RTS, or CTS already asserted
+    if (ms.segment == SEG_HEADER && ms.out_count >= config.buffers) {
+        // the next message waits for an output buffer (EV_COMPLETE)
+        if (!ms.waiting)
+            stats.cts_waits++;
+        ms.waiting = 1;
+        return;
+    }
+    ms.waiting = 0;
+    ms.receiving = 1;
+    ms.count = 0;
+    rx_timer();
+    set_cts(1);
+}
+
+// a whole downlink message has been received
+static void downlink(void)
+{
+    LonByte command = ms.msg.Header.Command;
+
+    stats.downlink_messages++;
+    if ((command & LonNiNv) == LonNiNv
+        || ((command & 0xF0) == LonNiComm && (command & 0x0F) != LonNiResponse)
+        || (command & 0xF0) == LonNiNetManagement) {
+        // goes on the network, the output buffer is freed by its completion
+        if (ms.out_count < config.buffers) {
+            memcpy(&ms.out[(ms.out_head + ms.out_count) % SS_EMU_MAX_BUFFERS], &ms.msg, sizeof(LonSmipMsg));
+            ms.out_count++;
+            schedule(EV_COMPLETE, (config.process_us + config.network_us) * NS_PER_US);
+        }
+        return;
+    }
+    switch (command) {
+    case LonNiComm | LonNiResponse:
+        stats.responses++;
+        break;
+    case LonNiAppInit:
+        ms.initialized = 1;
+        break;
+    case LonNiReset:
+        reset_begin(LonSoftwareReset);
+        break;
+    default:
+        break; // NvInit, online, offline, usop... nothing to emulate
+    }
+}
+
+static void downlink_byte(uint8_t data)
+{
+    uint8_t done = 0;
+
+    if (ms.resetting)
+        return;
+    if (!ms.receiving) {
+        stats.downlink_errors++;
+        return;
+    }
+    rx_timer();
+    switch (ms.segment) {
+    case SEG_HEADER:
+        ((uint8_t *) &ms.msg.Header)[ms.count++] = data;
+        if (ms.count < sizeof(LonSmipHdr))
+            return;
+        if (ms.msg.Header.Command == (LonNiNv | LON_NV_ESCAPE_SEQUENCE))
+            ms.segment = SEG_INFO;
+        else if (ms.msg.Header.Length)
+            ms.segment = SEG_PAYLOAD;
+        else
+            done = 1;
+        break;
+    case SEG_INFO:
+        ms.info[ms.count++] = data;
+        if (ms.count < sizeof(ms.info))
+            return;
+        if (ms.msg.Header.Length)
+            ms.segment = SEG_PAYLOAD;
+        else
+            done = 1;
+        break;
+    default:
+        if (ms.count < sizeof(ms.msg.Payload))
+            ms.msg.Payload[ms.count] = data;
+        if (++ms.count < ms.msg.Header.Length)
+            return;
+        done = 1;
+        break;
+    }
+    // end of the segment
+    ms.receiving = 0;
+    schedule(EV_CTS_OFF, config.latency_us * NS_PER_US);
+    if (done) {
+        cancel(EV_RX_TIMEOUT);
+        ms.segment = SEG_HEADER;
+        downlink();
+    } else
+        rx_timer();
+}
+
+// the network transaction of the oldest output buffer is complete
+static void complete(void)
+{
+    LonSmipMsg *msg = &ms.out[ms.out_head];
+    LonExplicitMessage *request = &PSICB(msg)->ExplicitMessage;
+    LonSmipMsg event;
+    LonExplicitMessage *exp = &PSICB(&event)->ExplicitMessage;
+
+    if (ms.out_count == 0)
+        return;
+    memset(&event, 0, sizeof(event));
+    event.Header.Command = LonNiComm | LonNiResponse;
+    if ((msg->Header.Command & LonNiNv) == LonNiNv) {
+        // NV update or poll
+        LonNvMessage *nv = &PSICB(&event)->NvMessage;
+
+        stats.nv_updates++;
+        if (PSICB(msg)->NvMessage.Length != 0)
+            nv_values[PSICB(msg)->NvMessage.Index] = PSICB(msg)->NvMessage.NvData[PSICB(msg)->NvMessage.Length - 1];
+        nv->Attributes_1 = PSICB(msg)->NvMessage.Attributes_1;
+        LON_SET_ATTRIBUTE(*nv, LON_NVMSG_COMPLETIONCODE, LonCompletionSuccess);
+        nv->Index = PSICB(msg)->NvMessage.Index;
+        event.Header.Length = sizeof(LonNvMessage) - sizeof(nv->NvData);
+        uplink(&event, 0);
+    } else if ((msg->Header.Command & 0xF0) == LonNiNetManagement) {
+        // local network management isn't emulated
+        exp->Attributes_1 = request->Attributes_1;
+        LON_SET_ATTRIBUTE(*exp, LON_EXPMSG_RESPONSE, 1);
+        exp->Length = 1;
+        exp->Code = LON_NM_FAILURE(request->Code);
+        event.Header.Length = LON_SICB_MIN_OVERHEAD;
+        uplink(&event, 0);
+    } else {
+        stats.messages++;
+        if (LON_GET_ATTRIBUTE(*request, LON_EXPMSG_SERVICE) == LonServiceRequest) {
+            // the response of the other device: code and data of the request
+            memcpy(&event, msg, sizeof(LonSmipMsg));
+            event.Header.Command = LonNiComm | LonNiResponse;
+            exp->Attributes_2 = 0;
+            LON_SET_ATTRIBUTE(*exp, LON_EXPMSG_RESPONSE, 1);
+            uplink(&event, 0);
+            memset(&event, 0, sizeof(event));
+            event.Header.Command = LonNiComm | LonNiResponse;
+        }
+        exp->Attributes_1 = request->Attributes_1;
+        LON_SET_ATTRIBUTE(*exp, LON_EXPMSG_COMPLETIONCODE, LonCompletionSuccess);
+        exp->Length = 1;
+        exp->Code = request->Code;
+        event.Header.Length = LON_SICB_MIN_OVERHEAD;
+        uplink(&event, 0);
+    }
+    ms.out_head = (ms.out_head + 1) % SS_EMU_MAX_BUFFERS;
+    ms.out_count--;
+    if (ms.waiting)
+        cts_request();
+}
+
+static void dispatch(uint8_t kind)
+{
+    switch (kind) {
+    case EV_TICK:
+        schedule(EV_TICK, NS_PER_MS);
+        PeriodicIntervalTimerHandler1ms();
+        break;
+    case EV_UART_TX:
+        stats.downlink_bytes++;
+        downlink_byte(uart.tx[uart.tx_next++]);
+        if (uart.tx_next < uart.tx_size)
+            schedule(EV_UART_TX, byte_ns);
+        else {
+            uart.tx_size = 0;
+            uart_tx_complete();
+        }
+        break;
+    case EV_UPLINK_START:
+        // a message starts while HRDY is asserted
+        if (ms.resetting || ms.sending || ms.up_count == 0 || (pins & FT_HRDY_Pin))
+            break;
+        ms.sending = 1;
+        ms.up_next = 0;
+        schedule(EV_UPLINK, byte_ns);
+        break;
+    case EV_UPLINK:
+        uplink_byte();
+        break;
+    case EV_CTS_ON:
+        cts_on();
+        break;
+    case EV_CTS_OFF:
+        set_cts(0);
+        break;
+    case EV_COMPLETE:
+        complete();
+        break;
+    case EV_WATCHDOG:
+        reset_begin(LonWatchdogReset);
+        break;
+    case EV_RX_TIMEOUT:
+        rx_timeout();
+        break;
+    case EV_RESET_DONE:
+        ms.resetting = 0;
+        reset_notification();
+        if (!(pins & SS_O_RTS_Pin))
+            cts_request();
+        break;
+    default:
+        break;
+    }
+}
+
+// STM32 HAL
+
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+    if (uart.tx_size != 0)
+        return HAL_BUSY;
+    if (Size == 0 || Size > sizeof(uart.tx))
+        return HAL_ERROR;
+    memcpy(uart.tx, pData, Size);
+    uart.tx_size = Size;
+    uart.tx_next = 0;
+    schedule(EV_UART_TX, byte_ns);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+    return HAL_UART_Transmit_IT(huart, pData, Size);
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+    if (uart.rx_left != 0)
+        return HAL_BUSY;
+    uart.rx = pData;
+    uart.rx_left = Size;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+    return HAL_UART_Receive_IT(huart, pData, Size);
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart)
+{
+    cancel(EV_UART_TX);
+    uart.tx_size = 0;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart)
+{
+    uart.rx_left = 0;
+    return HAL_OK;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    uint16_t changed = pins;
+
+    if (PinState == GPIO_PIN_SET)
+        pins |= GPIO_Pin;
+    else
+        pins &= ~GPIO_Pin;
+    changed ^= pins;
+
+    if ((changed & SS_O_RTS_Pin) && !(pins & SS_O_RTS_Pin))
+        cts_request();
+    if ((changed & FT_HRDY_Pin) && !(pins & FT_HRDY_Pin) && ms.up_count)
+        uplink_start(config.latency_us * NS_PER_US);
+    if (changed & FT_RESET_Pin) {
+        ms.reset_line = !(pins & FT_RESET_Pin);
+        if (ms.reset_line)
+            reset_begin(LonExternalReset);
+        else
+            schedule(EV_RESET_DONE, config.reset_ms * NS_PER_MS);
+    }
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+    return (pins & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+uint32_t HAL_GetTick(void)
+{
+    return (uint32_t) (now / NS_PER_MS);
+}
+
+void __enable_irq(void)
+{
+    if (isr_depth == 0)
+        run_until(now + POLL_NS, 0);
+}
+
+// CMSIS-RTOS
+
+osSemaphoreId osSemaphoreCreate(const osSemaphoreDef_t *semaphore_def, int32_t count)
+{
+    tokens = 0;
+    return (osSemaphoreId) &tokens;
+}
+
+int32_t osSemaphoreWait(osSemaphoreId semaphore_id, uint32_t millisec)
+{
+    if (isr_depth == 0 && tokens == 0)
+        run_until(now + millisec * NS_PER_MS, 1);
+    if (tokens == 0)
+        return 0;
+    tokens--;
+    return 1;
+}
+
+osStatus osSemaphoreRelease(osSemaphoreId semaphore_id)
+{
+    tokens = 1;
+    return osOK;
+}
+
+osStatus osDelay(uint32_t millisec)
+{
+    if (isr_depth)
+        now += millisec * NS_PER_MS; // busy wait in an interrupt, the others are late
+    else
+        run_until(now + millisec * NS_PER_MS, 0);
+    return osOK;
+}
+
+// emulator
+
+void SS_emu_defaults(SS_emu_config *c)
+{
+    c->bps = LDV_SCI_BPS;
+    c->latency_us = 20;
+    c->process_us = 100;
+    c->network_us = 2000;
+    c->gap_us = 50;
+    c->reset_ms = 20;
+    c->rx_timeout_ms = 10;
+    c->buffers = 2;
+}
+
+void SS_emu_init(const SS_emu_config *c)
+{
+    if (c)
+        config = *c;
+    else
+        SS_emu_defaults(&config);
+    if (config.bps == 0)
+        config.bps = LDV_SCI_BPS;
+    if (config.buffers == 0)
+        config.buffers = 1;
+    if (config.buffers > SS_EMU_MAX_BUFFERS)
+        config.buffers = SS_EMU_MAX_BUFFERS;
+    byte_ns = (10 * 1000000000ULL + config.bps - 1) / config.bps;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&ms, 0, sizeof(ms));
+    for (unsigned i = 0; i < sizeof(nv_values) / sizeof(nv_values[0]); i++)
+        nv_values[i] = -1;
+    memset(&uart, 0, sizeof(uart));
+    now = 0;
+    event_count = 0;
+    tokens = 0;
+    pins = SS_O_RTS_Pin | SS_I_CTS_Pin | FT_HRDY_Pin | FT_RESET_Pin;
+
+    schedule(EV_TICK, NS_PER_MS);
+    // power up
+    reset_begin(LonPowerUpReset);
+    stats.resets = 0;
+}
+
+uint64_t SS_emu_time_us(void)
+{
+    return now / NS_PER_US;
+}
+
+uint8_t SS_emu_nv_update(unsigned nv_index, const uint8_t *data, uint8_t length)
+{
+    LonSmipMsg msg;
+    LonNvMessage *nv = &PSICB(&msg)->NvMessage;
+
+    if (length > LON_MAX_MSG_NV_DATA)
+        return 0;
+    memset(&msg, 0, sizeof(msg));
+    msg.Header.Command = LonNiComm | LonNiIncoming;
+    LON_SET_ATTRIBUTE(*nv, LON_NVMSG_MSGTYPE, LonMessageNv);
+    nv->Length = length;
+    nv->Index = nv_index;
+    memcpy(nv->NvData, data, length);
+    msg.Header.Length = sizeof(LonNvMessage) - sizeof(nv->NvData) + length;
+    return uplink(&msg, 1);
+}
+
+uint8_t SS_emu_msg(uint8_t code, const uint8_t *data, uint8_t length)
+{
+    LonSmipMsg msg;
+    LonExplicitMessage *exp = &PSICB(&msg)->ExplicitMessage;
+
+    if (length > LON_MAX_MSG_DATA)
+        return 0;
+    memset(&msg, 0, sizeof(msg));
+    msg.Header.Command = LonNiComm | LonNiIncoming;
+    LON_SET_ATTRIBUTE(*exp, LON_EXPMSG_SERVICE, LonServiceUnacknowledged);
+    exp->Length = length + 1;
+    exp->Code = code;
+    memcpy(exp->Data.Data, data, length);
+    msg.Header.Length = LON_SICB_MIN_OVERHEAD + length;
+    return uplink(&msg, 1);
+}
+
+void SS_emu_reset(void)
+{
+    schedule(EV_WATCHDOG, 0);
+}
+
+unsigned SS_emu_uplink_pending(void)
+{
+    return ms.up_count;
+}
+
+unsigned SS_emu_transactions(void)
+{
+    return ms.out_count;
+}
+
+int SS_emu_nv_value(unsigned nv_index)
+{
+    return nv_index < sizeof(nv_values) / sizeof(nv_values[0]) ? nv_values[nv_index] : -1;
+}
+
+const SS_emu_stats *SS_emu_get_stats(void)
+{
+    return &stats;
+}
+
+void SS_emu_clear_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
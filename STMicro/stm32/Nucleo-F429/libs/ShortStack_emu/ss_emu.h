@@ -0,0 +1,108 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#ifndef SS_EMU_H
+#define SS_EMU_H
+// default packing, the ShortStack headers (LonPlatform.h) leave pack(1) on
+#pragma pack(push)
+#pragma pack()
+#include <stdint.h>
+
+// ShortStack Micro Server emulator: the ShortStack driver and API (LdvSci.c, ShortStackApi.c, ...) run
+// unmodified on a desktop against a model of the Micro Server at the other end of the SCI link.
+// The HAL and CMSIS-RTOS calls of the driver (stm32g0xx_hal.h, cmsis_os.h) drive the model, on a simulated
+// clock: the bytes take the time of the bit rate, the Micro Server answers RTS with CTS after a latency,
+// and the 1 ms timer of the driver (PeriodicIntervalTimerHandler1ms) runs every simulated millisecond.
+// The simulated interrupts (UART, CTS line, timer) run while the application waits in the driver
+// (osSemaphoreWait, osDelay), and when the driver unmasks the interrupts (__enable_irq), which takes
+// a microsecond. The application code itself takes no simulated time.
+//
+// The Micro Server takes the downlink messages with the RTS/CTS handshake of each segment (header, info,
+// payload), answers a reset (command or RESET line) with an uplink reset notification, and sends the
+// completion event of each NV update and explicit message after the network time, the response first
+// for a request (an echo of its code and data). Local network management commands get a failure response.
+// It sends the uplink messages while HRDY is asserted, and the network traffic of the other devices
+// is injected with SS_emu_nv_update and SS_emu_msg.
+
+#define SS_EMU_UPLINK_FRAMES 64 // uplink messages queued on the Micro Server
+#define SS_EMU_MAX_BUFFERS 16
+
+typedef struct SS_emu_config {
+    uint32_t bps; // bit rate of the link (10 bits per byte), LDV_SCI_BPS by default
+    uint32_t latency_us; // Micro Server reaction to the RTS and HRDY lines, and CTS deassert after a segment
+    uint32_t process_us; // Micro Server processing of a downlink message before it goes on the network
+    uint32_t network_us; // network transaction time of a downlink message, until its completion event
+    uint32_t gap_us; // time between two uplink messages
+    uint16_t reset_ms; // Micro Server reset time, until the uplink reset notification
+    uint16_t rx_timeout_ms; // a downlink message is dropped when its bytes stop that long (0: never)
+    uint8_t buffers; // Micro Server output buffers, CTS waits for a free one (1..SS_EMU_MAX_BUFFERS)
+} SS_emu_config;
+
+typedef struct SS_emu_stats {
+    uint32_t downlink_messages;
+    uint32_t downlink_bytes;
+    uint32_t downlink_errors; // bytes sent by the host while CTS was deasserted
+    uint32_t downlink_timeouts; // downlink messages dropped, their bytes stopped (rx_timeout_ms)
+    uint32_t uplink_messages;
+    uint32_t uplink_bytes;
+    uint32_t uplink_dropped; // uplink messages not queued, the queue was full
+    uint32_t uplink_lost; // bytes the host UART wasn't receiving
+    uint32_t nv_updates; // NV updates and polls sent on the network
+    uint32_t messages; // explicit messages sent on the network
+    uint32_t responses; // responses of the host sent on the network
+    uint32_t resets;
+    uint32_t cts_waits; // RTS held while the output buffers were full
+} SS_emu_stats;
+
+void SS_emu_defaults(SS_emu_config *config);
+void SS_emu_init(const SS_emu_config *config); // before LonInit, NULL for the defaults. Powers up the Micro Server
+uint64_t SS_emu_time_us(void); // simulated time
+
+// network traffic for the host, 0 if the uplink queue is full (it keeps room for the completion events)
+uint8_t SS_emu_nv_update(unsigned nv_index, const uint8_t *data, uint8_t length);
+uint8_t SS_emu_msg(uint8_t code, const uint8_t *data, uint8_t length);
+
+void SS_emu_reset(void); // the Micro Server resets on its own (watchdog)
+unsigned SS_emu_uplink_pending(void); // uplink messages queued or being sent
+unsigned SS_emu_transactions(void); // downlink messages in the output buffers
+int SS_emu_nv_value(unsigned nv_index); // last data byte of the NV updates sent on the network, -1 if none
+const SS_emu_stats *SS_emu_get_stats(void);
+void SS_emu_clear_stats(void);
+
+#pragma pack(pop)
+#endif
@@ -0,0 +1,524 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ShortStackDev.h"
+#include "ShortStackApi.h"
+#include "LdvSci.h"
+#include "ss_emu.h"
+
+// Scenarios of the ShortStack emulator: throughput of the link and regression checks of the driver,
+// on the simulated time of ss_emu.c. The exit code is the number of failed scenarios.
+
+extern LonUbits32 nRxErrors;
+extern LonUbits32 nRxTimeout;
+extern LdvSysTxBuffer TxBuffer[LDV_TXSLOTS];
+
+static SS_emu_config config;
+static unsigned count = 200; // messages per scenario
+static unsigned max_msgs = 1; // LonEventHandlerEx
+
+static struct {
+    unsigned resets;
+    unsigned initialized; // reset notifications after the application initialization
+    unsigned nv_updates;
+    unsigned nv_completed;
+    unsigned nv_failed;
+    unsigned msgs;
+    unsigned req_completed;
+    unsigned req_failed;
+    unsigned req_timed_out;
+    unsigned bad_data;
+    int propagated[2]; // number of the last propagate of nvoValue and nvoBlock, -1: none
+} app;
+
+// API callbacks of the application (LON_FRAMEWORK_TYPE_III)
+
+void LonResetOccurred(const LonResetNotification* const pResetNotification)
+{
+    app.resets++;
+    if (LON_GET_ATTRIBUTE(*pResetNotification, LON_RESET_INITIALIZED))
+        app.initialized++;
+}
+
+void LonWink(void)
+{
+}
+
+void LonServicePinPressed(void)
+{
+}
+
+void LonServicePinHeld(void)
+{
+}
+
+void LonNvUpdateOccurred(const unsigned index, const LonReceiveAddress* const pSourceAddress)
+{
+    // the value is the number of the update, in each byte
+    LonByte expected = (LonByte) app.nv_updates;
+
+    if (index == NV_nviValue_index) {
+        if (nviValue.lsb != expected)
+            app.bad_data++;
+    } else if (index == NV_nviBlock_index) {
+        if (nviBlock[0] != expected || nviBlock[LON_BLOCK_SIZE - 1] != expected)
+            app.bad_data++;
+    }
+    app.nv_updates++;
+}
+
+void LonNvUpdateCompleted(const unsigned index, const LonBool success)
+{
+    if (success)
+        app.nv_completed++;
+    else
+        app.nv_failed++;
+}
+
+void myLonMsgArrived(const LonByte* const pData, const unsigned length)
+{
+    app.msgs++;
+}
+
+static void service(void)
+{
+    (void) LonEventHandlerEx(max_msgs, 0);
+}
+
+static uint8_t idle(void)
+{
+    return SS_emu_uplink_pending() == 0 && SS_emu_transactions() == 0 && LdvGetMsgCount() == 0;
+}
+
+// the network sends NV update number i
+static uint8_t inject(unsigned i)
+{
+    uint8_t data[LON_BLOCK_SIZE];
+
+    memset(data, (uint8_t) i, sizeof(data));
+    if (i & 1)
+        return SS_emu_nv_update(NV_nviBlock_index, data, sizeof(data));
+    data[0] = 0;
+    return SS_emu_nv_update(NV_nviValue_index, data, 2);
+}
+
+// propagates output number i, 0 if the driver has no buffer
+static uint8_t propagate(unsigned i)
+{
+    if (i & 1) {
+        memset((void *) nvoBlock, (uint8_t) i, sizeof(nvoBlock));
+        if (LonPropagateNv(NV_nvoBlock_index) != LonApiNoError)
+            return 0;
+    } else {
+        nvoValue.msb = 0;
+        nvoValue.lsb = (LonByte) i;
+        if (LonPropagateNv(NV_nvoValue_index) != LonApiNoError)
+            return 0;
+    }
+    app.propagated[i & 1] = i;
+    return 1;
+}
+
+// the propagates so far have all completed: at least expected of them (the ones the driver still had
+// when the Micro Server reset complete too) since the network had sent updates.
+// With LON_NV_COALESCE a propagate merged into a queued update has no completion event of its
+// own: each update on the network completes, and the network has the last value of each output
+static uint8_t propagated(unsigned completed, unsigned expected, unsigned updates)
+{
+#if LON_NV_COALESCE
+    return completed <= expected && completed == SS_emu_get_stats()->nv_updates - updates
+        && (app.propagated[0] < 0 || SS_emu_nv_value(NV_nvoValue_index) == (uint8_t) app.propagated[0])
+        && (app.propagated[1] < 0 || SS_emu_nv_value(NV_nvoBlock_index) == (uint8_t) app.propagated[1]);
+#else
+    return completed >= expected;
+#endif
+}
+
+// transmit buffers of the driver in use, queued or on the link
+static unsigned tx_buffers(void)
+{
+    unsigned i, n = 0;
+
+    for (i = 0; i < LDV_TXSLOTS; i++)
+        if (TxBuffer[i].State != LdvTxBufferEmpty)
+            n++;
+    return n;
+}
+
+static uint8_t request(unsigned i)
+{
+    LonByte data[8];
+
+    memset(data, (uint8_t) i, sizeof(data));
+    return LonSendMsg(i % LonMtCount, (i & 3) == 0, LonServiceRequest, FALSE, NULL, 0x10, data, sizeof(data))
+        == LonApiNoError;
+}
+
+// a LonSendRequest transaction of the pending scenario
+typedef struct {
+    unsigned number;
+    unsigned responses;
+    uint8_t done; // had its last event
+} transaction;
+
+static void request_event(const LonRequestHandle handle, void* const context, const LonRequestEvent event,
+    const LonResponseAddress* const pAddress, const LonByte code, const LonByte* const pData, const unsigned dataLength)
+{
+    transaction *t = context;
+
+    if (t->done) {
+        app.bad_data++; // nothing after the last event
+        return;
+    }
+    switch (event) {
+    case LonRequestResponse:
+        // the other device answers with the code and data of the request
+        if (code != 0x10 || dataLength == 0 || pData[0] != (LonByte) t->number)
+            app.bad_data++;
+        t->responses++;
+        break;
+    case LonRequestCompleted:
+        t->done = 1;
+        app.req_completed++;
+        if (t->responses != 1)
+            app.bad_data++;
+        break;
+    case LonRequestTimedOut:
+        t->done = 1;
+        app.req_timed_out++;
+        break;
+    default:
+        t->done = 1;
+        app.req_failed++;
+        break;
+    }
+}
+
+static uint64_t deadline(uint64_t ms)
+{
+    return SS_emu_time_us() + ms * 1000;
+}
+
+static uint8_t start(void)
+{
+    uint64_t limit;
+
+    memset(&app, 0, sizeof(app));
+    app.propagated[0] = app.propagated[1] = -1;
+    nRxErrors = 0;
+    nRxTimeout = 0;
+    SS_emu_init(&config);
+    if (LonInit("emu") != LonApiNoError)
+        return 0;
+    limit = deadline(2000);
+    while (app.initialized == 0 && SS_emu_time_us() < limit)
+        service();
+    SS_emu_clear_stats();
+    return app.initialized != 0;
+}
+
+typedef struct result {
+    const char *name;
+    uint8_t ok;
+    unsigned messages;
+    uint64_t us; // simulated
+    clock_t cpu;
+} result;
+
+static void report(const result *r)
+{
+    const SS_emu_stats *s = SS_emu_get_stats();
+    double seconds = r->us / 1e6;
+    double bytes_per_s = config.bps / 10.0;
+
+    printf("%-10s %5u msgs %9.1f ms %8.1f msgs/s  link up %5.1f %% down %5.1f %%  cts waits %4u  lost %u  rx timeouts %lu/%u  resets %u  cpu %.0f ms  %s\n",
+        r->name, r->messages, r->us / 1000.0, seconds > 0 ? r->messages / seconds : 0.0,
+        seconds > 0 ? 100.0 * s->uplink_bytes / (bytes_per_s * seconds) : 0.0,
+        seconds > 0 ? 100.0 * s->downlink_bytes / (bytes_per_s * seconds) : 0.0,
+        s->cts_waits, s->uplink_lost, (unsigned long) nRxTimeout, s->downlink_timeouts, s->resets,
+        1000.0 * r->cpu / CLOCKS_PER_SEC, r->ok ? "ok" : "FAILED");
+}
+
+static void scenario_init(result *r)
+{
+    r->ok = start() && app.resets >= 1 && nRxTimeout == 0;
+    r->us = SS_emu_time_us(); // from the power up to the reset notification after LonInit
+    r->messages = app.resets;
+}
+
+// a burst of NV updates from the network
+static void scenario_uplink(result *r)
+{
+    unsigned injected = 0;
+    uint64_t begin, limit;
+
+    if (!start())
+        return;
+    begin = SS_emu_time_us();
+    limit = deadline(5000 + count * 50);
+    while (app.nv_updates < count && SS_emu_time_us() < limit) {
+        while (injected < count && inject(injected))
+            injected++;
+        service();
+    }
+    r->us = SS_emu_time_us() - begin;
+    r->messages = app.nv_updates;
+    r->ok = app.nv_updates == count && app.bad_data == 0 && SS_emu_get_stats()->uplink_lost == 0 && nRxTimeout == 0;
+}
+
+// NV updates to the network, as fast as the driver takes them
+static void scenario_propagate(result *r)
+{
+    unsigned sent = 0, in_use = 0;
+    uint64_t begin, limit;
+
+    if (!start())
+        return;
+    begin = SS_emu_time_us();
+    limit = deadline(5000 + count * 50);
+    while (!(sent == count && propagated(app.nv_completed, count, 0)) && SS_emu_time_us() < limit) {
+        while (sent < count && propagate(sent))
+            sent++;
+        if (tx_buffers() > in_use)
+            in_use = tx_buffers();
+        service();
+    }
+    r->us = SS_emu_time_us() - begin;
+    r->messages = app.nv_completed;
+    r->ok = sent == count && propagated(app.nv_completed, count, 0) && app.nv_failed == 0
+        && SS_emu_get_stats()->nv_updates == app.nv_completed && nRxTimeout == 0;
+    // the propagates merge into the queued updates: one buffer per output, the others stay free
+    if (LON_NV_COALESCE && in_use > 2)
+        r->ok = 0;
+}
+
+// explicit requests, every fourth one priority, answered by the other device
+static void scenario_request(result *r)
+{
+    unsigned sent = 0;
+    uint64_t begin, limit;
+
+    if (!start())
+        return;
+    begin = SS_emu_time_us();
+    limit = deadline(5000 + count * 50);
+    while ((sent < count || !idle()) && SS_emu_time_us() < limit) {
+        while (sent < count && request(sent))
+            sent++;
+        service();
+    }
+    r->us = SS_emu_time_us() - begin;
+    r->messages = SS_emu_get_stats()->messages;
+    r->ok = r->messages == count && idle() && nRxTimeout == 0;
+}
+
+// pipelined LonSendRequest transactions on two tags, every tenth one with a timeout of half the
+// network time: it times out, and the transactions after it still get their own responses
+static void scenario_pending(result *r)
+{
+    transaction *t = calloc(count, sizeof(transaction));
+    unsigned sent = 0, expired = 0, timeout = config.network_us / 2000;
+    uint64_t begin, limit;
+
+    if (t == NULL || !start()) {
+        free(t);
+        return;
+    }
+    begin = SS_emu_time_us();
+    limit = deadline(5000 + count * 50);
+    while ((sent < count || !idle()) && SS_emu_time_us() < limit) {
+        while (sent < count) {
+            LonByte data[8];
+            unsigned ms = (sent % 10 == 9) ? timeout : 0;
+
+            t[sent].number = sent;
+            memset(data, (uint8_t) sent, sizeof(data));
+            if (LonSendRequest(1 + sent % 2, FALSE, FALSE, NULL, 0x10, data, sizeof(data),
+                    request_event, &t[sent], ms, NULL) != LonApiNoError)
+                break;
+            expired += ms != 0;
+            sent++;
+        }
+        service();
+    }
+    r->us = SS_emu_time_us() - begin;
+    r->messages = app.req_completed + app.req_timed_out;
+    r->ok = app.req_completed == count - expired && app.req_timed_out == expired && app.req_failed == 0
+        && app.bad_data == 0 && idle() && nRxTimeout == 0;
+    free(t);
+}
+
+// uplink burst and propagates at the same time
+static void scenario_mixed(result *r)
+{
+    unsigned injected = 0, sent = 0;
+    uint64_t begin, limit;
+
+    if (!start())
+        return;
+    begin = SS_emu_time_us();
+    limit = deadline(5000 + count * 100);
+    while ((app.nv_updates < count || !(sent == count && propagated(app.nv_completed, count, 0)))
+            && SS_emu_time_us() < limit) {
+        while (injected < count && inject(injected))
+            injected++;
+        while (sent < count && propagate(sent))
+            sent++;
+        service();
+    }
+    r->us = SS_emu_time_us() - begin;
+    r->messages = app.nv_updates + app.nv_completed;
+    r->ok = app.nv_updates == count && sent == count && propagated(app.nv_completed, count, 0) && app.bad_data == 0
+        && nRxTimeout == 0;
+}
+
+// the Micro Server resets in the middle of the propagates: the driver gets back in sync,
+// and the propagates after the reset notification all complete
+static void scenario_recover(result *r)
+{
+    unsigned sent = 0, resets, after = 0, updates;
+    uint8_t reset = 0;
+    uint64_t begin, limit;
+
+    if (!start())
+        return;
+    begin = SS_emu_time_us();
+    limit = deadline(10000 + count * 100);
+    resets = app.resets;
+    while (!reset && SS_emu_time_us() < limit) {
+        while (sent < count / 2 && propagate(sent))
+            sent++;
+        service();
+        // the coalesced propagates may complete with a few events
+        if (app.nv_completed >= count / 4 || (LON_NV_COALESCE && app.nv_completed > 0)) {
+            SS_emu_reset();
+            reset = 1;
+        }
+    }
+    while (app.resets == resets && SS_emu_time_us() < limit)
+        service();
+    while (!idle() && SS_emu_time_us() < limit)
+        service();
+    // the rest after the reset
+    after = app.nv_completed;
+    updates = SS_emu_get_stats()->nv_updates;
+    while (!(sent == count && propagated(app.nv_completed - after, count - count / 2, updates))
+            && SS_emu_time_us() < limit) {
+        while (sent < count && propagate(sent))
+            sent++;
+        service();
+    }
+    r->us = SS_emu_time_us() - begin;
+    r->messages = app.nv_completed;
+    r->ok = app.resets > resets && sent == count && propagated(app.nv_completed - after, count - count / 2, updates)
+        && app.nv_failed == 0;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(result *r);
+} scenarios[] = {
+    { "init", scenario_init },
+    { "uplink", scenario_uplink },
+    { "propagate", scenario_propagate },
+    { "request", scenario_request },
+    { "pending", scenario_pending },
+    { "mixed", scenario_mixed },
+    { "recover", scenario_recover },
+};
+
+static void usage(void)
+{
+    SS_emu_config d;
+
+    SS_emu_defaults(&d);
+    fprintf(stderr,
+        "ss_emu [-s scenario] [-n messages] [-m max messages per LonEventHandlerEx] [-b bps] [-l latency us]\n"
+        "       [-p process us] [-w network us] [-g uplink gap us] [-r reset ms] [-t rx timeout ms] [-B buffers]\n"
+        "defaults: -n %u -m %u -b %lu -l %lu -p %lu -w %lu -g %lu -r %u -t %u -B %u, all scenarios:",
+        count, max_msgs, (unsigned long) d.bps, (unsigned long) d.latency_us, (unsigned long) d.process_us,
+        (unsigned long) d.network_us, (unsigned long) d.gap_us, d.reset_ms, d.rx_timeout_ms, d.buffers);
+    for (unsigned i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        fprintf(stderr, " %s", scenarios[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *only = NULL;
+    int failed = 0, opt;
+
+    SS_emu_defaults(&config);
+    while ((opt = getopt(argc, argv, "s:n:m:b:l:p:w:g:r:t:B:h")) != -1) {
+        switch (opt) {
+        case 's': only = optarg; break;
+        case 'n': count = strtoul(optarg, NULL, 0); break;
+        case 'm': max_msgs = strtoul(optarg, NULL, 0); break;
+        case 'b': config.bps = strtoul(optarg, NULL, 0); break;
+        case 'l': config.latency_us = strtoul(optarg, NULL, 0); break;
+        case 'p': config.process_us = strtoul(optarg, NULL, 0); break;
+        case 'w': config.network_us = strtoul(optarg, NULL, 0); break;
+        case 'g': config.gap_us = strtoul(optarg, NULL, 0); break;
+        case 'r': config.reset_ms = strtoul(optarg, NULL, 0); break;
+        case 't': config.rx_timeout_ms = strtoul(optarg, NULL, 0); break;
+        case 'B': config.buffers = strtoul(optarg, NULL, 0); break;
+        default: usage();
+        }
+    }
+    if (count < 2)
+        count = 2;
+
+    for (unsigned i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        result r = { scenarios[i].name, 0, 0, 0, 0 };
+        clock_t cpu = clock();
+
+        if (only && strcmp(only, r.name))
+            continue;
+        scenarios[i].run(&r);
+        r.cpu = clock() - cpu;
+        report(&r);
+        failed += !r.ok;
+    }
+    return failed;
+}
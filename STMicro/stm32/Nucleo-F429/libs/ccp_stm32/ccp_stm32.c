@@ -92,6 +92,11 @@ void stm32_serial_read_bytes(uint8_t *data, uint16_t length) {
 	}
 }
 
+int stm32_serial_busy() {
+
+	return CLICK_UART.gState == HAL_UART_STATE_BUSY_TX;
+}
+
 int stm32_serial_has_bytes() {
 
 	if (mikrobus_rx_buff_head != mikrobus_rx_buff_tail) {
@@ -112,6 +117,7 @@ CCP_Comm_HAL *create_stm32_serial_comm(CCP_Comm_HAL *comm) {
   comm->send_bytes = stm32_serial_send_bytes;
   comm->read_bytes = stm32_serial_read_bytes;
   comm->has_bytes = stm32_serial_has_bytes;
+  comm->busy = stm32_serial_busy;
 
   return(comm);
 }
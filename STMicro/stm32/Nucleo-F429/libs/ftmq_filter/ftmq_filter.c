@@ -0,0 +1,258 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#include "ftmq_filter.h"
+#include "ccp.h"
+
+#include "string.h"
+
+// ---------------- CONSTANTS --------------------------------
+#define FTMQ_TOPIC_LEVEL_SEPARATOR '/'
+#define FTMQ_WILDCARD_LEVEL '+'
+#define FTMQ_WILDCARD_REST '#'
+
+// -------------- CUSTOM TYPES ---------------------------------
+
+typedef struct FTMQ_filter {
+    uint8_t active;
+    uint8_t wildcard;
+    uint16_t topic_id; // exact topics only, wildcard filters learn the ids from the register frames
+    char pattern[FTMQ_MAX_PACKET_LEN];
+} FTMQ_filter;
+
+typedef struct FTMQ_filter_learned_id {
+    uint16_t topic_id;
+    uint16_t mask;
+} FTMQ_filter_learned_id;
+
+typedef struct FTMQ_filter_fragment {
+    uint16_t source_id;
+    uint8_t msg_id;
+    uint16_t mask; // 0 means the slot is free
+} FTMQ_filter_fragment;
+
+// ------------ PRIVATE FUNCTION PROTOTYPES ---------------------------------
+uint16_t match_topic(const uint8_t *topic, int length);
+uint16_t match_topic_id(uint16_t topic_id);
+uint16_t match_fragment(const uint8_t *frame, int length);
+void learn_topic_id(const uint8_t *frame, int length);
+
+// ------------- LIBRARY GLOBAL VARIABLES ----------------------------
+uint16_t active_FTMQ_filters = 0; // mask
+FTMQ_filter FTMQ_filters[FTMQ_MAX_FILTERS];
+FTMQ_filter_learned_id FTMQ_learned_ids[FTMQ_FILTER_LEARNED_IDS];
+uint8_t FTMQ_next_learned_id = 0;
+FTMQ_filter_fragment FTMQ_filter_fragments[FTMQ_FILTER_FRAGMENT_SLOTS];
+uint8_t FTMQ_next_filter_fragment = 0;
+
+// ------------ PUBLIC FUNCTIONS -------------------------------------
+
+void FTMQ_filter_init() {
+    active_FTMQ_filters = 0;
+    memset(FTMQ_learned_ids, 0, sizeof(FTMQ_learned_ids));
+    memset(FTMQ_filter_fragments, 0, sizeof(FTMQ_filter_fragments));
+}
+
+uint8_t FTMQ_filter_command(const uint8_t *data, int length) {
+    if (length < 1)
+        return 0;
+    if (data[0] == CCP_COMMAND_FTMQ_CLEAR_FILTERS) {
+        FTMQ_filter_init();
+        return 1;
+    }
+    if (data[0] != CCP_COMMAND_FTMQ_SUBSCRIBE)
+        return 0;
+    if (length < 3 || data[1] >= FTMQ_MAX_FILTERS || length - 2 >= FTMQ_MAX_PACKET_LEN)
+        return 1; // bad subscription, ignored
+    FTMQ_filter *filter = &FTMQ_filters[data[1]];
+    memcpy(filter->pattern, data + 2, length - 2);
+    filter->pattern[length - 2] = 0;
+    filter->wildcard = strchr(filter->pattern, FTMQ_WILDCARD_LEVEL) != 0 || strchr(filter->pattern, FTMQ_WILDCARD_REST) != 0;
+    filter->topic_id = FTMQ_topic_id(filter->pattern);
+    active_FTMQ_filters |= 1U << data[1];
+    return 1;
+}
+
+uint8_t FTMQ_filter_match(const uint8_t *frame, int length, uint16_t *mask) {
+    *mask = 0;
+    if (active_FTMQ_filters == 0 || length <= 0)
+        return FTMQ_FILTER_PASS;
+    switch (frame[0]) {
+        case FTMQ_FRAME_REGISTER:
+            learn_topic_id(frame, length);
+            return FTMQ_FILTER_PASS; // the host needs them to find topic id conflicts
+        case FTMQ_FRAME_REGISTER_REQUEST:
+            return FTMQ_FILTER_PASS;
+        case FTMQ_FRAME_TOPIC_ID:
+            if (length >= FTMQ_TOPIC_ID_HEADER_LEN)
+                *mask = match_topic_id(frame[1] | ((uint16_t)(frame[2]) << 8));
+            break;
+        case FTMQ_FRAME_FRAGMENT:
+            *mask = match_fragment(frame, length);
+            break;
+        case FTMQ_FRAME_FILTERED:
+            return FTMQ_FILTER_DROP; // never sent over the network
+        default:
+            if (frame[0] < ' ')
+                return FTMQ_FILTER_PASS; // unknown extended frame, let the host decide
+            *mask = match_topic(frame, length);
+            break;
+    }
+    return *mask ? FTMQ_FILTER_MATCH : FTMQ_FILTER_DROP;
+}
+
+uint8_t FTMQ_filter_forward(uint8_t commid, const uint8_t *frame, int length) {
+    uint16_t mask;
+    uint8_t header[FTMQ_FILTERED_HEADER_LEN];
+    switch (FTMQ_filter_match(frame, length, &mask)) {
+        case FTMQ_FILTER_PASS:
+            if (CCP_sendPacket(commid, CCP_FTMQ_QUEUE, (uint8_t *)frame, length) != 0)
+                return FTMQ_ERR_BUSY;
+            break;
+        case FTMQ_FILTER_MATCH:
+            header[0] = FTMQ_FRAME_FILTERED;
+            header[1] = (uint8_t)(mask & 0x00ff);
+            header[2] = (uint8_t)((mask & 0xff00) >> 8);
+            if (CCP_beginPacket(commid, CCP_FTMQ_QUEUE, FTMQ_FILTERED_HEADER_LEN + length) != 0)
+                return FTMQ_ERR_BUSY;
+            CCP_writePacket(commid, header, FTMQ_FILTERED_HEADER_LEN);
+            CCP_writePacket(commid, frame, length);
+            if (CCP_endPacket(commid) != 0)
+                return FTMQ_ERR_BUSY;
+            break;
+        default:
+            break;
+    }
+    return FTMQ_OK;
+}
+
+uint8_t FTMQ_filter_topic_match(const char *pattern, const uint8_t *topic, uint8_t topic_length) {
+    uint8_t t = 0;
+    while (*pattern) {
+        if (*pattern == FTMQ_WILDCARD_REST)
+            return 1;
+        if (*pattern == FTMQ_WILDCARD_LEVEL) {
+            while (t < topic_length && topic[t] != FTMQ_TOPIC_LEVEL_SEPARATOR)
+                t++;
+            pattern++;
+        } else if (t < topic_length && topic[t] == *pattern) {
+            t++;
+            pattern++;
+        } else {
+            // "a/#" also matches "a"
+            return t == topic_length && pattern[0] == FTMQ_TOPIC_LEVEL_SEPARATOR && pattern[1] == FTMQ_WILDCARD_REST && pattern[2] == 0;
+        }
+    }
+    return t == topic_length;
+}
+
+// ------------ PRIVATE FUNCTIONS -------------------------------------
+
+// topic\0payload
+uint16_t match_topic(const uint8_t *topic, int length) {
+    const uint8_t *separator = memchr(topic, 0, length);
+    if (separator == 0)
+        return 0;
+    uint16_t mask = 0;
+    for (uint8_t i = 0; i < FTMQ_MAX_FILTERS; i++) {
+        if ((active_FTMQ_filters & (1U << i)) && FTMQ_filter_topic_match(FTMQ_filters[i].pattern, topic, separator - topic))
+            mask |= 1U << i;
+    }
+    return mask;
+}
+
+uint16_t match_topic_id(uint16_t topic_id) {
+    uint16_t mask = 0;
+    for (uint8_t i = 0; i < FTMQ_MAX_FILTERS; i++) {
+        if ((active_FTMQ_filters & (1U << i)) && !FTMQ_filters[i].wildcard && FTMQ_filters[i].topic_id == topic_id)
+            mask |= 1U << i;
+    }
+    for (uint8_t i = 0; i < FTMQ_FILTER_LEARNED_IDS; i++) {
+        if (FTMQ_learned_ids[i].mask != 0 && FTMQ_learned_ids[i].topic_id == topic_id)
+            mask |= FTMQ_learned_ids[i].mask & active_FTMQ_filters;
+    }
+    return mask;
+}
+
+// the topic is in the first fragment, the others get the mask it had
+uint16_t match_fragment(const uint8_t *frame, int length) {
+    if (length <= FTMQ_FRAGMENT_HEADER_LEN)
+        return 0;
+    uint16_t source_id = frame[1] | ((uint16_t)(frame[2]) << 8);
+    uint8_t msg_id = frame[3];
+    FTMQ_filter_fragment *slot = 0;
+    for (uint8_t i = 0; i < FTMQ_FILTER_FRAGMENT_SLOTS; i++) {
+        if (FTMQ_filter_fragments[i].mask != 0 && FTMQ_filter_fragments[i].source_id == source_id)
+            slot = &FTMQ_filter_fragments[i];
+    }
+    if (frame[4] != 0) // index
+        return (slot != 0 && slot->msg_id == msg_id) ? slot->mask : 0;
+    uint16_t mask = match_topic(frame + FTMQ_FRAGMENT_HEADER_LEN, length - FTMQ_FRAGMENT_HEADER_LEN);
+    if (slot == 0) {
+        slot = &FTMQ_filter_fragments[FTMQ_next_filter_fragment];
+        FTMQ_next_filter_fragment = (FTMQ_next_filter_fragment + 1) % FTMQ_FILTER_FRAGMENT_SLOTS;
+    }
+    slot->source_id = source_id;
+    slot->msg_id = msg_id;
+    slot->mask = mask;
+    return mask;
+}
+
+// | FTMQ_FRAME_REGISTER | topic id | topic |
+void learn_topic_id(const uint8_t *frame, int length) {
+    if (length <= FTMQ_TOPIC_ID_HEADER_LEN)
+        return;
+    uint16_t topic_id = frame[1] | ((uint16_t)(frame[2]) << 8);
+    uint16_t mask = 0;
+    for (uint8_t i = 0; i < FTMQ_MAX_FILTERS; i++) {
+        if ((active_FTMQ_filters & (1U << i)) && FTMQ_filters[i].wildcard &&
+            FTMQ_filter_topic_match(FTMQ_filters[i].pattern, frame + FTMQ_TOPIC_ID_HEADER_LEN, length - FTMQ_TOPIC_ID_HEADER_LEN))
+            mask |= 1U << i;
+    }
+    if (mask == 0)
+        return;
+    for (uint8_t i = 0; i < FTMQ_FILTER_LEARNED_IDS; i++) {
+        if (FTMQ_learned_ids[i].topic_id == topic_id) {
+            FTMQ_learned_ids[i].mask = mask;
+            return;
+        }
+    }
+    FTMQ_learned_ids[FTMQ_next_learned_id].topic_id = topic_id;
+    FTMQ_learned_ids[FTMQ_next_learned_id].mask = mask;
+    FTMQ_next_learned_id = (FTMQ_next_learned_id + 1) % FTMQ_FILTER_LEARNED_IDS;
+}
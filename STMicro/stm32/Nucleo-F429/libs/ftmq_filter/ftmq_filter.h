@@ -0,0 +1,61 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#ifndef FTMQ_FILTER_H
+#define FTMQ_FILTER_H
+#include "stdint.h"
+#include "ftmq.h"
+
+// FT Click side of the offloaded subscriptions: the host sends its topics on CCP_COMMAND_QUEUE
+// (CCP_COMMAND_FTMQ_SUBSCRIBE / CCP_COMMAND_FTMQ_CLEAR_FILTERS) and only the matching FTMQ frames
+// are forwarded to it, inside a FTMQ_FRAME_FILTERED frame. Without filters everything is forwarded as before.
+
+#define FTMQ_FILTER_LEARNED_IDS 8       // topic ids learned for the wildcard filters
+#define FTMQ_FILTER_FRAGMENT_SLOTS 2    // fragmented messages followed at the same time
+
+// FTMQ_filter_match results
+#define FTMQ_FILTER_DROP  0 // nobody subscribed on the host
+#define FTMQ_FILTER_PASS  1 // forward the frame as is (control frames, or no filters)
+#define FTMQ_FILTER_MATCH 2 // forward the frame inside a FTMQ_FRAME_FILTERED frame with the mask
+
+void FTMQ_filter_init(void);
+uint8_t FTMQ_filter_command(const uint8_t *data, int length); // CCP_COMMAND_QUEUE payload from the host, 1 if it was a filter command
+uint8_t FTMQ_filter_match(const uint8_t *frame, int length, uint16_t *mask);
+uint8_t FTMQ_filter_forward(uint8_t commid, const uint8_t *frame, int length); // for every FTMQ frame received from the FT network
+uint8_t FTMQ_filter_topic_match(const char *pattern, const uint8_t *topic, uint8_t topic_length); // + matches a level, # the rest
+#endif
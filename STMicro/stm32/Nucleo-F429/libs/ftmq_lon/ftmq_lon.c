@@ -0,0 +1,459 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#include "ftmq_lon.h"
+#include "ftmq_codec.h"
+#include "ftmq_filter.h"
+#include "ccp.h"
+#include "ShortStackDev.h"
+#include "ShortStackApi.h"
+
+#include "string.h"
+
+// ---------------- CONSTANTS --------------------------------
+#define FTMQ_LON_NO_BINDING 0xFF
+#define FTMQ_LON_PAYLOAD_LEN 6 // marker, key, float
+#define FTMQ_LON_NO_GROUP 0xFF
+#define FTMQ_LON_SELECTORS 0x3000 // bound selectors, 0x3000..0x3FFF are the unbound ones
+#define FTMQ_LON_NO_ADDRESS 0x0F // NV config address index of the NVs without address
+#if LON_APPLICATION_MESSAGES && LON_NM_UPDATE_FUNCTIONS
+#define FTMQ_LON_GROUPS
+#endif
+
+// ---------------- CUSTOM TYPES --------------------------------
+typedef struct FTMQ_lon_group_id {
+    uint16_t topic_id;
+    uint8_t group; // FTMQ_LON_NO_GROUP when free
+} FTMQ_lon_group_id;
+
+// ------------ PRIVATE FUNCTION PROTOTYPES ---------------------------------
+uint8_t find_topic_binding(const uint8_t *topic, uint8_t topic_length);
+uint8_t find_id_binding(uint16_t topic_id);
+uint8_t write_nv(const FTMQ_lon_binding *binding, const uint8_t *payload, uint16_t length);
+uint8_t read_nv(const FTMQ_lon_binding *binding, float *value);
+void put_uint16(volatile uint8_t *data, uint16_t value);
+uint16_t get_uint16(const volatile uint8_t *data);
+#ifdef FTMQ_LON_GROUPS
+uint8_t find_group(const uint8_t *topic, uint8_t topic_length);
+uint8_t filters_overlap(const uint8_t *a, uint8_t a_length, const uint8_t *b, uint8_t b_length);
+void learn_group_id(const uint8_t *frame, int length);
+void join_groups(uint16_t wanted);
+void write_aliases(const FTMQ_lon_group *group, uint8_t index);
+#endif
+
+// ------------- LIBRARY GLOBAL VARIABLES ----------------------------
+uint8_t FTMQ_lon_commid = 0;
+const FTMQ_lon_binding *FTMQ_lon_bindings = 0;
+uint8_t FTMQ_lon_count = 0;
+uint16_t FTMQ_lon_ids[FTMQ_LON_MAX_BINDINGS]; // topic ids of the bindings, for the topic id frames
+#ifdef FTMQ_LON_GROUPS
+const FTMQ_lon_group *FTMQ_lon_group_table = 0;
+uint8_t FTMQ_lon_group_count = 0;
+uint16_t FTMQ_lon_joined = 0; // mask of the groups in the address table
+uint16_t FTMQ_lon_pinned = 0; // groups of the input NVs, always joined
+uint8_t FTMQ_lon_filtered = 0; // the host sent its subscriptions, only their groups are joined
+FTMQ_lon_group_id FTMQ_lon_group_ids[FTMQ_LON_GROUP_IDS];
+uint8_t next_FTMQ_lon_group_id = 0;
+#endif
+
+// ------------ PUBLIC FUNCTIONS -------------------------------------
+
+void FTMQ_lon_init(uint8_t commid, const FTMQ_lon_binding *bindings, uint8_t count) {
+    if (count > FTMQ_LON_MAX_BINDINGS)
+        count = FTMQ_LON_MAX_BINDINGS;
+    FTMQ_lon_commid = commid;
+    FTMQ_lon_bindings = bindings;
+    FTMQ_lon_count = count;
+    for (uint8_t i = 0; i < count; i++)
+        FTMQ_lon_ids[i] = FTMQ_topic_id(bindings[i].topic);
+}
+
+// topic string and topic id frames are bound, the others (fragments, control frames) are always broadcast
+uint8_t FTMQ_lon_publish(const uint8_t *frame, int length) {
+    uint8_t index = FTMQ_LON_NO_BINDING;
+    const uint8_t *payload = 0;
+    if (length <= 0)
+        return 0;
+    if (frame[0] == FTMQ_FRAME_TOPIC_ID && length >= FTMQ_TOPIC_ID_HEADER_LEN) {
+        index = find_id_binding(frame[1] | ((uint16_t)(frame[2]) << 8));
+        payload = frame + FTMQ_TOPIC_ID_HEADER_LEN;
+    } else if (frame[0] >= ' ') {
+        const uint8_t *separator = memchr(frame, 0, length);
+        if (separator == 0)
+            return 0;
+        index = find_topic_binding(frame, separator - frame);
+        payload = separator + 1;
+    }
+    if (index == FTMQ_LON_NO_BINDING)
+        return 0;
+    const FTMQ_lon_binding *binding = &FTMQ_lon_bindings[index];
+    if (!write_nv(binding, payload, length - (payload - frame)))
+        return 0; // not a value of the NV type, broadcast it
+    return LON_SUCCESS(LonPropagateNv(binding->nv_index));
+}
+
+void FTMQ_lon_nv_updated(unsigned nv_index) {
+    for (uint8_t i = 0; i < FTMQ_lon_count; i++) {
+        const FTMQ_lon_binding *binding = &FTMQ_lon_bindings[i];
+        if (binding->nv_index != nv_index)
+            continue;
+        uint8_t topic_length = strlen(binding->topic);
+        uint8_t payload[FTMQ_LON_PAYLOAD_LEN];
+        uint8_t frame[FTMQ_MAX_PACKET_LEN];
+        uint16_t payload_length;
+        if (binding->type == FTMQ_NV_RAW) {
+            payload_length = LonGetCurrentNvSize(nv_index);
+        } else {
+            FTMQ_codec codec;
+            float value;
+            if (!read_nv(binding, &value))
+                return;
+            FTMQ_codec_begin(&codec, payload, FTMQ_LON_PAYLOAD_LEN);
+            FTMQ_codec_put_float(&codec, binding->tag, value);
+            payload_length = FTMQ_codec_length(&codec);
+        }
+        if (topic_length + 1 + payload_length > FTMQ_MAX_PACKET_LEN)
+            return;
+        memcpy(frame, binding->topic, topic_length + 1); // with the separator
+        if (binding->type == FTMQ_NV_RAW)
+            memcpy(frame + topic_length + 1, (const uint8_t *)LonGetNvValue(nv_index), payload_length);
+        else
+            memcpy(frame + topic_length + 1, payload, payload_length);
+        // like the frames from the network: filtered for a host that keeps its subscriptions here
+        FTMQ_filter_forward(FTMQ_lon_commid, frame, topic_length + 1 + payload_length);
+        return;
+    }
+}
+
+void FTMQ_lon_groups(const FTMQ_lon_group *groups, uint8_t count) {
+#ifdef FTMQ_LON_GROUPS
+    if (count > FTMQ_LON_MAX_GROUPS)
+        count = FTMQ_LON_MAX_GROUPS;
+    FTMQ_lon_group_table = groups;
+    FTMQ_lon_group_count = count;
+    FTMQ_lon_pinned = 0;
+    FTMQ_lon_filtered = 0;
+    for (uint8_t i = 0; i < FTMQ_LON_GROUP_IDS; i++)
+        FTMQ_lon_group_ids[i].group = FTMQ_LON_NO_GROUP;
+    for (uint8_t i = 0; i < FTMQ_lon_count; i++) {
+        const FTMQ_lon_binding *binding = &FTMQ_lon_bindings[i];
+        uint8_t group = find_group((const uint8_t *)binding->topic, strlen(binding->topic));
+        if (group != FTMQ_LON_NO_GROUP && binding->direction == FTMQ_NV_INPUT)
+            FTMQ_lon_pinned |= 1U << group;
+    }
+    for (uint8_t i = 0; i < count; i++)
+        write_aliases(&groups[i], i);
+    FTMQ_lon_joined = 0;
+    join_groups((1U << count) - 1); // until the host subscribes, like ftmq_filter
+#endif
+}
+
+// topic string and topic id frames go to their group, the others (registers, fragments, control frames) are always broadcast
+uint8_t FTMQ_lon_send(const uint8_t *frame, int length) {
+#ifdef FTMQ_LON_GROUPS
+    uint8_t group = FTMQ_LON_NO_GROUP;
+    if (length <= 0 || FTMQ_lon_group_count == 0)
+        return 0;
+    if (frame[0] == FTMQ_FRAME_REGISTER) {
+        learn_group_id(frame, length);
+        return 0;
+    }
+    if (frame[0] == FTMQ_FRAME_TOPIC_ID && length >= FTMQ_TOPIC_ID_HEADER_LEN) {
+        uint16_t topic_id = frame[1] | ((uint16_t)(frame[2]) << 8);
+        for (uint8_t i = 0; i < FTMQ_LON_GROUP_IDS; i++) {
+            if (FTMQ_lon_group_ids[i].group != FTMQ_LON_NO_GROUP && FTMQ_lon_group_ids[i].topic_id == topic_id)
+                group = FTMQ_lon_group_ids[i].group;
+        }
+    } else if (frame[0] >= ' ') {
+        const uint8_t *separator = memchr(frame, 0, length);
+        if (separator != 0)
+            group = find_group(frame, separator - frame);
+    }
+    if (group == FTMQ_LON_NO_GROUP)
+        return 0;
+    LonSendAddress address;
+    memset(&address, 0, sizeof(address));
+    address.Group.TypeSize = LON_SENDGROUP_TYPE_MASK; // open group, size 0
+    address.Group.GroupId = FTMQ_lon_group_table[group].group_id;
+    return LON_SUCCESS(LonSendMsg(FTMQ_LON_MSG_TAG, FALSE, LonServiceUnacknowledged, FALSE, &address,
+                                  FTMQ_LON_MSG_CODE, frame, length));
+#else
+    return 0;
+#endif
+}
+
+// the groups follow the subscriptions of the host, a subscription joins every group its filter can overlap
+void FTMQ_lon_command(const uint8_t *data, int length) {
+#ifdef FTMQ_LON_GROUPS
+    if (length < 1)
+        return;
+    if (data[0] == CCP_COMMAND_FTMQ_CLEAR_FILTERS) {
+        FTMQ_lon_filtered = 0;
+        join_groups((1U << FTMQ_lon_group_count) - 1);
+        return;
+    }
+    if (data[0] != CCP_COMMAND_FTMQ_SUBSCRIBE || length < 3 || length - 2 >= FTMQ_MAX_PACKET_LEN)
+        return;
+    uint16_t wanted = FTMQ_lon_filtered ? FTMQ_lon_joined : FTMQ_lon_pinned;
+    for (uint8_t i = 0; i < FTMQ_lon_group_count; i++) {
+        const char *filter = FTMQ_lon_group_table[i].topic;
+        if (filters_overlap((const uint8_t *)filter, strlen(filter), data + 2, length - 2))
+            wanted |= 1U << i;
+    }
+    FTMQ_lon_filtered = 1;
+    join_groups(wanted);
+#endif
+}
+
+// ------------ PRIVATE FUNCTIONS -------------------------------------
+
+uint8_t find_topic_binding(const uint8_t *topic, uint8_t topic_length) {
+    for (uint8_t i = 0; i < FTMQ_lon_count; i++) {
+        const char *bound = FTMQ_lon_bindings[i].topic;
+        if (strncmp(bound, (const char *)topic, topic_length) == 0 && bound[topic_length] == 0)
+            return i;
+    }
+    return FTMQ_LON_NO_BINDING;
+}
+
+uint8_t find_id_binding(uint16_t topic_id) {
+    for (uint8_t i = 0; i < FTMQ_lon_count; i++) {
+        if (FTMQ_lon_ids[i] == topic_id)
+            return i;
+    }
+    return FTMQ_LON_NO_BINDING;
+}
+
+// the value is the codec field with the binding tag, scaled to the NV type
+uint8_t write_nv(const FTMQ_lon_binding *binding, const uint8_t *payload, uint16_t length) {
+    volatile uint8_t *data = (volatile uint8_t *)LonGetNvValue(binding->nv_index);
+    unsigned size = LonGetDeclaredNvSize(binding->nv_index);
+    FTMQ_codec_field field;
+    if (data == 0)
+        return 0;
+    if (binding->type == FTMQ_NV_RAW) {
+        if (length > size)
+            return 0;
+        for (uint16_t i = 0; i < length; i++)
+            data[i] = payload[i];
+        return 1;
+    }
+    if (!FTMQ_codec_find(payload, length, binding->tag, &field))
+        return 0;
+    float value = FTMQ_codec_get_float(&field);
+    switch (binding->type) {
+        case FTMQ_NV_FLOAT: {
+            uint32_t bits;
+            if (size < 4)
+                return 0;
+            memcpy(&bits, &value, 4);
+            put_uint16(data, (uint16_t)(bits >> 16));
+            put_uint16(data + 2, (uint16_t)bits);
+            return 1;
+        }
+        case FTMQ_NV_TEMP_P:
+            if (size < 2)
+                return 0;
+            put_uint16(data, (uint16_t)(int16_t)(value * 100.0f));
+            return 1;
+        case FTMQ_NV_LEV_PERCENT:
+            if (size < 2)
+                return 0;
+            put_uint16(data, (uint16_t)(int16_t)(value * 200.0f));
+            return 1;
+        case FTMQ_NV_SWITCH:
+            if (size < 2)
+                return 0;
+            if (value < 0.0f)
+                value = 0.0f;
+            if (value > 100.0f)
+                value = 100.0f;
+            data[0] = (uint8_t)(value * 2.0f);
+            data[1] = value > 0.0f ? 1 : 0;
+            return 1;
+        case FTMQ_NV_COUNT:
+            if (size < 2 || value < 0.0f)
+                return 0;
+            put_uint16(data, (uint16_t)value);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+uint8_t read_nv(const FTMQ_lon_binding *binding, float *value) {
+    const volatile uint8_t *data = (const volatile uint8_t *)LonGetNvValue(binding->nv_index);
+    if (data == 0)
+        return 0;
+    switch (binding->type) {
+        case FTMQ_NV_FLOAT: {
+            uint32_t bits = ((uint32_t)get_uint16(data) << 16) | get_uint16(data + 2);
+            memcpy(value, &bits, 4);
+            return 1;
+        }
+        case FTMQ_NV_TEMP_P:
+            *value = (int16_t)get_uint16(data) / 100.0f;
+            return 1;
+        case FTMQ_NV_LEV_PERCENT:
+            *value = (int16_t)get_uint16(data) / 200.0f;
+            return 1;
+        case FTMQ_NV_SWITCH:
+            *value = data[1] ? data[0] / 2.0f : 0.0f;
+            return 1;
+        case FTMQ_NV_COUNT:
+            *value = get_uint16(data);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// LON data is big endian
+void put_uint16(volatile uint8_t *data, uint16_t value) {
+    data[0] = (uint8_t)(value >> 8);
+    data[1] = (uint8_t)(value & 0x00ff);
+}
+
+uint16_t get_uint16(const volatile uint8_t *data) {
+    return ((uint16_t)data[0] << 8) | data[1];
+}
+
+#ifdef FTMQ_LON_GROUPS
+uint8_t find_group(const uint8_t *topic, uint8_t topic_length) {
+    for (uint8_t i = 0; i < FTMQ_lon_group_count; i++) {
+        const char *filter = FTMQ_lon_group_table[i].topic;
+        if (filters_overlap((const uint8_t *)filter, strlen(filter), topic, topic_length))
+            return i;
+    }
+    return FTMQ_LON_NO_GROUP;
+}
+
+// level by level, + matches any level and # the rest. A topic without wildcards is a filter too
+uint8_t filters_overlap(const uint8_t *a, uint8_t a_length, const uint8_t *b, uint8_t b_length) {
+    uint8_t i = 0, j = 0;
+    while (1) {
+        uint8_t a_end = i, b_end = j;
+        while (a_end < a_length && a[a_end] != '/')
+            a_end++;
+        while (b_end < b_length && b[b_end] != '/')
+            b_end++;
+        uint8_t a_rest = a_end - i == 1 && a[i] == '#';
+        uint8_t b_rest = b_end - j == 1 && b[j] == '#';
+        if (a_rest || b_rest)
+            return 1;
+        uint8_t a_level = a_end - i == 1 && a[i] == '+';
+        uint8_t b_level = b_end - j == 1 && b[j] == '+';
+        if (!a_level && !b_level && (a_end - i != b_end - j || memcmp(a + i, b + j, a_end - i) != 0))
+            return 0;
+        if (a_end >= a_length || b_end >= b_length) {
+            // sport/# matches sport too
+            if (a_end >= a_length && b_end >= b_length)
+                return 1;
+            if (a_end >= a_length)
+                return b_length - b_end == 2 && b[b_end + 1] == '#';
+            return a_length - a_end == 2 && a[a_end + 1] == '#';
+        }
+        i = a_end + 1;
+        j = b_end + 1;
+    }
+}
+
+// | FTMQ_FRAME_REGISTER | topic id (2 bytes) | topic |, the oldest learned id is replaced
+void learn_group_id(const uint8_t *frame, int length) {
+    if (length <= FTMQ_TOPIC_ID_HEADER_LEN)
+        return;
+    uint8_t group = find_group(frame + FTMQ_TOPIC_ID_HEADER_LEN, length - FTMQ_TOPIC_ID_HEADER_LEN);
+    if (group == FTMQ_LON_NO_GROUP)
+        return;
+    uint16_t topic_id = frame[1] | ((uint16_t)(frame[2]) << 8);
+    for (uint8_t i = 0; i < FTMQ_LON_GROUP_IDS; i++) {
+        if (FTMQ_lon_group_ids[i].group != FTMQ_LON_NO_GROUP && FTMQ_lon_group_ids[i].topic_id == topic_id)
+            return;
+    }
+    FTMQ_lon_group_ids[next_FTMQ_lon_group_id].topic_id = topic_id;
+    FTMQ_lon_group_ids[next_FTMQ_lon_group_id].group = group;
+    next_FTMQ_lon_group_id = (next_FTMQ_lon_group_id + 1) % FTMQ_LON_GROUP_IDS;
+}
+
+// only the entries that change are written, an unassigned entry leaves the group
+void join_groups(uint16_t wanted) {
+    for (uint8_t i = 0; i < FTMQ_lon_group_count; i++) {
+        uint16_t bit = 1U << i;
+        if ((wanted & bit) == (FTMQ_lon_joined & bit))
+            continue;
+        LonAddress address;
+        memset(&address, 0, sizeof(address));
+        if (wanted & bit) {
+            address.Group.TypeSize = LON_ADDRESS_GROUP_TYPE_MASK; // open group, size 0, member 0
+            address.Group.Group = FTMQ_lon_group_table[i].group_id;
+        }
+        if (LON_SUCCESS(LonUpdateAddressConfig(FTMQ_lon_group_table[i].address_index, &address)))
+            FTMQ_lon_joined ^= bit;
+    }
+}
+
+// the bound NVs of the group get an alias on its address entry, the selector comes from the topic id so
+// the output NV of a node and the input NVs of the others match without a network tool
+void write_aliases(const FTMQ_lon_group *group, uint8_t index) {
+    uint8_t alias_index = group->alias_index;
+    if (alias_index == FTMQ_LON_NO_ALIAS)
+        return;
+    for (uint8_t i = 0; i < FTMQ_lon_count; i++) {
+        const FTMQ_lon_binding *binding = &FTMQ_lon_bindings[i];
+        if (find_group((const uint8_t *)binding->topic, strlen(binding->topic)) != index)
+            continue;
+        uint16_t selector = FTMQ_lon_ids[i] % FTMQ_LON_SELECTORS;
+        LonAliasConfig alias;
+        memset(&alias, 0, sizeof(alias));
+        alias.Alias.SelhiDirPrio = (selector >> 8) & LON_NV_SELHIGH_MASK;
+        if (binding->direction == FTMQ_NV_OUTPUT)
+            alias.Alias.SelhiDirPrio |= LON_NV_OUTPUT_MASK;
+        alias.Alias.SelectorLow = (LonByte)selector;
+        LON_SET_ATTRIBUTE(alias.Alias, LON_NV_SERVICE, LonServiceUnacknowledged);
+        LON_SET_ATTRIBUTE(alias.Alias, LON_NV_ADDRESS,
+                          binding->direction == FTMQ_NV_OUTPUT ? group->address_index : FTMQ_LON_NO_ADDRESS);
+        if (binding->nv_index < 0xFF) {
+            alias.Primary = (LonByte)binding->nv_index;
+        } else {
+            alias.Primary = 0xFF;
+            LON_SET_UNSIGNED_WORD(alias.HostPrimary, binding->nv_index);
+        }
+        LonUpdateAliasConfig(alias_index++, &alias);
+    }
+}
+#endif
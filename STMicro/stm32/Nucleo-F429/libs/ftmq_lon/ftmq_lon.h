@@ -0,0 +1,103 @@
+/****************************************************************************************
+*
+*   Copyright (C) 2020 ConnectEx, Inc.
+*
+*   This program is free software : you can redistribute it and/or modify
+*   it under the terms of the GNU Lesser General Public License as published by
+*   the Free Software Foundation, either version 3 of the License.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+*   GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License
+*   along with this program.If not, see <http://www.gnu.org/licenses/>.
+*
+*   As a special exception, if other files instantiate templates or
+*   use macros or inline functions from this file, or you compile
+*   this file and link it with other works to produce a work based
+*   on this file, this file does not by itself cause the resulting
+*   work to be covered by the GNU General Public License. However
+*   the source code for this file must still be made available in
+*   accordance with section (3) of the GNU General Public License.
+*
+*   This exception does not invalidate any other reasons why a work
+*   based on this file might be covered by the GNU General Public
+*   License.
+*
+*   For more information: info@connect-ex.com
+*
+*   For access to source code :
+*
+*       info@connect-ex.com
+*           or
+*       github.com/ConnectEx/BACnet-Dev-Kit
+*
+****************************************************************************************/
+
+#ifndef FTMQ_LON_H
+#define FTMQ_LON_H
+// default packing, the ShortStack headers (LonPlatform.h) leave pack(1) on
+#pragma pack(push)
+#pragma pack()
+#include "stdint.h"
+#include "ftmq.h"
+
+// FT Click side binding of FTMQ topics to LON network variables (ShortStack API).
+// A publish from the host on a topic bound to an output NV is written into the NV (binary layout of its type)
+// and propagated with LonPropagateNv, with the NV bindings of the LON network instead of a broadcast.
+// An update of a bound input NV (LonNvUpdateOccurred) goes to the host as a regular FTMQ message on the topic,
+// with a ftmq_codec payload. Topics not in the table are broadcast as before.
+// Topic groups send the other FTMQ frames of their topics to a LON group instead of the whole network:
+// the FT Click joins the groups its host subscribed to (address table) and sends the publishes group addressed.
+
+#define FTMQ_LON_MAX_BINDINGS 16
+#define FTMQ_LON_MAX_GROUPS 16 // one bit each in the joined mask
+#define FTMQ_LON_GROUP_IDS 8 // topic ids of the host learned from its register frames
+#define FTMQ_LON_NO_ALIAS 0xFF
+
+#ifndef FTMQ_LON_MSG_CODE
+#define FTMQ_LON_MSG_CODE 0x00 // application message code of the FTMQ packets, the same as the broadcasts
+#endif
+#ifndef FTMQ_LON_MSG_TAG
+#define FTMQ_LON_MSG_TAG 0x0F // non bindable message tag, the destination address is explicit
+#endif
+
+// NV layouts, SNVT style (big endian)
+#define FTMQ_NV_FLOAT       0 // SNVT_xxx_f, IEEE 754 single precision
+#define FTMQ_NV_TEMP_P      1 // SNVT_temp_p, int16 in 0.01 degrees C
+#define FTMQ_NV_LEV_PERCENT 2 // SNVT_lev_percent, int16 in 0.005 %
+#define FTMQ_NV_SWITCH      3 // SNVT_switch, value uint8 in 0.5 % and state int8
+#define FTMQ_NV_COUNT       4 // SNVT_count, uint16
+#define FTMQ_NV_RAW         5 // the payload is copied as is (up to the declared size)
+
+// NV directions
+#define FTMQ_NV_INPUT  0 // updated by the network, goes to the host
+#define FTMQ_NV_OUTPUT 1 // written by the host publishes
+
+typedef struct FTMQ_lon_binding {
+    const char *topic;
+    unsigned nv_index; // from ShortStackDev.h
+    uint8_t type; // FTMQ_NV_xxx
+    uint8_t tag; // ftmq_codec tag of the value in the FTMQ payload
+    uint8_t direction; // FTMQ_NV_INPUT or FTMQ_NV_OUTPUT
+} FTMQ_lon_binding;
+
+typedef struct FTMQ_lon_group {
+    const char *topic; // topic filter, with the ftmq_filter wildcards (sensors/#). A topic goes to the first matching group
+    uint8_t group_id; // LON group, open (no size, no acknowledgement)
+    uint8_t address_index; // address table entry joining the group (0..14)
+    uint8_t alias_index; // first alias entry for the bound NVs of the group, one per NV, or FTMQ_LON_NO_ALIAS
+} FTMQ_lon_group;
+
+// the table must stay valid (const), commid is the host comm
+void FTMQ_lon_init(uint8_t commid, const FTMQ_lon_binding *bindings, uint8_t count);
+uint8_t FTMQ_lon_publish(const uint8_t *frame, int length); // FTMQ frame from the host, 1 if it was propagated on its NV
+void FTMQ_lon_nv_updated(unsigned nv_index); // from LonNvUpdateOccurred
+// after FTMQ_lon_init, the table must stay valid (const). Joins every group and writes the NV aliases
+void FTMQ_lon_groups(const FTMQ_lon_group *groups, uint8_t count);
+uint8_t FTMQ_lon_send(const uint8_t *frame, int length); // FTMQ frame from the host, 1 if it was sent to its group
+void FTMQ_lon_command(const uint8_t *data, int length); // CCP_COMMAND_QUEUE payload from the host, before FTMQ_filter_command
+#pragma pack(pop)
+#endif
@@ -37,25 +37,115 @@
 #***************************************************************************************
 
 
+import time
+import os
+import uuid
+import zlib
+import json
 from ccp import CCP, Comm
+from ftmq_codec import FTMQCodec
 
 class FTMQ:
     FTMQ_SEPARATOR = b'\x00'
     FTMQ_MAX_MSG = 49
+    # messages bigger than FTMQ_MAX_MSG are fragmented
+    FTMQ_MAX_MESSAGE_LEN = 256
+    FTMQ_REASSEMBLY_TIMEOUT = 1.0 # seconds
+
+    # regular frames start with the topic, extended frames with one of these
+    FTMQ_FRAME_FRAGMENT = 0x01
+    FTMQ_FRAME_TOPIC_ID = 0x02
+    FTMQ_FRAME_REGISTER = 0x03
+    FTMQ_FRAME_REGISTER_REQUEST = 0x04
+    FTMQ_FRAME_FILTERED = 0x05
+    FTMQ_FRAME_RETAINED_REQUEST = 0x07
+    FTMQ_FRAME_REQUEST = 0x08
+    FTMQ_FRAME_RESPONSE = 0x09
+
+    # | FTMQ_FRAME_FRAGMENT | source id (2 bytes) | message id | index | count | chunk |
+    FTMQ_FRAGMENT_HEADER_LEN = 6
+    FTMQ_FRAGMENT_CHUNK_LEN = FTMQ_MAX_MSG - FTMQ_FRAGMENT_HEADER_LEN
+
+    # | FTMQ_FRAME_TOPIC_ID | topic id (2 bytes) | payload |, the id is announced with
+    # | FTMQ_FRAME_REGISTER | topic id (2 bytes) | topic | and asked again with
+    # | FTMQ_FRAME_REGISTER_REQUEST | topic id (2 bytes) |
+    FTMQ_TOPIC_ID_HEADER_LEN = 3
+    FTMQ_REGISTER_RETRY = 1.0 # seconds
+
+    # with offload the FTClick filters the messages, they arrive as
+    # | FTMQ_FRAME_FILTERED | mask of the matching subscriptions (2 bytes) | frame |
+    FTMQ_FILTERED_HEADER_LEN = 3
+    FTMQ_MAX_FILTERS = 16
+    CCP_COMMAND_FTMQ_SUBSCRIBE = 10
+    CCP_COMMAND_FTMQ_CLEAR_FILTERS = 11
+
+    # | FTMQ_FRAME_RETAINED_REQUEST | topic (optional) |, the publishers send their last value again
+
+    # | FTMQ_FRAME_REQUEST | source id (2 bytes) | sequence | topic\0payload | is answered with
+    # | FTMQ_FRAME_RESPONSE | source id of the requester (2 bytes) | sequence | payload |
+    FTMQ_RPC_HEADER_LEN = 4
+    FTMQ_MAX_PENDING = 16
+
+    # response status
+    FTMQ_OK = 0
+    FTMQ_ERR_TIMEOUT = 5
     
-    def __init__(self):
+    @staticmethod
+    def default_source_id():
+        '''Different on each host and process: the MAC address and the pid folded to 16 bits'''
+        key = uuid.getnode().to_bytes(6, 'little') + os.getpid().to_bytes(4, 'little')
+        return zlib.crc32(key) & 0xFFFF
+
+    def __init__(self, source_id=None, schema=None, offload=False):
         self.ccp = CCP()
+        self.codec = FTMQCodec(schema)
         self.ccp.register_callback(CCP.CCP_FTMQ_QUEUE, self.message_received)
         self.callbacks = []
+        # identifies this node in fragmented messages and requests
+        self.source_id = source_id if source_id is not None else self.default_source_id()
+        self.next_msg_id = 0
+        self.reassembly = {} # source id -> partial message
+        self.topics = {} # topic id -> published topic
+        self.bindings = {} # topic id -> subscribed topic binding
+        self.offload = offload # subscriptions kept by the FTClick, topics can use + and # wildcards
+        self.delivery_mask = 0
+        self.registered_topics = {} # topic id -> topic, from the register frames
+        self.retained = {} # topic -> last payload published or received
+        self.published = {} # topic -> commid, the topics we answer the retained requests for
+        self.next_sequence = 0
+        self.pending = {} # sequence -> request waiting for its response
+        self.responders = {} # topic -> function returning the response payload
+        self.ccp.register_tick_callback(self.manage_requests)
 
     #This function is called each time a packet is received
     #it checks the topic and call the subscribed functions
     def message_received(self, msg):
         #print("received: ", msg)
+        if len(msg) > 0 and msg[0] == self.FTMQ_FRAME_RETAINED_REQUEST:
+            self.retained_requested(msg)
+            return
+        if len(msg) > 0 and msg[0] == self.FTMQ_FRAME_REQUEST:
+            self.request_received(msg)
+            return
+        if len(msg) > 0 and msg[0] == self.FTMQ_FRAME_RESPONSE:
+            self.response_received(msg)
+            return
+        if self.offload:
+            self.filtered_received(msg)
+            return
+        if len(msg) > 0 and msg[0] in (self.FTMQ_FRAME_TOPIC_ID, self.FTMQ_FRAME_REGISTER, self.FTMQ_FRAME_REGISTER_REQUEST):
+            self.topic_id_received(msg)
+            return
+        if len(msg) > 0 and msg[0] == self.FTMQ_FRAME_FRAGMENT:
+            msg = self.reassemble_fragment(msg)
+            if msg is None:
+                return
         (topic, sep, payload) = msg.partition(self.FTMQ_SEPARATOR)
         try:
             topic_str = topic.decode()
             if (self.check_topic(topic_str) and len(payload) > 0):
+                if any(callback['topic'] == topic_str for callback in self.callbacks):
+                    self.retained[topic_str] = bytes(payload)
                 for callback in self.callbacks:
                     if topic_str == callback['topic']:
                         callback['callback'](topic_str, payload)
@@ -63,17 +153,233 @@ class FTMQ:
             # bad message
             pass 
 
+    def filtered_received(self, msg):
+        '''With offload only the frames wrapped by the FTClick are delivered, to the subscriptions in the mask'''
+        if len(msg) > self.FTMQ_TOPIC_ID_HEADER_LEN and msg[0] == self.FTMQ_FRAME_REGISTER:
+            self.registered_topics[int.from_bytes(msg[1:3], 'little')] = bytes(msg[3:]).decode(errors='replace')
+        if len(msg) > 0 and msg[0] in (self.FTMQ_FRAME_REGISTER, self.FTMQ_FRAME_REGISTER_REQUEST):
+            self.topic_id_received(msg) # we may be the publisher
+            return
+        if len(msg) <= self.FTMQ_FILTERED_HEADER_LEN or msg[0] != self.FTMQ_FRAME_FILTERED:
+            return
+        mask = int.from_bytes(msg[1:3], 'little')
+        frame = msg[self.FTMQ_FILTERED_HEADER_LEN:]
+        if frame[0] == self.FTMQ_FRAME_TOPIC_ID:
+            topic_id = int.from_bytes(frame[1:3], 'little')
+            topic = self.registered_topics.get(topic_id, str(topic_id))
+            payload = frame[self.FTMQ_TOPIC_ID_HEADER_LEN:]
+        else:
+            if frame[0] == self.FTMQ_FRAME_FRAGMENT:
+                frame = self.reassemble_fragment(frame)
+                if frame is None:
+                    return
+            (topic, sep, payload) = frame.partition(self.FTMQ_SEPARATOR)
+            topic = topic.decode(errors='replace')
+        if mask:
+            self.retained[topic] = bytes(payload)
+        for index, callback in enumerate(self.callbacks):
+            if mask & (1 << index):
+                callback['callback'](topic, payload)
+
     def publish(self,commid, topic,payload):
         msg = topic.encode() + self.FTMQ_SEPARATOR + payload
+        self.retained[topic] = bytes(payload)
+        self.published[topic] = commid
         #print(msg, len(msg))
+        if len(msg) > self.FTMQ_MAX_MSG:
+            self.publish_fragments(commid, msg)
+        else:
+            self.ccp.send_data(commid, CCP.CCP_FTMQ_QUEUE, msg)
+
+    def publish_fragments(self, commid, msg):
+        if len(msg) > self.FTMQ_MAX_MESSAGE_LEN:
+            raise ValueError("FTMQ message too long")
+        chunks = [msg[i:i + self.FTMQ_FRAGMENT_CHUNK_LEN] for i in range(0, len(msg), self.FTMQ_FRAGMENT_CHUNK_LEN)]
+        msg_id = self.next_msg_id
+        self.next_msg_id = (self.next_msg_id + 1) & 0xFF
+        for index, chunk in enumerate(chunks):
+            header = bytes([self.FTMQ_FRAME_FRAGMENT]) + self.source_id.to_bytes(2, 'little') + bytes([msg_id, index, len(chunks)])
+            self.ccp.send_data(commid, CCP.CCP_FTMQ_QUEUE, header + chunk)
+
+    def reassemble_fragment(self, frame):
+        '''Returns the complete message when its last fragment arrives, None otherwise'''
+        if len(frame) <= self.FTMQ_FRAGMENT_HEADER_LEN:
+            return None
+        source_id = int.from_bytes(frame[1:3], 'little')
+        (msg_id, index, count) = frame[3:6]
+        now = time.monotonic()
+        slot = self.reassembly.get(source_id)
+        if slot is not None and now - slot['time'] > self.FTMQ_REASSEMBLY_TIMEOUT:
+            slot = None
+        if index == 0:
+            slot = dict(msg_id=msg_id, count=count, data=bytearray())
+            self.reassembly[source_id] = slot
+        elif slot is None or slot['msg_id'] != msg_id:
+            return None
+        if index != len(slot['data']) // self.FTMQ_FRAGMENT_CHUNK_LEN or count != slot['count']:
+            # lost fragment, drop the message
+            self.reassembly.pop(source_id, None)
+            return None
+        slot['data'] += frame[self.FTMQ_FRAGMENT_HEADER_LEN:]
+        slot['time'] = now
+        if index + 1 == count:
+            del self.reassembly[source_id]
+            return bytes(slot['data'])
+        return None
+
+    @staticmethod
+    def topic_id(topic):
+        '''FNV-1a folded to 16 bits, the same as FTMQ_topic_id() in ftmq.c'''
+        h = 2166136261
+        for c in topic.encode():
+            h = ((h ^ c) * 16777619) & 0xFFFFFFFF
+        return (h ^ (h >> 16)) & 0xFFFF
+
+    def send_topic_id_frame(self, commid, frame, topic_id, data):
+        self.ccp.send_data(commid, CCP.CCP_FTMQ_QUEUE, bytes([frame]) + topic_id.to_bytes(2, 'little') + data)
+
+    def register_topic(self, commid, topic):
+        '''Announces topic -> id, returns the id to use with publish_id'''
+        topic_id = self.topic_id(topic)
+        entry = self.topics.setdefault(topic_id, dict(topic=topic, conflict=False))
+        self.send_topic_id_frame(commid, self.FTMQ_FRAME_REGISTER, topic_id, entry['topic'].encode())
+        entry['announced'] = True
+        return topic_id
+
+    def publish_id(self, commid, topic_id, payload):
+        entry = self.topics[topic_id]
+        if entry['conflict'] or self.FTMQ_TOPIC_ID_HEADER_LEN + len(payload) > self.FTMQ_MAX_MSG:
+            self.publish(commid, entry['topic'], payload)
+            return
+        if not entry['announced']:
+            self.register_topic(commid, entry['topic'])
+        self.retained[entry['topic']] = bytes(payload)
+        self.published[entry['topic']] = commid
+        self.send_topic_id_frame(commid, self.FTMQ_FRAME_TOPIC_ID, topic_id, payload)
+
+    def topic_id_received(self, frame):
+        if len(frame) < self.FTMQ_TOPIC_ID_HEADER_LEN:
+            return
+        topic_id = int.from_bytes(frame[1:3], 'little')
+        data = frame[self.FTMQ_TOPIC_ID_HEADER_LEN:]
+        binding = self.bindings.get(topic_id)
+        if frame[0] == self.FTMQ_FRAME_TOPIC_ID:
+            if binding is None:
+                return
+            if binding['state'] == 'bound':
+                self.retained[binding['topic']] = bytes(data)
+                for callback in self.callbacks:
+                    if callback['topic'] == binding['topic']:
+                        callback['callback'](binding['topic'], data)
+            elif binding['state'] == 'unbound' and time.monotonic() >= binding['retry']:
+                # we missed the announcement, ask the publisher to repeat it
+                self.send_topic_id_frame(binding['commid'], self.FTMQ_FRAME_REGISTER_REQUEST, topic_id, b'')
+                binding['retry'] = time.monotonic() + self.FTMQ_REGISTER_RETRY
+        elif frame[0] == self.FTMQ_FRAME_REGISTER:
+            entry = self.topics.get(topic_id)
+            if entry is not None and entry['topic'].encode() != data:
+                entry['conflict'] = True
+            if binding is not None and binding['state'] != 'conflict':
+                binding['state'] = 'bound' if binding['topic'].encode() == data else 'conflict'
+        elif frame[0] == self.FTMQ_FRAME_REGISTER_REQUEST:
+            if topic_id in self.topics:
+                self.topics[topic_id]['announced'] = False
+
+    def get_retained(self, topic):
+        '''The last payload published or received on topic, None if there is none'''
+        return self.retained.get(topic)
+
+    def request_retained(self, commid, topic=None):
+        '''Asks the publishers to send their last value of topic (of every topic if None), call it at startup'''
+        msg = bytes([self.FTMQ_FRAME_RETAINED_REQUEST])
+        if topic is not None:
+            msg += topic.encode()
         self.ccp.send_data(commid, CCP.CCP_FTMQ_QUEUE, msg)
 
+    def retained_requested(self, frame):
+        topic = bytes(frame[1:]).decode(errors='replace')
+        for published_topic, commid in list(self.published.items()):
+            if len(frame) == 1 or published_topic == topic:
+                self.publish(commid, published_topic, self.retained[published_topic])
+
+    def request(self, commid, topic, payload, timeout, callback):
+        '''Sends a request, callback(status, payload) gets the first response or FTMQ_ERR_TIMEOUT after timeout seconds'''
+        msg = topic.encode() + self.FTMQ_SEPARATOR + payload
+        if self.FTMQ_RPC_HEADER_LEN + len(msg) > self.FTMQ_MAX_MSG:
+            raise ValueError("FTMQ request too long")
+        if len(self.pending) >= self.FTMQ_MAX_PENDING:
+            raise ValueError("too many FTMQ pending requests")
+        sequence = self.next_sequence
+        while sequence in self.pending:
+            sequence = (sequence + 1) & 0xFF
+        self.next_sequence = (sequence + 1) & 0xFF
+        header = bytes([self.FTMQ_FRAME_REQUEST]) + self.source_id.to_bytes(2, 'little') + bytes([sequence])
+        self.ccp.send_data(commid, CCP.CCP_FTMQ_QUEUE, header + msg)
+        self.pending[sequence] = dict(callback=callback, deadline=time.monotonic() + timeout)
+
+    def respond(self, commid, topic, callback):
+        '''Answers the requests to topic with the bytes returned by callback(payload)'''
+        self.responders[topic] = dict(commid=commid, callback=callback)
+
+    def request_received(self, frame):
+        (topic, sep, payload) = bytes(frame[self.FTMQ_RPC_HEADER_LEN:]).partition(self.FTMQ_SEPARATOR)
+        responder = self.responders.get(topic.decode(errors='replace'))
+        if responder is None or not sep:
+            return
+        response = responder['callback'](payload)
+        header = bytes([self.FTMQ_FRAME_RESPONSE]) + bytes(frame[1:self.FTMQ_RPC_HEADER_LEN])
+        self.ccp.send_data(responder['commid'], CCP.CCP_FTMQ_QUEUE, header + response[:self.FTMQ_MAX_MSG - self.FTMQ_RPC_HEADER_LEN])
+
+    def response_received(self, frame):
+        if len(frame) < self.FTMQ_RPC_HEADER_LEN or int.from_bytes(frame[1:3], 'little') != self.source_id:
+            return
+        pending = self.pending.pop(frame[3], None)
+        if pending is not None:
+            pending['callback'](self.FTMQ_OK, bytes(frame[self.FTMQ_RPC_HEADER_LEN:]))
+
+    def manage_requests(self):
+        '''Called from ccp.poll_1msec, expired requests get FTMQ_ERR_TIMEOUT'''
+        now = time.monotonic()
+        for sequence in [s for s, p in self.pending.items() if now >= p['deadline']]:
+            self.pending.pop(sequence)['callback'](self.FTMQ_ERR_TIMEOUT, b'')
+
+    def publish_values(self, commid, topic, values):
+        '''Publishes a dict {name : value} as a binary payload, see FTMQCodec'''
+        self.publish(commid, topic, self.codec.encode(values))
+
+    def decode_payload(self, payload):
+        '''Returns the values of a binary or JSON payload as a dict, None if it is neither'''
+        if self.codec.is_binary(payload):
+            return self.codec.decode(payload)
+        try:
+            return json.loads(payload.decode())
+        except (UnicodeError, ValueError):
+            return None
+
     def subscribe(self, commid, r_topic, r_callback):
+        if self.offload:
+            if len(self.callbacks) >= self.FTMQ_MAX_FILTERS:
+                raise ValueError("too many FTMQ subscriptions")
+            if len(self.callbacks) == 0:
+                self.ccp.send_data(commid, CCP.CCP_COMMAND_QUEUE, bytes([self.CCP_COMMAND_FTMQ_CLEAR_FILTERS]))
+            self.ccp.send_data(commid, CCP.CCP_COMMAND_QUEUE, bytes([self.CCP_COMMAND_FTMQ_SUBSCRIBE, len(self.callbacks)]) + r_topic.encode())
         self.callbacks.append(dict(topic=r_topic,callback=r_callback))
+        topic_id = self.topic_id(r_topic)
+        binding = self.bindings.setdefault(topic_id, dict(topic=r_topic, commid=commid, state='unbound', retry=0))
+        if binding['topic'] != r_topic:
+            binding['state'] = 'conflict'
         # in python host handles topic filtering
         # send subscribe to all to ftclick (empty msg)
         #self.ccp.send_data(commid, CCP.CCP_FTMQ_QUEUE, bytes())
     
+    def resubscribe(self, commid):
+        '''Sends the subscriptions again after a FTClick reset'''
+        if not self.offload:
+            return
+        self.ccp.send_data(commid, CCP.CCP_COMMAND_QUEUE, bytes([self.CCP_COMMAND_FTMQ_CLEAR_FILTERS]))
+        for index, callback in enumerate(self.callbacks):
+            self.ccp.send_data(commid, CCP.CCP_COMMAND_QUEUE, bytes([self.CCP_COMMAND_FTMQ_SUBSCRIBE, index]) + callback['topic'].encode())
+
     def check_topic(self, topic):
         # check if topic contains illegal chars
         return True
@@ -0,0 +1,138 @@
+#****************************************************************************************
+#
+#   Copyright (C) 2020 ConnectEx, Inc.
+#
+#   This program is free software : you can redistribute it and/or modify
+#   it under the terms of the GNU Lesser General Public License as published by
+#   the Free Software Foundation, either version 3 of the License.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+#   GNU Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU Lesser General Public License
+#   along with this program.If not, see <http://www.gnu.org/licenses/>.
+#
+#   As a special exception, if other files instantiate templates or
+#   use macros or inline functions from this file, or you compile
+#   this file and link it with other works to produce a work based
+#   on this file, this file does not by itself cause the resulting
+#   work to be covered by the GNU General Public License. However
+#   the source code for this file must still be made available in
+#   accordance with section (3) of the GNU General Public License.
+#
+#   This exception does not invalidate any other reasons why a work
+#   based on this file might be covered by the GNU General Public
+#   License.
+#
+#   For more information: info@connect-ex.com
+#
+#   For access to source code :
+#
+#       info@connect-ex.com
+#           or
+#       github.com/ConnectEx/BACnet-Dev-Kit
+#
+#***************************************************************************************
+
+
+import struct
+
+class FTMQCodec:
+    '''
+    Compact binary payloads, the same format as ftmq_codec.c
+    | MARKER | key | value | key | value | ...
+    key = tag << 3 | type, values are little endian
+    The schema maps field names to tags, so decoded payloads look like the JSON ones
+    '''
+    MARKER = 0xB1
+
+    TYPE_UINT8 = 0
+    TYPE_INT8 = 1
+    TYPE_UINT16 = 2
+    TYPE_INT16 = 3
+    TYPE_INT32 = 4
+    TYPE_FLOAT = 5
+    TYPE_BYTES = 6
+    TYPE_UINT32 = 7
+
+    TYPE_FORMATS = { TYPE_UINT8 : '<B',
+                     TYPE_INT8 : '<b',
+                     TYPE_UINT16 : '<H',
+                     TYPE_INT16 : '<h',
+                     TYPE_INT32 : '<i',
+                     TYPE_FLOAT : '<f',
+                     TYPE_UINT32 : '<I' }
+
+    TYPE_NAMES = { 'uint8' : TYPE_UINT8,
+                   'int8' : TYPE_INT8,
+                   'uint16' : TYPE_UINT16,
+                   'int16' : TYPE_INT16,
+                   'int32' : TYPE_INT32,
+                   'float' : TYPE_FLOAT,
+                   'bytes' : TYPE_BYTES,
+                   'uint32' : TYPE_UINT32 }
+
+    MAX_TAG = 31
+
+    # well known tags, same as FTMQ_TAG_xxx in ftmq_codec.h
+    DEFAULT_SCHEMA = { 'value' : (0, 'float'),
+                       'temperature' : (1, 'float'),
+                       'humidity' : (2, 'float'),
+                       'pressure' : (3, 'float'),
+                       'AQI' : (4, 'float'),
+                       'led' : (5, 'bytes'),
+                       'button' : (6, 'uint8'),
+                       'min' : (7, 'float'),
+                       'max' : (8, 'float'),
+                       'mean' : (9, 'float'),
+                       'count' : (10, 'uint16') }
+
+    def __init__(self, schema=None):
+        self.schema = dict(self.DEFAULT_SCHEMA)
+        if schema:
+            self.schema.update(schema)
+        self.names = {tag : name for name, (tag, type_name) in self.schema.items()}
+
+    @classmethod
+    def is_binary(cls, payload):
+        return len(payload) > 0 and payload[0] == cls.MARKER
+
+    def encode(self, values):
+        '''Encodes a dict {name : value} using the schema tags and types'''
+        out = bytearray([self.MARKER])
+        for name, value in values.items():
+            (tag, type_name) = self.schema[name]
+            value_type = self.TYPE_NAMES[type_name]
+            out.append((tag << 3) | value_type)
+            if value_type == self.TYPE_BYTES:
+                data = bytes(value)
+                out.append(len(data))
+                out += data
+            else:
+                out += struct.pack(self.TYPE_FORMATS[value_type], value)
+        return bytes(out)
+
+    def decode(self, payload):
+        '''Returns a dict {name : value}, tags missing in the schema are named by number'''
+        values = {}
+        pos = 1
+        while pos < len(payload):
+            key = payload[pos]
+            pos += 1
+            (tag, value_type) = (key >> 3, key & 0x07)
+            if value_type == self.TYPE_BYTES:
+                if pos >= len(payload):
+                    break
+                length = payload[pos]
+                pos += 1
+                value = list(payload[pos:pos + length])
+            else:
+                length = struct.calcsize(self.TYPE_FORMATS[value_type])
+                if pos + length > len(payload):
+                    break
+                [value] = struct.unpack(self.TYPE_FORMATS[value_type], payload[pos:pos + length])
+            pos += length
+            values[self.names.get(tag, str(tag))] = value
+        return values
@@ -56,7 +56,8 @@ def temp(topic, payload):
     print(topic)
     print("Payload:", end= " ")
     #print(struct.unpack('<f', payload)[0])
-    print(payload.decode())
+    # the sensor nodes may publish JSON text or binary (ftmq_codec) payloads
+    print(ftmq.decode_payload(payload))
 
 
 if __name__ == "__main__":
@@ -0,0 +1,204 @@
+#****************************************************************************************
+#
+#   Copyright (C) 2020 ConnectEx, Inc.
+#
+#   This program is free software : you can redistribute it and/or modify
+#   it under the terms of the GNU Lesser General Public License as published by
+#   the Free Software Foundation, either version 3 of the License.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+#   GNU Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU Lesser General Public License
+#   along with this program.If not, see <http://www.gnu.org/licenses/>.
+#
+#   As a special exception, if other files instantiate templates or
+#   use macros or inline functions from this file, or you compile
+#   this file and link it with other works to produce a work based
+#   on this file, this file does not by itself cause the resulting
+#   work to be covered by the GNU General Public License. However
+#   the source code for this file must still be made available in
+#   accordance with section (3) of the GNU General Public License.
+#
+#   This exception does not invalidate any other reasons why a work
+#   based on this file might be covered by the GNU General Public
+#   License.
+#
+#   For more information: info@connect-ex.com
+#
+#   For access to source code :
+#
+#       info@connect-ex.com
+#           or
+#       github.com/ConnectEx/BACnet-Dev-Kit
+#
+#***************************************************************************************
+
+"""FTMQ topic table.
+Generates the build-time topic table of a firmware: a minimal perfect hash of its topics,
+so ftmq.c finds the subscription of a received topic with one hash and one compare.
+
+Usage:     ftmq_topic_table.py <topics> [-o <dir>]
+
+Arguments:
+    <topics>            text file, one topic per line, optionally followed by the callback to call
+                        (topics without a callback can only be looked up with FTMQ_sub_lookup)
+                        empty lines and lines starting with # are skipped
+
+Options:
+    -o <dir>            where ftmq_topics.h and ftmq_topics.c are written [default: .]
+
+Include ftmq_topics.h from ftmq_config.h and build ftmq_topics.c with the firmware.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+MIX = 2654435761
+MAX_TOPICS = 254 # FTMQ_NO_STATIC_TOPIC is 0xFF
+MAX_SEED = 0xFFFF
+RESERVED = ('FTMQ_TOPIC_ID', 'FTMQ_TOPIC_ID_HEADER_LEN', 'FTMQ_TOPIC_LEVEL_SEPARATOR') # macros of ftmq.h and ftmq.c
+
+
+def topic_hash(topic):
+    '''FNV-1a, the same as hash_topic in ftmq.c'''
+    h = FNV_OFFSET
+    for b in topic.encode():
+        h = ((h ^ b) * FNV_PRIME) & 0xFFFFFFFF
+    return h
+
+
+def topic_id(h):
+    '''Same as fold_topic_id in ftmq.c'''
+    return (h ^ (h >> 16)) & 0xFFFF
+
+
+def slot(h, seed, size):
+    '''Same as find_static_topic in ftmq.c'''
+    return ((((h ^ seed) * MIX) & 0xFFFFFFFF) >> 16) % size
+
+
+def build(topics):
+    '''Hash and displace: returns (seeds, table), table[slot] is the index in topics'''
+    n = len(topics)
+    hashes = [topic_hash(t) for t in topics]
+    for buckets_count in range(max(1, n // 2), n + 1):
+        buckets = [[] for _ in range(buckets_count)]
+        for i, h in enumerate(hashes):
+            buckets[h % buckets_count].append(i)
+        seeds = [0] * buckets_count
+        table = [None] * n
+        # the biggest buckets are placed first, while most slots are free
+        for b in sorted(range(buckets_count), key=lambda b: -len(buckets[b])):
+            if not buckets[b]:
+                continue
+            for seed in range(MAX_SEED + 1):
+                slots = [slot(hashes[i], seed, n) for i in buckets[b]]
+                if len(set(slots)) == len(slots) and all(table[s] is None for s in slots):
+                    break
+            else:
+                break # no seed fits this bucket, try with more buckets
+            seeds[b] = seed
+            for i, s in zip(buckets[b], slots):
+                table[s] = i
+        else:
+            return (seeds, table)
+    raise ValueError("no perfect hash found for these topics")
+
+
+def macro_name(topic):
+    return 'FTMQ_TOPIC_' + re.sub('[^A-Za-z0-9]', '_', topic).upper()
+
+
+def read_topics(path):
+    entries = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line or line.startswith('#'):
+                continue
+            fields = line.split()
+            entries.append((fields[0], fields[1] if len(fields) > 1 else None))
+    return entries
+
+
+def check(entries):
+    topics = [t for t, cb in entries]
+    if not topics:
+        raise ValueError("no topics")
+    if len(topics) > MAX_TOPICS:
+        raise ValueError("more than %d topics" % MAX_TOPICS)
+    if len(set(topics)) != len(topics):
+        raise ValueError("duplicated topic")
+    names = [macro_name(t) for t in topics]
+    if len(set(names)) != len(names):
+        raise ValueError("two topics have the same FTMQ_TOPIC_ name")
+    for t, name in zip(topics, names):
+        if name in RESERVED:
+            raise ValueError("%s is reserved by ftmq, rename the topic: %s" % (name, t))
+    ids = [topic_id(topic_hash(t)) for t in topics]
+    if len(set(ids)) != len(ids):
+        raise ValueError("two topics have the same topic id")
+    for t in topics:
+        if '+' in t or '#' in t:
+            raise ValueError("wildcards can't be in the table: " + t)
+        if len(t.encode()) >= 49:
+            raise ValueError("topic too long: " + t)
+
+
+def generate(entries, source):
+    (seeds, table) = build([t for t, cb in entries])
+    ordered = [entries[i] for i in table]
+    header = "// generated by utilities/ftmq_topic_table.py from %s, do not edit\n" % os.path.basename(source)
+
+    h = [header,
+         "#ifndef FTMQ_TOPICS_H",
+         "#define FTMQ_TOPICS_H",
+         "",
+         "#define FTMQ_STATIC_TOPICS %d" % len(table),
+         "#define FTMQ_STATIC_BUCKETS %d" % len(seeds),
+         "",
+         "// FTMQ_sub_lookup results"]
+    h += ["#define %s %d" % (macro_name(t), index) for index, (t, cb) in enumerate(ordered)]
+    h += ["", "#endif", ""]
+
+    c = [header,
+         '#include "ftmq_config.h"',
+         '#include "ftmq.h"',
+         ""]
+    callbacks = sorted(set(cb for t, cb in entries if cb))
+    c += ["void %s(uint8_t *payload, uint16_t payload_length);" % cb for cb in callbacks]
+    if callbacks:
+        c.append("")
+    c.append("const uint16_t FTMQ_static_seeds[FTMQ_STATIC_BUCKETS] = { %s };" % ", ".join(str(s) for s in seeds))
+    c.append("")
+    c.append("const FTMQ_static_topic FTMQ_static_topics[FTMQ_STATIC_TOPICS] = {")
+    for t, cb in ordered:
+        c.append('    { "%s", 0x%08XUL, %d, %s },' % (t, topic_hash(t), len(t.encode()), cb if cb else "0"))
+    c += ["};", ""]
+    return ("\n".join(h), "\n".join(c))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('topics', help="text file, one topic per line, optionally followed by the callback")
+    parser.add_argument('-o', dest='dir', default='.', help="where ftmq_topics.h and ftmq_topics.c are written")
+    args = parser.parse_args()
+    try:
+        entries = read_topics(args.topics)
+        check(entries)
+        (h, c) = generate(entries, args.topics)
+    except ValueError as e:
+        print("ftmq_topic_table:", e)
+        sys.exit(1)
+    with open(os.path.join(args.dir, 'ftmq_topics.h'), 'w') as f:
+        f.write(h)
+    with open(os.path.join(args.dir, 'ftmq_topics.c'), 'w') as f:
+        f.write(c)
+    print("%d topics written to %s" % (len(entries), args.dir))
@@ -0,0 +1,258 @@
+#****************************************************************************************
+#
+#   Copyright (C) 2020 ConnectEx, Inc.
+#
+#   This program is free software : you can redistribute it and/or modify
+#   it under the terms of the GNU Lesser General Public License as published by
+#   the Free Software Foundation, either version 3 of the License.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+#   GNU Lesser General Public License for more details.
+#
+#   You should have received a copy of the GNU Lesser General Public License
+#   along with this program.If not, see <http://www.gnu.org/licenses/>.
+#
+#   As a special exception, if other files instantiate templates or
+#   use macros or inline functions from this file, or you compile
+#   this file and link it with other works to produce a work based
+#   on this file, this file does not by itself cause the resulting
+#   work to be covered by the GNU General Public License. However
+#   the source code for this file must still be made available in
+#   accordance with section (3) of the GNU General Public License.
+#
+#   This exception does not invalidate any other reasons why a work
+#   based on this file might be covered by the GNU General Public
+#   License.
+#
+#   For more information: info@connect-ex.com
+#
+#   For access to source code :
+#
+#       info@connect-ex.com
+#           or
+#       github.com/ConnectEx/BACnet-Dev-Kit
+#
+#***************************************************************************************
+
+"""ShortStack link-layer trace.
+Decodes the binary records of LdvTrace.c (LDV_TRACE in LdvSci.h): a timeline of the
+frames and of the RTS/CTS/HRDY handshake, and the latency of each command.
+
+Usage:     ldv_trace.py <port> [-o <file>]
+           ldv_trace.py -i <file>
+
+Arguments:
+    <port>              serial port of the CCP link, the firmware sends the trace packets
+                        to CCP_DEBUG_QUEUE with LdvTraceDrain (Ctrl-C to stop)
+
+Options:
+    -o <file>           also save the raw trace packets, to decode them later with -i
+    -i <file>           decode a saved trace instead of reading the port
+    -q                  statistics only, no timeline
+
+TX latency is from the RTS assertion to the end of the frame, RX latency from the
+length byte to the end of the frame.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+MAGIC = b'LT'
+VERSION = 1
+HEADER = struct.Struct('<2sBBIH')
+RECORD = struct.Struct('<IBBBB8s')
+CCP_DEBUG_QUEUE = 2
+
+EVENT_RX = 1
+EVENT_TX = 2
+EVENT_RX_START = 3
+EVENT_RX_DROP = 4
+EVENT_CTS = 5
+EVENT_RTS = 6
+EVENT_HRDY = 7
+EVENT_RESET = 8
+EVENT_RX_TIMEOUT = 9
+
+EVENT_NAMES = { EVENT_RX : 'RX',
+                EVENT_TX : 'TX',
+                EVENT_RX_START : 'RX start',
+                EVENT_RX_DROP : 'RX drop',
+                EVENT_CTS : 'CTS',
+                EVENT_RTS : 'RTS',
+                EVENT_HRDY : 'HRDY',
+                EVENT_RESET : 'reset',
+                EVENT_RX_TIMEOUT : 'RX timeout' }
+
+# same order as LdvTxStates and LdvRxStates in LdvSci.h
+TX_STATES = ['Idle', 'Cmd', 'HandShake', 'Info_1', 'Info_2', 'Payload', 'Done']
+RX_STATES = ['Idle', 'Payload', 'Ignore']
+
+
+def command_name(command):
+    '''Names of the LonSmipCmd values (ShortStackTypes.h), by their upper nibble for the queued ones'''
+    names = { 0x10 : 'Comm', 0x20 : 'NetMgmt', 0x40 : 'Phase' }
+    fixed = { 0x00 : 'Null', 0x06 : 'Service', 0x08 : 'AppInit', 0x0A : 'SiData', 0x0B : 'NvInit',
+              0x0D : 'Usop', 0x50 : 'Reset', 0x60 : 'Flush', 0x70 : 'OnLine', 0x80 : 'OffLine',
+              0x90 : 'Flush', 0xA0 : 'FlushIgnore' }
+    if command in fixed:
+        return fixed[command]
+    if command & 0xF0 in names:
+        return '%s/%X' % (names[command & 0xF0], command & 0x0F)
+    return '0x%02X' % command
+
+
+def state_name(state):
+    tx = state & 0x07
+    rx = (state >> 3) & 0x03
+    return '%s/%s%s' % (TX_STATES[tx] if tx < len(TX_STATES) else tx,
+                        RX_STATES[rx] if rx < len(RX_STATES) else rx,
+                        '' if state & 0x80 else ' sleep')
+
+
+def details(event, length, command, data):
+    if event in (EVENT_RX, EVENT_TX):
+        shown = data[:min(length, len(data))]
+        return '%-12s len %-3d %s%s' % (command_name(command), length, shown.hex(' '),
+                                         ' ...' if length > len(data) else '')
+    if event in (EVENT_CTS, EVENT_RTS, EVENT_HRDY):
+        return 'asserted' if length else 'deasserted'
+    if event in (EVENT_RX_START, EVENT_RX_DROP):
+        return 'len %d' % length
+    if event == EVENT_RX_TIMEOUT:
+        return 'rx state %s' % (RX_STATES[length] if length < len(RX_STATES) else length)
+    return ''
+
+
+class Stats:
+    def __init__(self):
+        self.latencies = {}
+
+    def add(self, direction, command, micros):
+        self.latencies.setdefault((direction, command), []).append(micros)
+
+    def print(self):
+        print()
+        print('%-4s %-12s %7s %10s %10s %10s' % ('', 'command', 'count', 'min us', 'mean us', 'max us'))
+        for (direction, command), values in sorted(self.latencies.items()):
+            print('%-4s %-12s %7d %10.1f %10.1f %10.1f' % (direction, command_name(command), len(values),
+                  min(values), sum(values) / len(values), max(values)))
+
+
+class Decoder:
+    def __init__(self, timeline=True):
+        self.timeline = timeline
+        self.stats = Stats()
+        self.high = 0           # timestamps are 32 bit, unwrapped here
+        self.last_raw = None
+        self.first = None
+        self.last = None
+        self.rts_time = None
+        self.rx_start = None
+        self.lost = 0
+        self.records = 0
+
+    def packet(self, payload):
+        payload = bytes(payload)
+        if len(payload) < HEADER.size:
+            return
+        (magic, version, size, hz, lost) = HEADER.unpack_from(payload)
+        if magic != MAGIC or version != VERSION or size != RECORD.size or hz == 0:
+            print('ldv_trace: not a trace packet')
+            return
+        if lost:
+            self.lost += lost
+            if self.timeline:
+                print('--- %d records lost' % lost)
+            # the latencies in progress are unknown
+            self.rts_time = None
+            self.rx_start = None
+        for offset in range(HEADER.size, len(payload) - RECORD.size + 1, RECORD.size):
+            self.record(hz, *RECORD.unpack_from(payload, offset))
+
+    def record(self, hz, timestamp, event, state, length, command, data):
+        if self.last_raw is not None and timestamp < self.last_raw:
+            self.high += 1 << 32
+        self.last_raw = timestamp
+        micros = (self.high + timestamp) * 1e6 / hz
+        if self.first is None:
+            self.first = micros
+            self.last = micros
+        self.records += 1
+
+        if event == EVENT_RTS and length and self.rts_time is None:
+            self.rts_time = micros
+        elif event == EVENT_TX and self.rts_time is not None:
+            self.stats.add('TX', command, micros - self.rts_time)
+            self.rts_time = None
+        elif event == EVENT_RX_START:
+            self.rx_start = micros
+        elif event == EVENT_RX and self.rx_start is not None:
+            self.stats.add('RX', command, micros - self.rx_start)
+            self.rx_start = None
+        elif event in (EVENT_RESET, EVENT_RX_TIMEOUT):
+            self.rts_time = None
+            self.rx_start = None
+
+        if self.timeline:
+            print('%12.1f %+10.1f  %-10s %-17s %s' % (micros - self.first, micros - self.last,
+                  EVENT_NAMES.get(event, str(event)), state_name(state), details(event, length, command, data)))
+        self.last = micros
+
+    def summary(self):
+        self.stats.print()
+        print()
+        print('%d records, %d lost' % (self.records, self.lost))
+
+
+def read_file(path, decoder):
+    with open(path, 'rb') as f:
+        while True:
+            length = f.read(2)
+            if len(length) < 2:
+                break
+            decoder.packet(f.read(struct.unpack('<H', length)[0]))
+
+
+def capture(port, decoder, path):
+    from ccp import CCP, SerialComm
+    out = open(path, 'wb') if path else None
+
+    def received(payload):
+        if out:
+            out.write(struct.pack('<H', len(payload)) + bytes(payload))
+        decoder.packet(payload)
+
+    ccp = CCP()
+    ccp.register_comm(SerialComm(port))
+    ccp.register_callback(CCP_DEBUG_QUEUE, received)
+    try:
+        while True:
+            ccp.poll_1msec()
+            time.sleep(0.001)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if out:
+            out.close()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('port', nargs='?', help="serial port of the CCP link")
+    parser.add_argument('-o', dest='output', help="file the raw trace packets are saved to")
+    parser.add_argument('-i', dest='input', help="saved trace to decode")
+    parser.add_argument('-q', dest='quiet', action='store_true', help="statistics only")
+    args = parser.parse_args()
+    if bool(args.port) == bool(args.input):
+        parser.print_usage()
+        sys.exit(1)
+    decoder = Decoder(not args.quiet)
+    if args.input:
+        read_file(args.input, decoder)
+    else:
+        capture(args.port, decoder, args.output)
+    decoder.summary()